@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+#include <memory.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* threads for render and index jobs, which someone may be waiting for */
+#define JOBS_FOREGROUND_THREADS   2
+
+/* niceness of background threads if SCHED_IDLE is not available */
+#define JOBS_BACKGROUND_NICE      19
+
+/* compress jobs wait this long after the last input event */
+#define JOBS_INPUT_PAUSE_US       (300 * 1000)
+
+enum {
+    JOB_STATE_QUEUED = 0,
+    JOB_STATE_RUNNING,
+    JOB_STATE_DONE
+};
+
+struct _JobToken {
+    gint ref_count;
+    gint cancelled;
+};
+
+struct _Job {
+    gint ref_count;
+    JobPriority priority;
+    guint generation;
+    JobToken *token;
+    JobFunc func;
+    gpointer data;
+    GDestroyNotify destroy;
+    /* protected by the scheduler lock */
+    int state;
+};
+
+struct _JobScheduler {
+    GMutex lock;
+    /* signalled when a job is queued or on shutdown */
+    GCond work_cond;
+    /* signalled when a job is done */
+    GCond done_cond;
+    GQueue queues[JOB_N_PRIORITIES];
+    GThread **threads;
+    unsigned int thread_count;
+    gint generation;
+    gint shutdown;
+    /* monotonic time of the last input event */
+    gssize last_input;
+    /* CPU time used by background threads in microseconds */
+    gsize cpu_time;
+    gsize cpu_time_sampled;
+    gint64 sample_time;
+    /* background threads stay off the first CPU if reserve_ui_core is set */
+    cpu_set_t background_cpus;
+    int restrict_cpus;
+} _jobs;
+
+/* set in threads that only run bulk work */
+static GPrivate _jobs_background = G_PRIVATE_INIT(NULL);
+
+gpointer _jobs_thread_proc(gpointer background);
+Job *_jobs_pop(gboolean background, gint64 *wait_until);
+void _jobs_run(Job *job);
+gint64 _jobs_thread_cpu_time(void);
+
+/* threads is the number of background threads, 0 to leave one CPU for the UI */
+int jobs_init(unsigned int threads, int reserve_ui_core)
+{
+    unsigned int i, cpu;
+    memset(&_jobs, 0, sizeof(struct _JobScheduler));
+
+    g_mutex_init(&_jobs.lock);
+    g_cond_init(&_jobs.work_cond);
+    g_cond_init(&_jobs.done_cond);
+    for (i = 0; i < JOB_N_PRIORITIES; i++)
+        g_queue_init(&_jobs.queues[i]);
+
+    if (threads == 0)
+        threads = MAX(g_get_num_processors() - 1, 1);
+
+    if (reserve_ui_core && sched_getaffinity(0, sizeof(cpu_set_t), &_jobs.background_cpus) == 0 &&
+            CPU_COUNT(&_jobs.background_cpus) > 1) {
+        for (cpu = 0; !CPU_ISSET(cpu, &_jobs.background_cpus); cpu++);
+        CPU_CLR(cpu, &_jobs.background_cpus);
+        _jobs.restrict_cpus = 1;
+    }
+
+    _jobs.sample_time = g_get_monotonic_time();
+
+    _jobs.threads = g_malloc0(sizeof(GThread *) * (threads + JOBS_FOREGROUND_THREADS));
+    for (i = 0; i < JOBS_FOREGROUND_THREADS; i++)
+        _jobs.threads[i] = g_thread_new("Jobs", _jobs_thread_proc, GINT_TO_POINTER(FALSE));
+    for (i = 0; i < threads; i++)
+        _jobs.threads[JOBS_FOREGROUND_THREADS + i] = g_thread_new("JobsBackground", _jobs_thread_proc, GINT_TO_POINTER(TRUE));
+    _jobs.thread_count = threads + JOBS_FOREGROUND_THREADS;
+
+    return 0;
+}
+
+/* Move the calling thread out of the way of the UI: lowest scheduling
+ * class and, if requested, off the CPU left for the UI. */
+void jobs_setup_background_thread(void)
+{
+    struct sched_param param;
+
+    if (g_private_get(&_jobs_background))
+        return;
+    g_private_set(&_jobs_background, GINT_TO_POINTER(1));
+
+    memset(&param, 0, sizeof(struct sched_param));
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), JOBS_BACKGROUND_NICE);
+
+    if (_jobs.restrict_cpus)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &_jobs.background_cpus);
+}
+
+gboolean jobs_in_background_thread(void)
+{
+    return g_private_get(&_jobs_background) != NULL;
+}
+
+/* called from input handlers to hold back bulk work for a moment */
+void jobs_input_activity(void)
+{
+    g_atomic_pointer_set(&_jobs.last_input, (gssize)g_get_monotonic_time());
+}
+
+/* share of one CPU used by background threads since the last call */
+double jobs_get_cpu_share(void)
+{
+    gint64 now = g_get_monotonic_time();
+    gsize cpu_time = (gsize)g_atomic_pointer_get(&_jobs.cpu_time);
+    double share = 0.0;
+
+    if (now > _jobs.sample_time)
+        share = ((double)(cpu_time - _jobs.cpu_time_sampled)) / (now - _jobs.sample_time);
+    _jobs.cpu_time_sampled = cpu_time;
+    _jobs.sample_time = now;
+
+    return share;
+}
+
+/* cancel everything, drop what did not start yet and wait for the rest */
+void jobs_cleanup(void)
+{
+    GList *dropped = NULL, *tmp;
+    Job *job;
+    unsigned int i;
+
+    g_mutex_lock(&_jobs.lock);
+    g_atomic_int_set(&_jobs.shutdown, 1);
+    for (i = 0; i < JOB_N_PRIORITIES; i++) {
+        while ((job = g_queue_pop_head(&_jobs.queues[i])) != NULL) {
+            job->state = JOB_STATE_DONE;
+            dropped = g_list_prepend(dropped, job);
+        }
+    }
+    g_cond_broadcast(&_jobs.work_cond);
+    g_cond_broadcast(&_jobs.done_cond);
+    g_mutex_unlock(&_jobs.lock);
+
+    for (tmp = dropped; tmp; tmp = tmp->next) {
+        job = (Job *)tmp->data;
+        if (job->destroy)
+            job->destroy(job->data);
+        job->data = NULL;
+        job_unref(job);
+    }
+    g_list_free(dropped);
+
+    for (i = 0; i < _jobs.thread_count; i++)
+        g_thread_join(_jobs.threads[i]);
+    g_free(_jobs.threads);
+    _jobs.threads = NULL;
+    _jobs.thread_count = 0;
+
+    g_cond_clear(&_jobs.work_cond);
+    g_cond_clear(&_jobs.done_cond);
+    g_mutex_clear(&_jobs.lock);
+}
+
+void jobs_set_generation(guint generation)
+{
+    g_atomic_int_set(&_jobs.generation, (gint)generation);
+}
+
+JobToken *job_token_new(void)
+{
+    JobToken *token = g_malloc0(sizeof(JobToken));
+    token->ref_count = 1;
+    return token;
+}
+
+JobToken *job_token_ref(JobToken *token)
+{
+    if (token)
+        g_atomic_int_inc(&token->ref_count);
+    return token;
+}
+
+void job_token_unref(JobToken *token)
+{
+    if (token && g_atomic_int_dec_and_test(&token->ref_count))
+        g_free(token);
+}
+
+void job_token_cancel(JobToken *token)
+{
+    if (token)
+        g_atomic_int_set(&token->cancelled, 1);
+}
+
+Job *jobs_submit(JobPriority priority, guint generation, JobToken *token,
+                 JobFunc func, gpointer data, GDestroyNotify destroy)
+{
+    Job *job = g_malloc0(sizeof(Job));
+
+    /* one reference for the caller, one for the queue */
+    job->ref_count = 2;
+    job->priority = CLAMP(priority, 0, JOB_N_PRIORITIES - 1);
+    job->generation = generation;
+    job->token = job_token_ref(token);
+    job->func = func;
+    job->data = data;
+    job->destroy = destroy;
+
+    g_mutex_lock(&_jobs.lock);
+    if (g_atomic_int_get(&_jobs.shutdown) || _jobs.thread_count == 0) {
+        job->state = JOB_STATE_DONE;
+        g_mutex_unlock(&_jobs.lock);
+        if (job->destroy)
+            job->destroy(job->data);
+        job->data = NULL;
+        job_unref(job);
+        return job;
+    }
+    job->state = JOB_STATE_QUEUED;
+    g_queue_push_tail(&_jobs.queues[job->priority], job);
+    /* not every thread takes every priority */
+    g_cond_broadcast(&_jobs.work_cond);
+    g_mutex_unlock(&_jobs.lock);
+
+    return job;
+}
+
+gboolean job_is_cancelled(Job *job)
+{
+    guint generation;
+    if (job == NULL)
+        return TRUE;
+    if (g_atomic_int_get(&_jobs.shutdown))
+        return TRUE;
+    if (job->token && g_atomic_int_get(&job->token->cancelled))
+        return TRUE;
+    generation = (guint)g_atomic_int_get(&_jobs.generation);
+    if (job->generation && job->generation != generation)
+        return TRUE;
+    return FALSE;
+}
+
+/* If no thread picked up the job yet, run it in the calling thread. This is
+ * what a job waiting for another job has to do, or the pool could run out
+ * of threads. */
+gboolean job_run_if_queued(Job *job)
+{
+    if (job == NULL)
+        return FALSE;
+
+    g_mutex_lock(&_jobs.lock);
+    if (job->state != JOB_STATE_QUEUED) {
+        g_mutex_unlock(&_jobs.lock);
+        return FALSE;
+    }
+    g_queue_remove(&_jobs.queues[job->priority], job);
+    job->state = JOB_STATE_RUNNING;
+    g_mutex_unlock(&_jobs.lock);
+
+    _jobs_run(job);
+    return TRUE;
+}
+
+void job_wait(Job *job)
+{
+    if (job == NULL || job_run_if_queued(job))
+        return;
+
+    g_mutex_lock(&_jobs.lock);
+    while (job->state != JOB_STATE_DONE)
+        g_cond_wait(&_jobs.done_cond, &_jobs.lock);
+    g_mutex_unlock(&_jobs.lock);
+}
+
+void job_unref(Job *job)
+{
+    if (job == NULL || !g_atomic_int_dec_and_test(&job->ref_count))
+        return;
+    job_token_unref(job->token);
+    g_free(job);
+}
+
+/* Scheduler lock has to be held. Foreground threads only take render and
+ * index jobs, background threads everything else. If only compress jobs
+ * are waiting while input is coming in, wait_until is set to when they
+ * may run. */
+Job *_jobs_pop(gboolean background, gint64 *wait_until)
+{
+    unsigned int i;
+    gint64 resume;
+    for (i = background ? JOB_PRIORITY_THUMBNAIL : 0;
+            i < (background ? JOB_N_PRIORITIES : JOB_PRIORITY_THUMBNAIL); i++) {
+        if (g_queue_is_empty(&_jobs.queues[i]))
+            continue;
+        if (i == JOB_PRIORITY_COMPRESS) {
+            resume = (gint64)(gssize)g_atomic_pointer_get(&_jobs.last_input) + JOBS_INPUT_PAUSE_US;
+            if (g_get_monotonic_time() < resume) {
+                *wait_until = resume;
+                continue;
+            }
+        }
+        return g_queue_pop_head(&_jobs.queues[i]);
+    }
+    return NULL;
+}
+
+gint64 _jobs_thread_cpu_time(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* runs a job in state RUNNING and drops the queue reference */
+void _jobs_run(Job *job)
+{
+    gint64 cpu_start = 0;
+    gboolean background = jobs_in_background_thread();
+
+    if (background)
+        cpu_start = _jobs_thread_cpu_time();
+    if (!job_is_cancelled(job))
+        job->func(job, job->data);
+    if (background)
+        g_atomic_pointer_add(&_jobs.cpu_time, (gssize)(_jobs_thread_cpu_time() - cpu_start));
+    if (job->destroy)
+        job->destroy(job->data);
+    job->data = NULL;
+
+    g_mutex_lock(&_jobs.lock);
+    job->state = JOB_STATE_DONE;
+    g_cond_broadcast(&_jobs.done_cond);
+    g_mutex_unlock(&_jobs.lock);
+
+    job_unref(job);
+}
+
+gpointer _jobs_thread_proc(gpointer background)
+{
+    Job *job = NULL;
+    gint64 wait_until;
+
+    if (GPOINTER_TO_INT(background))
+        jobs_setup_background_thread();
+
+    while (1) {
+        g_mutex_lock(&_jobs.lock);
+        while (!g_atomic_int_get(&_jobs.shutdown)) {
+            wait_until = 0;
+            if ((job = _jobs_pop(GPOINTER_TO_INT(background), &wait_until)) != NULL)
+                break;
+            if (wait_until)
+                g_cond_wait_until(&_jobs.work_cond, &_jobs.lock, wait_until);
+            else
+                g_cond_wait(&_jobs.work_cond, &_jobs.lock);
+        }
+        if (g_atomic_int_get(&_jobs.shutdown)) {
+            g_mutex_unlock(&_jobs.lock);
+            break;
+        }
+        job->state = JOB_STATE_RUNNING;
+        g_mutex_unlock(&_jobs.lock);
+
+        _jobs_run(job);
+    }
+    return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <glib.h>
+
+/* lower values run first */
+typedef enum {
+    JOB_PRIORITY_RENDER = 0,
+    JOB_PRIORITY_INDEX,
+    JOB_PRIORITY_THUMBNAIL,
+    JOB_PRIORITY_COMPRESS,
+    JOB_N_PRIORITIES
+} JobPriority;
+
+typedef struct _JobToken JobToken;
+typedef struct _Job Job;
+
+/* long running jobs should check job_is_cancelled() regularly */
+typedef void (*JobFunc)(Job *job, gpointer data);
+
+int jobs_init(unsigned int threads, int reserve_ui_core);
+void jobs_cleanup(void);
+
+void jobs_setup_background_thread(void);
+gboolean jobs_in_background_thread(void);
+void jobs_input_activity(void);
+double jobs_get_cpu_share(void);
+
+/* jobs submitted for an older (non-zero) generation are cancelled */
+void jobs_set_generation(guint generation);
+
+JobToken *job_token_new(void);
+JobToken *job_token_ref(JobToken *token);
+void job_token_unref(JobToken *token);
+void job_token_cancel(JobToken *token);
+
+/* destroy is called on data exactly once, whether func ran or not;
+ * the returned job has to be released with job_unref() */
+Job *jobs_submit(JobPriority priority, guint generation, JobToken *token,
+                 JobFunc func, gpointer data, GDestroyNotify destroy);
+gboolean job_is_cancelled(Job *job);
+gboolean job_run_if_queued(Job *job);
+void job_wait(Job *job);
+void job_unref(Job *job);
+
+#endif
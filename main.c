@@ -5,10 +5,42 @@
 #include <memory.h>
 #include "page-cache.h"
 #include "page-overview.h"
+#include "transition.h"
+#include "overlay.h"
 #include "presentation.h"
+#include "render-worker.h"
+#include "jobs.h"
+#include "power.h"
+#include "pressure.h"
 #include "utils.h"
 #include <time.h>
 
+/* time the file has to be quiet before it is reloaded */
+#define MAIN_RELOAD_DEBOUNCE_MS 500
+
+/* the console clock only shows minutes when saving power */
+#define MAIN_POWER_SAVING_UPDATE_SECONDS 60
+
+/* the pointer is hidden when it did not move for this long */
+#define MAIN_HIDE_CURSOR_MS 3000
+
+/* page changes closer together than this show thumbnails until navigation stops */
+#define MAIN_NAVIGATION_SETTLE_MS 150
+
+/* results shown in search mode, retry interval while the text is indexed */
+#define MAIN_SEARCH_MAX_RESULTS 200
+#define MAIN_SEARCH_RETRY_MS 250
+
+/* a resize is over when the size did not change for this long */
+#define MAIN_RESIZE_SETTLE_MS 200
+
+/* strip at the bottom of the console holding clock and status, below the slide */
+#define MAIN_STATUS_HEIGHT 40
+#define MAIN_STATUS_FONT_SIZE 24
+
+/* pre-scaled copies per window: the page shown and both of its neighbours */
+#define MAIN_SCALED_SLOTS 3
+
 static gboolean _key_press_event(GtkWidget *widget, GdkEventKey *event, gpointer data);
 static gboolean _configure_event(GtkWidget *widget, GdkEventConfigure *event, gpointer data);
 static gboolean _draw_event(GtkWidget *widget, cairo_t *cr, gpointer data);
@@ -20,10 +52,23 @@ static gboolean _window_state_event(GtkWidget *widget, GdkEventWindowState *even
 static void _window_realize(GtkWidget *widget, gpointer data);
 
 void render_window(unsigned int id, cairo_t *cr);
-static void render_presentation_window(cairo_t *cr, int width, int height);
-static void render_console_window(cairo_t *cr, int width, int height);
-static void render_overview_window(cairo_t *cr, int width, int height);
+static void render_presentation_window(unsigned int id, cairo_t *cr, int width, int height);
+static void render_console_window(unsigned int id, cairo_t *cr, int width, int height);
+static void render_overview_window(unsigned int id, cairo_t *cr, int width, int height);
+static void render_search_window(unsigned int id, cairo_t *cr, int width, int height);
 void main_recalc_window_page_display(void);
+void main_render_page_filter(cairo_t *cr, int index, int width, int height, int show_part, gboolean do_center,
+                             unsigned int force_notes, unsigned int show_preview, cairo_filter_t filter);
+void main_render_surface(cairo_t *cr, cairo_surface_t *surface, unsigned int w, unsigned int h, int guess_split,
+                         int width, int height, int show_part, gboolean do_center,
+                         unsigned int force_notes, unsigned int show_preview, cairo_filter_t filter);
+int main_render_thumbnail(cairo_t *cr, int index, int width, int height, int show_part, gboolean do_center);
+void main_render_page_scaled(unsigned int id, cairo_t *cr, int index, int width, int height,
+                             int show_part, gboolean do_center);
+void main_scaled_page_job(Job *job, gpointer data);
+gboolean main_scaled_page_ready(gpointer data);
+void main_scaled_pages_clear(void);
+gboolean main_resize_settled(gpointer data);
 void main_reconfigure_windows(void);
 int main_window_overview_get_grid_position(unsigned int id, int wx, int wy, guint *row, guint *column);
 int main_window_to_page(unsigned int id, int wx, int wy, double *px, double *py);
@@ -33,6 +78,47 @@ void toggle_fullscreen(guint win_id);
 
 static void page_action_callback(unsigned int action, void *data);
 
+/* Page changes are applied in the update phase of the projector's frame clock,
+ * both windows then paint the new page in that frame. */
+struct _FramePacing {
+    GdkFrameClock *clock;
+    gboolean flip_pending;
+    gint64 flip_time;
+    guint flip_windows;     /* windows that still have to paint the flip, one bit each */
+    guint missed;
+    /* PDF transition into the page shown on the projector, one step per frame */
+    Transition *transition;
+} frame_pacing;
+
+gboolean main_frame_clock_running(void);
+void main_request_flip(void);
+void main_apply_flip(void);
+void main_frame_before_paint(GdkFrameClock *clock, gpointer data);
+void main_frame_update(GdkFrameClock *clock, gpointer data);
+void main_frame_check_flip(unsigned int id, GtkWidget *widget);
+gboolean main_navigation_settled(gpointer data);
+void main_transition_start(int from_index, int to_index);
+void main_transition_step(GdkFrameClock *clock);
+void main_transition_stop(void);
+gboolean main_transition_wanted(unsigned int id, int index);
+
+/* time from pointer input until the projector has drawn it */
+struct _OverlayLatency {
+    gint64 input_time;      /* oldest input not drawn yet, 0 if none */
+    gint64 last;
+    gint64 worst;
+    guint late;             /* inputs that took longer than one frame */
+} overlay_latency;
+
+void main_overlay_set_tool(OverlayTool tool);
+void main_overlay_clear_page(void);
+int main_overlay_area(unsigned int id, UtilRect *area);
+int main_overlay_from_window(unsigned int id, double wx, double wy, UtilPoint *pt);
+void main_overlay_queue_draw(UtilPoint *a, UtilPoint *b);
+void main_overlay_ink_segment(UtilPoint *a, UtilPoint *b, guint serial);
+void main_render_overlay(unsigned int id, cairo_t *cr);
+void main_overlay_check_latency(GtkWidget *widget);
+
 void main_read_config(int argc, char **argv);
 void config_step_notes(void);
 void config_step_preview(void);
@@ -41,9 +127,13 @@ void main_cleanup(void);
 void main_quit(void);
 
 gboolean main_regular_update(gpointer data);
+void main_clock_schedule(void);
 gboolean main_check_mouse_motion(gpointer data);
+void main_pointer_moved(void);
 
 void main_reload_document(void);
+void main_reload_document_finished(int result, gpointer userdata);
+gboolean main_reload_document_timeout(gpointer data);
 
 void main_file_monitor_start(void);
 void main_file_monitor_cleanup(void);
@@ -51,40 +141,125 @@ void main_file_monitor_cb(GFileMonitor *monitor, GFile *first, GFile *second, GF
 
 void main_init_modes(void);
 
+void main_memory_pressure(PressureLevel level, gpointer userdata);
+void main_power_changed(gpointer userdata);
+void main_document_indexed(gpointer userdata);
+
+void main_playlist_switch(gint delta);
+void main_playlist_prefetch(void);
+void main_playlist_prefetch_finished(int result, gpointer userdata);
+
+void main_startup_render_job(Job *job, gpointer data);
+gboolean main_startup_deferred(gpointer data);
+void main_startup_mark(const gchar *phase);
+GTimer *startup_timer = NULL;
+double startup_last_mark = 0.0;
+guint startup_deferred_source = 0;
+
 double overview_cell_width = 256.0f;
 double overview_cell_height = 192.0f;
 void main_set_overview_page_width(unsigned int width);
 void main_prerender_overview_grid(void);
+void main_cancel_overview_prerender(void);
 
-GThread *overview_grid_prerender_thread = NULL;
+Job *overview_grid_job = NULL;
+JobToken *overview_grid_token = NULL;
 GMutex overview_grid_lock;
 gint overview_grid_surface_status = 0; /* 0: invalid, 1: valid, 2: in prerender */
-gint cancel_running_threads = 0;
 
 GList *history_list = NULL;
 
 void main_history_mark_current(void);
 void main_history_back(void);
 
+GString *search_query = NULL;
+GArray *search_results = NULL;
+guint search_selection = 0;
+guint search_retry_source = 0;
+
+void main_search_start(void);
+void main_search_finish(void);
+void main_search_update(void);
+gboolean main_search_retry(gpointer data);
+void main_render_search_hits(cairo_t *cr, int index, int width, int height, gboolean do_center,
+                             SearchHit *hits, guint hit_count);
+
 enum WindowMode {
     WINDOW_MODE_PRESENTATION = 0,
     WINDOW_MODE_CONSOLE,
-    WINDOW_MODE_OVERVIEW
+    WINDOW_MODE_OVERVIEW,
+    WINDOW_MODE_SEARCH
+};
+
+/* everything the pixels of a scaled page depend on */
+struct _ScaledPageKey {
+    gint index;
+    int width;
+    int height;
+    int show_part;
+    gboolean do_center;
+    guint generation;
+    unsigned int force_notes;
+    unsigned int show_preview;
+};
+
+/* page pre-scaled to the exact size it is drawn at; the image from the job
+ * is uploaded once into native, which only the main thread touches */
+struct _ScaledPage {
+    struct _ScaledPageKey key;
+    cairo_surface_t *surface;
+    cairo_surface_t *native;
+    gboolean pending;
 };
 
 struct _Win {
     GtkWidget *win;
     gint cx;
     gint cy;
-    void (*render)(cairo_t *, int, int);
+    void (*render)(unsigned int, cairo_t *, int, int);
     enum WindowMode window_mode;
     struct {
         UtilRect bounds;
         double scale;
     } page_display;
+    /* previous, current and next page, slot is index % MAIN_SCALED_SLOTS;
+     * protected by scaled_pages_lock */
+    struct _ScaledPage scaled[MAIN_SCALED_SLOTS];
+    /* ink of the shown page, drawn once into its own layer over the slide */
+    struct {
+        cairo_surface_t *surface;
+        int page;
+        int width;
+        int height;
+        guint serial;
+    } ink;
+    guint resize_source;
+    unsigned int resizing : 1;
     unsigned int fullscreen : 1;
+    unsigned int hidden : 1; /* iconified or withdrawn */
 } windows[2];
 
+/* text rendered once and blitted until it changes */
+struct _TextLayer {
+    gchar *text;
+    cairo_surface_t *surface;
+    int width;
+} console_status_layer, console_clock_layer;
+
+void main_text_layer_update(struct _TextLayer *layer, cairo_t *cr, const gchar *text);
+void main_text_layer_clear(struct _TextLayer *layer);
+void main_overview_queue_draw_cell(guint row, guint column);
+
+GMutex scaled_pages_lock;
+JobToken *scaled_pages_token = NULL;
+void main_scaled_page_request(unsigned int id, struct _ScaledPageKey *key, gboolean redraw);
+void main_scaled_page_upload(unsigned int id, struct _ScaledPage *slot);
+void main_scaled_pages_upload(unsigned int id);
+void main_scaled_page_key(struct _ScaledPageKey *key, int index, int width, int height,
+                          int show_part, gboolean do_center);
+cairo_surface_t *main_scaled_page_snapshot(unsigned int id, int index, int width, int height,
+                                           int show_part, gboolean do_center);
+
 struct _PresenterConfig {
     gchar *filename;
     unsigned int scale_to_height;
@@ -93,16 +268,36 @@ struct _PresenterConfig {
     unsigned int show_console : 1;
     unsigned int show_preview : 1;
     unsigned int disable_cache : 1;
+    unsigned int startup_timings : 1;
+    unsigned int reserve_ui_core : 1;
+    unsigned int power_report : 1;
+    unsigned int debug_wakeups : 1;
+    unsigned int no_transitions : 1;
+    PowerProfile power_profile;
     guint overview_columns;
     guint overview_rows;
+    guint render_workers;
+    guint cache_budget;
+    /* all documents given on the command line, filename is the presented one */
+    gchar **playlist;
+    guint playlist_length;
 } _config;
 
 struct _PresenterState {
     double page_width;
     double page_height;
     int page_guess_split;
+    /* page both windows show, follows the presentation at the next frame */
+    int display_page;
+    /* fast navigation: shown from the thumbnail, the page itself is not loaded yet */
+    gboolean display_thumbnail;
+    gint64 navigation_time;
+    guint navigation_source;
     GFile *document;
     GFileMonitor *monitor;
+    guint reload_source;
+    guint playlist_index;
+    PageCacheInstance **playlist_caches;
 } _state;
 
 struct _PresentationMode {
@@ -116,6 +311,7 @@ struct _PresentationMode {
 enum _PresentationModeType {
     PRESENTATION_MODE_NORMAL = 0,
     PRESENTATION_MODE_OVERVIEW,
+    PRESENTATION_MODE_SEARCH,
     N_PRESENTATION_MODES
 };
 
@@ -127,7 +323,8 @@ void main_set_mode(enum _PresentationModeType mode);
 GdkCursor *hand_cursor = NULL;
 GdkCursor *blank_cursor = NULL;
 guint hide_cursor_source = 0;
-GTimer *hide_cursor_timer = NULL;
+gint64 pointer_motion_time = 0;
+guint clock_source = 0;
 
 cairo_surface_t *overview_grid_surface = NULL;
 
@@ -136,40 +333,62 @@ int main(int argc, char **argv)
     unsigned int i;
     unsigned int w, h;
 
+    /* helper process started by the render worker pool */
+    if (argc == 2 && g_strcmp0(argv[1], RENDER_WORKER_ARGUMENT) == 0)
+        return render_worker_main(3);
+
     gtk_init(&argc, &argv);
 
     g_mutex_init(&overview_grid_lock);
+    g_mutex_init(&scaled_pages_lock);
 
     main_init_modes();
     main_read_config(argc, argv);
 
+    if (_config.startup_timings)
+        startup_timer = g_timer_new();
+
+    jobs_init(0, _config.reserve_ui_core);
+    scaled_pages_token = job_token_new();
+
     if (page_cache_init() != 0) {
         fprintf(stderr, "Failed to initialize page cache\n");
         return 1;
     }
 
+    page_cache_set_scale_to_height(_config.scale_to_height);
+    page_cache_set_memory_budget((gsize)_config.cache_budget * 1024 * 1024);
+    page_cache_set_indexed_callback(main_document_indexed, NULL);
+
+    if (_config.power_profile == POWER_PROFILE_AUTO)
+        power_watch_start(main_power_changed, NULL);
+    _config.power_profile = power_resolve_profile(_config.power_profile);
+    page_cache_set_power_saving(_config.power_profile == POWER_PROFILE_SAVING);
+
+    if (render_worker_init(_config.render_workers) != 0)
+        fprintf(stderr, "Failed to start render workers, working in process\n");
+
     if (page_cache_load_document(_config.filename) != 0) {
         fprintf(stderr, "Error loading document\n");
         return 1;
     }
+    _state.playlist_caches = g_malloc0(sizeof(PageCacheInstance *) * _config.playlist_length);
+    _state.playlist_caches[0] = page_cache_get_presented();
+    main_startup_mark("load document");
+
+    /* render the first page while the windows are set up */
+    job_unref(jobs_submit(JOB_PRIORITY_RENDER, 0, NULL, main_startup_render_job, NULL, NULL));
 
     page_overview_init(_config.overview_columns);
-    page_overview_update();
+    main_set_overview_page_width(_config.overview_page_width);
 
     main_file_monitor_start();
+    pressure_monitor_init(main_memory_pressure, NULL);
 
-    page_cache_set_scale_to_height(_config.scale_to_height);
-
-    if (_config.disable_cache == 0)
-        page_cache_start_caching();
-
-    presentation_init(page_action_callback, NULL);
-
-    main_set_overview_page_width(_config.overview_page_width);
-    main_prerender_overview_grid();
-
-    i = presentation_get_current_page();
-    page_cache_fetch_page(i, NULL, &w, &h, &_state.page_guess_split);
+    /* until the first page is indexed its size may be unknown, assume 4:3 */
+    w = 1024;
+    h = 768;
+    page_cache_get_page_size(0, &w, &h, &_state.page_guess_split);
     _state.page_width = (double)w;
     _state.page_height = (double)h;
 
@@ -222,6 +441,11 @@ int main(int argc, char **argv)
     gtk_window_set_role(GTK_WINDOW(windows[0].win), "presentation");
     gtk_window_set_role(GTK_WINDOW(windows[1].win), "console");
 
+    main_startup_mark("create windows");
+
+    presentation_init(page_action_callback, NULL);
+    main_startup_mark("first page");
+
     main_reconfigure_windows();
 
     gtk_widget_show_all(windows[0].win);
@@ -230,10 +454,11 @@ int main(int argc, char **argv)
     hand_cursor = /*gdk_cursor_new(GDK_HAND2);*/
         gdk_cursor_new_from_name(gdk_display_get_default(), "pointer");
 
-    g_timeout_add_seconds(1, (GSourceFunc)main_regular_update, NULL);
-    hide_cursor_timer = g_timer_new();
-    g_timer_start(hide_cursor_timer);
-    hide_cursor_source = g_idle_add(main_check_mouse_motion, NULL);
+    if (_config.power_report)
+        power_report_start();
+    if (_config.debug_wakeups)
+        power_wakeups_start();
+    main_pointer_moved();
 
     gtk_main();
 
@@ -242,27 +467,103 @@ int main(int argc, char **argv)
     return 0;
 }
 
+void main_startup_render_job(Job *job, gpointer data)
+{
+    PageCacheLease lease;
+
+    /* the released surface stays in the pool for presentation_init */
+    if (page_cache_page_acquire(0, &lease) == 0)
+        page_cache_page_release(&lease);
+}
+
+gboolean main_startup_deferred(gpointer data)
+{
+    page_overview_update();
+    main_startup_mark("page labels");
+
+    main_prerender_overview_grid();
+
+    if (_config.disable_cache == 0)
+        page_cache_start_caching();
+    main_playlist_prefetch();
+    main_startup_mark("start background work");
+
+    if (startup_timer) {
+        g_timer_destroy(startup_timer);
+        startup_timer = NULL;
+    }
+
+    return FALSE;
+}
+
+/* prints the time since the last mark, only with --startup-timings */
+void main_startup_mark(const gchar *phase)
+{
+    double now;
+    if (!startup_timer)
+        return;
+
+    now = g_timer_elapsed(startup_timer, NULL);
+    fprintf(stderr, "startup: %-24s %8.1f ms (total %8.1f ms)\n", phase,
+            (now - startup_last_mark) * 1000.0, now * 1000.0);
+    startup_last_mark = now;
+}
+
 void main_cleanup(void)
 {
     int i;
     main_file_monitor_cleanup();
+    pressure_monitor_cleanup();
+    power_watch_stop();
+    power_report_stop();
+    power_wakeups_stop();
 
     page_overview_cleanup();
 
+    if (search_retry_source)
+        g_source_remove(search_retry_source);
+    search_results_free(search_results);
+    if (search_query)
+        g_string_free(search_query, TRUE);
+
+    main_cancel_overview_prerender();
+    job_token_cancel(scaled_pages_token);
     page_cache_stop_caching();
+    jobs_cleanup();
+    job_token_unref(scaled_pages_token);
+    main_scaled_pages_clear();
+    for (i = 0; i < 2; i++) {
+        if (windows[i].resize_source)
+            g_source_remove(windows[i].resize_source);
+    }
     page_cache_cleanup();
+    render_worker_cleanup();
     for (i = 0; i < 2; i++) {
         if (GTK_IS_WINDOW(windows[i].win)) {
             gtk_widget_destroy(windows[i].win);
         }
     }
     g_free(_config.filename);
+    g_strfreev(_config.playlist);
+    g_free(_state.playlist_caches);
 
     if (overview_grid_surface)
         cairo_surface_destroy(overview_grid_surface);
-
-    if (hide_cursor_timer)
-        g_timer_destroy(hide_cursor_timer);
+    main_text_layer_clear(&console_status_layer);
+    main_text_layer_clear(&console_clock_layer);
+
+    if (clock_source)
+        g_source_remove(clock_source);
+    if (_state.navigation_source)
+        g_source_remove(_state.navigation_source);
+    main_transition_stop();
+    overlay_cleanup();
+    for (i = 0; i < 2; i++) {
+        if (windows[i].ink.surface)
+            cairo_surface_destroy(windows[i].ink.surface);
+    }
+    if (startup_timer)
+        g_timer_destroy(startup_timer);
     if (hide_cursor_source)
         g_source_remove(hide_cursor_source);
     if (hand_cursor)
@@ -273,6 +574,7 @@ void main_cleanup(void)
 
 static gboolean _key_press_event(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
+    jobs_input_activity();
     return mode_class[current_mode].handle_key_press(widget, event, data);
 }
 
@@ -282,6 +584,13 @@ static gboolean _configure_event(GtkWidget *widget, GdkEventConfigure *event, gp
     if (id != 0 && id != 1) {
         return FALSE;
     }
+    /* draw with the fast filter until the size settles */
+    if (windows[id].cx != 0 && (windows[id].cx != event->width || windows[id].cy != event->height)) {
+        windows[id].resizing = 1;
+        if (windows[id].resize_source)
+            g_source_remove(windows[id].resize_source);
+        windows[id].resize_source = g_timeout_add(MAIN_RESIZE_SETTLE_MS, main_resize_settled, GUINT_TO_POINTER(id));
+    }
     windows[id].cx = event->width;
     windows[id].cy = event->height;
 
@@ -309,6 +618,15 @@ static gboolean _configure_event(GtkWidget *widget, GdkEventConfigure *event, gp
 static gboolean _draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
     render_window(GPOINTER_TO_UINT(data), cr);
+    main_frame_check_flip(GPOINTER_TO_UINT(data), widget);
+    if (GPOINTER_TO_UINT(data) == 0)
+        main_overlay_check_latency(widget);
+
+    /* labels, overview and caching wait until the first frame is out */
+    if (!startup_deferred_source && GPOINTER_TO_UINT(data) == 0) {
+        main_startup_mark("first frame");
+        startup_deferred_source = g_idle_add_full(G_PRIORITY_LOW, main_startup_deferred, NULL, NULL);
+    }
 
     return FALSE;
 }
@@ -321,16 +639,19 @@ static gboolean _delete_event(GtkWidget *widget, GdkEvent *event, gpointer data)
 
 static gboolean _button_press_event(GtkWidget *widget, GdkEventButton *event, gpointer data)
 {
+    jobs_input_activity();
     return mode_class[current_mode].handle_button_press(widget, event, data);
 }
 
 static gboolean _scroll_event(GtkWidget *widget, GdkEventScroll *event, gpointer data)
 {
+    jobs_input_activity();
     return mode_class[current_mode].handle_scroll_event(widget, event, data);
 }
 
 static gboolean _motion_notify_event(GtkWidget *widget, GdkEventMotion *event, gpointer data)
 {
+    jobs_input_activity();
     return mode_class[current_mode].handle_motion_event(widget, event, data);
 }
 
@@ -340,6 +661,15 @@ static gboolean _window_state_event(GtkWidget *widget, GdkEventWindowState *even
     if (event->changed_mask & GDK_WINDOW_STATE_FULLSCREEN) {
         windows[id].fullscreen = (event->new_window_state & GDK_WINDOW_STATE_FULLSCREEN) ? 1 : 0;
     }
+    if (event->changed_mask & (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN)) {
+        windows[id].hidden = (event->new_window_state &
+                              (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN)) ? 1 : 0;
+        /* a flip requested just before would wait for the clock to thaw */
+        if (id == 0 && windows[id].hidden && frame_pacing.flip_pending) {
+            frame_pacing.flip_pending = FALSE;
+            main_apply_flip();
+        }
+    }
     return FALSE;
 }
 
@@ -350,6 +680,15 @@ static void _window_realize(GtkWidget *widget, gpointer data)
                           GDK_BUTTON_PRESS_MASK |
                           GDK_POINTER_MOTION_MASK |
                           GDK_SCROLL_MASK);
+
+    /* the projector paces page changes */
+    if (GPOINTER_TO_UINT(data) == 0 && !frame_pacing.clock) {
+        frame_pacing.clock = gtk_widget_get_frame_clock(widget);
+        if (frame_pacing.clock) {
+            g_signal_connect(frame_pacing.clock, "before-paint", G_CALLBACK(main_frame_before_paint), NULL);
+            g_signal_connect(frame_pacing.clock, "update", G_CALLBACK(main_frame_update), NULL);
+        }
+    }
 }
 
 void render_window(unsigned int id, cairo_t *cr)
@@ -365,29 +704,61 @@ void render_window(unsigned int id, cairo_t *cr)
     cairo_fill(cr);
 
     if (windows[id].render) {
-        windows[id].render(cr, windows[id].cx, windows[id].cy);
+        windows[id].render(id, cr, windows[id].cx, windows[id].cy);
     }
 }
 
+/* main loop only, reads the layout from the configuration */
 void main_render_page(cairo_t *cr, int index, int width, int height, int show_part, gboolean do_center)
 {
-    cairo_save(cr);
+    main_render_page_filter(cr, index, width, height, show_part, do_center,
+                            _config.force_notes, _config.show_preview, CAIRO_FILTER_GOOD);
+}
+
+void main_render_page_filter(cairo_t *cr, int index, int width, int height, int show_part, gboolean do_center,
+                             unsigned int force_notes, unsigned int show_preview, cairo_filter_t filter)
+{
+    PageCacheLease lease;
+
+    if (page_cache_page_acquire(index, &lease) != 0) {
+        fprintf(stderr, "could not fetch page %d\n", index);
+        return;
+    }
+    main_render_surface(cr, lease.surface, lease.width, lease.height, lease.guess_split,
+                        width, height, show_part, do_center, force_notes, show_preview, filter);
+    page_cache_page_release(&lease);
+}
 
-    cairo_surface_t *page_surface;
+/* never loads the page, returns 1 if there is no thumbnail yet */
+int main_render_thumbnail(cairo_t *cr, int index, int width, int height, int show_part, gboolean do_center)
+{
+    cairo_surface_t *thumbnail = page_cache_get_thumbnail(index);
     unsigned int w, h;
+
+    if (!thumbnail)
+        return 1;
+    w = cairo_image_surface_get_width(thumbnail);
+    h = cairo_image_surface_get_height(thumbnail);
+    main_render_surface(cr, thumbnail, w, h, w > 2*h ? 1 : 0, width, height, show_part, do_center,
+                        _config.force_notes, _config.show_preview, CAIRO_FILTER_FAST);
+    cairo_surface_destroy(thumbnail);
+    return 0;
+}
+
+/* force_notes and show_preview are passed in, as this runs on job threads */
+void main_render_surface(cairo_t *cr, cairo_surface_t *surface, unsigned int w, unsigned int h, int guess_split,
+                         int width, int height, int show_part, gboolean do_center,
+                         unsigned int force_notes, unsigned int show_preview, cairo_filter_t filter)
+{
     double scale, tmp;
     double ox = 0.0f, oy = 0.0f;
     double page_offset = 0.0f;
-    int guess_split;
 
-    if (page_cache_fetch_page(index, &page_surface, &w, &h, &guess_split) != 0) {
-        fprintf(stderr, "could not fetch page %d\n", index);
-        goto done;
-    }
+    cairo_save(cr);
 
-    if ((guess_split && _config.force_notes == 0) || _config.force_notes == 1) {
+    if ((guess_split && force_notes == 0) || force_notes == 1) {
         w /= 2;
-        if (!_config.show_preview && show_part == 1)
+        if (!show_preview && show_part == 1)
             page_offset = -((double)w);
     }
 
@@ -403,59 +774,368 @@ void main_render_page(cairo_t *cr, int index, int width, int height, int show_pa
     cairo_translate(cr, ox, oy);
     cairo_scale(cr, scale, scale);
 
-    cairo_set_source_surface(cr, page_surface, page_offset, 0.0f);
+    cairo_set_source_surface(cr, surface, page_offset, 0.0f);
+    cairo_pattern_set_filter(cairo_get_source(cr), filter);
     cairo_rectangle(cr, 0.0f, 0.0f, w, h);
     cairo_fill(cr);
 
-done:
+    cairo_restore(cr);
+}
+
+struct _ScaledPageJob {
+    unsigned int id;
+    struct _ScaledPageKey key;
+    gboolean redraw;
+};
+
+/* Draws from the window's pre-scaled copy, which is a plain blit. Misses are drawn
+ * directly, and the copy is (re)built in the background, together with both
+ * neighbours, so that a page change in either direction finds its frame ready. */
+void main_render_page_scaled(unsigned int id, cairo_t *cr, int index, int width, int height,
+                             int show_part, gboolean do_center)
+{
+    struct _ScaledPageKey key;
+    struct _ScaledPage *slot;
+    gboolean hit = FALSE;
+
+    main_scaled_page_key(&key, index, width, height, show_part, do_center);
+
+    if (index >= 0) {
+        g_mutex_lock(&scaled_pages_lock);
+        slot = &windows[id].scaled[index % MAIN_SCALED_SLOTS];
+        if ((slot->surface || slot->native) && memcmp(&slot->key, &key, sizeof(key)) == 0) {
+            main_scaled_page_upload(id, slot);
+            cairo_save(cr);
+            cairo_set_source_surface(cr, slot->native ? slot->native : slot->surface, 0.0f, 0.0f);
+            cairo_rectangle(cr, 0.0f, 0.0f, width, height);
+            cairo_fill(cr);
+            cairo_restore(cr);
+            hit = TRUE;
+        }
+        g_mutex_unlock(&scaled_pages_lock);
+    }
+
+    if (!hit)
+        main_render_page_filter(cr, index, width, height, show_part, do_center, key.force_notes, key.show_preview,
+                                windows[id].resizing ? CAIRO_FILTER_FAST : CAIRO_FILTER_GOOD);
+
+    /* wait with the rebuild until the resize is over */
+    if (windows[id].resizing || index < 0)
+        return;
+    if (!hit)
+        main_scaled_page_request(id, &key, TRUE);
+    if (index + 1 < page_cache_get_page_count()) {
+        key.index = index + 1;
+        main_scaled_page_request(id, &key, FALSE);
+    }
+    if (index > 0) {
+        key.index = index - 1;
+        main_scaled_page_request(id, &key, FALSE);
+    }
+}
+
+void main_scaled_page_key(struct _ScaledPageKey *key, int index, int width, int height,
+                          int show_part, gboolean do_center)
+{
+    memset(key, 0, sizeof(*key));
+    key->index = index;
+    key->width = width;
+    key->height = height;
+    key->show_part = show_part;
+    key->do_center = do_center;
+    key->generation = page_cache_get_generation();
+    key->force_notes = _config.force_notes;
+    key->show_preview = _config.show_preview;
+}
+
+/* image of a finished copy for the CPU, NULL if there is none */
+cairo_surface_t *main_scaled_page_snapshot(unsigned int id, int index, int width, int height,
+                                           int show_part, gboolean do_center)
+{
+    struct _ScaledPageKey key;
+    struct _ScaledPage *slot;
+    cairo_surface_t *snapshot = NULL;
+    cairo_t *cr;
+
+    if (index < 0)
+        return NULL;
+    main_scaled_page_key(&key, index, width, height, show_part, do_center);
+
+    g_mutex_lock(&scaled_pages_lock);
+    slot = &windows[id].scaled[index % MAIN_SCALED_SLOTS];
+    if (!slot->pending && memcmp(&slot->key, &key, sizeof(key)) == 0) {
+        if (slot->surface) {
+            snapshot = cairo_surface_reference(slot->surface);
+        }
+        else if (slot->native) {
+            /* reads the pixels back, only if the image was not kept */
+            snapshot = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+            cr = cairo_create(snapshot);
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, slot->native, 0.0f, 0.0f);
+            cairo_paint(cr);
+            cairo_destroy(cr);
+        }
+    }
+    g_mutex_unlock(&scaled_pages_lock);
+
+    return snapshot;
+}
+
+void main_scaled_page_request(unsigned int id, struct _ScaledPageKey *key, gboolean redraw)
+{
+    struct _ScaledPage *slot;
+    struct _ScaledPageJob *job;
+
+    g_mutex_lock(&scaled_pages_lock);
+    slot = &windows[id].scaled[key->index % MAIN_SCALED_SLOTS];
+    if ((slot->surface || slot->native || slot->pending) && memcmp(&slot->key, key, sizeof(*key)) == 0) {
+        g_mutex_unlock(&scaled_pages_lock);
+        return;
+    }
+    if (slot->surface) {
+        cairo_surface_destroy(slot->surface);
+        slot->surface = NULL;
+    }
+    if (slot->native) {
+        cairo_surface_destroy(slot->native);
+        slot->native = NULL;
+    }
+    slot->key = *key;
+    slot->pending = TRUE;
+    g_mutex_unlock(&scaled_pages_lock);
+
+    job = g_malloc(sizeof(struct _ScaledPageJob));
+    job->id = id;
+    job->key = *key;
+    job->redraw = redraw;
+    job_unref(jobs_submit(JOB_PRIORITY_RENDER, key->generation, scaled_pages_token,
+                          main_scaled_page_job, job, g_free));
+}
+
+void main_scaled_page_job(Job *job, gpointer data)
+{
+    struct _ScaledPageJob *scaled = data;
+    struct _ScaledPage *slot;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, scaled->key.width, scaled->key.height);
+    cr = cairo_create(surface);
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    cairo_paint(cr);
+    main_render_page_filter(cr, scaled->key.index, scaled->key.width, scaled->key.height,
+                            scaled->key.show_part, scaled->key.do_center,
+                            scaled->key.force_notes, scaled->key.show_preview, CAIRO_FILTER_GOOD);
+    cairo_destroy(cr);
+
+    /* the slot may have been taken by another page in the meantime */
+    g_mutex_lock(&scaled_pages_lock);
+    slot = &windows[scaled->id].scaled[scaled->key.index % MAIN_SCALED_SLOTS];
+    if (slot->pending && memcmp(&slot->key, &scaled->key, sizeof(scaled->key)) == 0) {
+        slot->surface = surface;
+        slot->pending = FALSE;
+        surface = NULL;
+    }
+    g_mutex_unlock(&scaled_pages_lock);
+
+    if (surface)
+        cairo_surface_destroy(surface);
+    else
+        g_idle_add(main_scaled_page_ready, GUINT_TO_POINTER(scaled->id * 2 + (scaled->redraw ? 1 : 0)));
+}
+
+/* uploads in advance, so the page flip itself is a server-side copy */
+gboolean main_scaled_page_ready(gpointer data)
+{
+    unsigned int id = GPOINTER_TO_UINT(data) / 2;
+
+    if (!GTK_IS_WINDOW(windows[id].win))
+        return FALSE;
+
+    g_mutex_lock(&scaled_pages_lock);
+    main_scaled_pages_upload(id);
+    g_mutex_unlock(&scaled_pages_lock);
+
+    if (GPOINTER_TO_UINT(data) & 1)
+        gtk_widget_queue_draw(windows[id].win);
+    return FALSE;
+}
+
+/* copy into a surface of the window's own kind (a pixmap on X11) once,
+ * instead of sending the image with every draw; needs scaled_pages_lock.
+ * Pages taking part in a transition keep their image for blending. */
+void main_scaled_page_upload(unsigned int id, struct _ScaledPage *slot)
+{
+    GdkWindow *window = gtk_widget_get_window(windows[id].win);
+    cairo_t *cr;
+
+    if (!slot->surface || slot->native || !window)
+        return;
+
+    slot->native = gdk_window_create_similar_surface(window, CAIRO_CONTENT_COLOR,
+                                                     slot->key.width, slot->key.height);
+    cr = cairo_create(slot->native);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, slot->surface, 0.0f, 0.0f);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    if (main_transition_wanted(id, slot->key.index))
+        return;
+    cairo_surface_destroy(slot->surface);
+    slot->surface = NULL;
+}
 
+void main_scaled_pages_upload(unsigned int id)
+{
+    unsigned int k;
+    for (k = 0; k < MAIN_SCALED_SLOTS; k++)
+        main_scaled_page_upload(id, &windows[id].scaled[k]);
+}
+
+void main_scaled_pages_clear(void)
+{
+    unsigned int i, k;
+    g_mutex_lock(&scaled_pages_lock);
+    for (i = 0; i < 2; i++) {
+        for (k = 0; k < MAIN_SCALED_SLOTS; k++) {
+            if (windows[i].scaled[k].surface)
+                cairo_surface_destroy(windows[i].scaled[k].surface);
+            if (windows[i].scaled[k].native)
+                cairo_surface_destroy(windows[i].scaled[k].native);
+            windows[i].scaled[k].surface = NULL;
+            windows[i].scaled[k].native = NULL;
+            windows[i].scaled[k].pending = FALSE;
+        }
+    }
+    g_mutex_unlock(&scaled_pages_lock);
+}
+
+gboolean main_resize_settled(gpointer data)
+{
+    unsigned int id = GPOINTER_TO_UINT(data);
+    windows[id].resize_source = 0;
+    windows[id].resizing = 0;
+    gtk_widget_queue_draw(windows[id].win);
+    return FALSE;
+}
+
+static void render_presentation_window(unsigned int id, cairo_t *cr, int width, int height)
+{
+    if (id == 0 && frame_pacing.transition) {
+        cairo_set_source_surface(cr, transition_get_surface(frame_pacing.transition), 0.0f, 0.0f);
+        cairo_paint(cr);
+        return;
+    }
+    if (_state.display_thumbnail)
+        main_render_thumbnail(cr, _state.display_page, width, height, 0, TRUE);
+    else
+        main_render_page_scaled(id, cr, _state.display_page,
+                                width, height, 0, TRUE);
+    main_render_overlay(id, cr);
+}
+
+void main_text_layer_update(struct _TextLayer *layer, cairo_t *cr, const gchar *text)
+{
+    cairo_text_extents_t ext;
+    cairo_font_extents_t fext;
+    cairo_t *lcr;
+
+    if (layer->surface && g_strcmp0(layer->text, text) == 0)
+        return;
+    main_text_layer_clear(layer);
+
+    cairo_save(cr);
+    cairo_set_font_size(cr, MAIN_STATUS_FONT_SIZE);
+    cairo_text_extents(cr, text, &ext);
+    cairo_font_extents(cr, &fext);
     cairo_restore(cr);
+
+    layer->text = g_strdup(text);
+    layer->width = (int)(ext.x_advance + 0.5);
+    layer->surface = cairo_surface_create_similar(cairo_get_target(cr), CAIRO_CONTENT_COLOR_ALPHA,
+                                                  layer->width > 0 ? layer->width : 1, MAIN_STATUS_HEIGHT);
+    lcr = cairo_create(layer->surface);
+    cairo_set_source_rgb(lcr, 1.0f, 1.0f, 1.0f);
+    cairo_set_font_size(lcr, MAIN_STATUS_FONT_SIZE);
+    cairo_move_to(lcr, 0.0f, MAIN_STATUS_HEIGHT - fext.descent);
+    cairo_show_text(lcr, text);
+    cairo_destroy(lcr);
 }
 
-static void render_presentation_window(cairo_t *cr, int width, int height)
+void main_text_layer_clear(struct _TextLayer *layer)
 {
-    main_render_page(cr, presentation_get_current_page(),
-                     width, height, 0, TRUE);
+    if (layer->surface)
+        cairo_surface_destroy(layer->surface);
+    layer->surface = NULL;
+    g_free(layer->text);
+    layer->text = NULL;
 }
 
-static void render_console_window(cairo_t *cr, int width, int height)
+/* The slide and the status strip are separate layers, the regular update
+ * only invalidates the strip. */
+static void render_console_window(unsigned int id, cairo_t *cr, int width, int height)
 {
     time_t tval;
     struct tm *curtval;
     char dbuf[256];
     char buffer[512];
-    cairo_text_extents_t ext;
+    double x1, y1, x2, y2;
     PresentationStatus pstate;
 
-    main_render_page(cr, presentation_get_current_page() + (_config.show_preview ? 1 : 0),
-                         (int)(width * 0.8), (int)(height * 0.8), 1, FALSE);
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+    /* nothing to do for the slide if only the strip is redrawn */
+    if (x1 < (int)(width * 0.8) && y1 < (int)(height * 0.8)) {
+        if (_state.display_thumbnail)
+            main_render_thumbnail(cr, _state.display_page + (_config.show_preview ? 1 : 0),
+                                  (int)(width * 0.8), (int)(height * 0.8), 1, FALSE);
+        else
+            main_render_page_scaled(id, cr, _state.display_page + (_config.show_preview ? 1 : 0),
+                                    (int)(width * 0.8), (int)(height * 0.8), 1, FALSE);
+    }
+    main_render_overlay(id, cr);
+
+    if (y2 <= height - MAIN_STATUS_HEIGHT)
+        return;
 
     /* render time */
     time(&tval);
     curtval = localtime(&tval);
-    strftime(dbuf, 256, "%H:%M:%S", curtval);
+    strftime(dbuf, 256, _config.power_profile == POWER_PROFILE_SAVING ? "%H:%M" : "%H:%M:%S", curtval);
 
     presentation_get_status(&pstate);
 
-    sprintf(buffer, "Cache: (%d/%d, %" G_GSIZE_FORMAT " bytes) %d/%d, %s",
+    sprintf(buffer, "Cache: (%d/%d, %" G_GSIZE_FORMAT " bytes, %d decompressed, %d%% CPU, %u missed frames) %d/%d, ",
             pstate.cached_pages, pstate.num_pages, pstate.cached_size,
-            pstate.current_page, pstate.num_pages, dbuf);
-
-    cairo_set_source_rgb(cr, 1.0f, 1.0f, 1.0f);
-    cairo_set_font_size(cr, 24);
-    cairo_text_extents(cr, buffer, &ext);
-    cairo_move_to(cr, width-ext.x_advance, height+ext.y_bearing);
-    cairo_show_text(cr, buffer);
+            pstate.decompressed_pages, (int)(pstate.background_cpu * 100.0 + 0.5),
+            frame_pacing.missed, pstate.current_page, pstate.num_pages);
+    if (overlay_get_tool() != OVERLAY_TOOL_NONE)
+        sprintf(buffer + strlen(buffer), "Pointer: %.1f ms (worst %.1f ms, %u late), ",
+                overlay_latency.last / 1000.0, overlay_latency.worst / 1000.0, overlay_latency.late);
+
+    main_text_layer_update(&console_clock_layer, cr, dbuf);
+    main_text_layer_update(&console_status_layer, cr, buffer);
+
+    cairo_set_source_surface(cr, console_clock_layer.surface,
+                             width - console_clock_layer.width, height - MAIN_STATUS_HEIGHT);
+    cairo_paint(cr);
+    cairo_set_source_surface(cr, console_status_layer.surface,
+                             width - console_clock_layer.width - console_status_layer.width,
+                             height - MAIN_STATUS_HEIGHT);
+    cairo_paint(cr);
 }
 
-void render_overview_window_page_thumbnail(cairo_t *cr, gint index, gchar *label, guint row, guint column)
+void render_overview_window_page_thumbnail(cairo_t *cr, gint index, gchar *label, guint row, guint column,
+                                           unsigned int force_notes)
 {
     cairo_text_extents_t ext;
 
     cairo_save(cr);
     /* horizontal center in cell */
     cairo_translate(cr, (column + 0.05) * overview_cell_width, row * overview_cell_height);
-    main_render_page(cr, index, overview_cell_width * 0.9f, overview_cell_height * 0.9f, 0, FALSE);
+    main_render_page_filter(cr, index, overview_cell_width * 0.9f, overview_cell_height * 0.9f, 0, FALSE,
+                            force_notes, 0, CAIRO_FILTER_GOOD);
 
     cairo_set_source_rgb(cr, 1.0f, 1.0f, 1.0f);
     cairo_set_font_size(cr, 8);
@@ -475,7 +1155,7 @@ void render_overview_window_page_thumbnail(cairo_t *cr, gint index, gchar *label
     cairo_restore(cr);
 }
 
-static void render_overview_window(cairo_t *cr, int width, int height)
+static void render_overview_window(unsigned int id, cairo_t *cr, int width, int height)
 {
     guint col, row;
 
@@ -493,11 +1173,16 @@ static void render_overview_window(cairo_t *cr, int width, int height)
     else {
         gint index;
         gchar *label;
+        double x1, y1, x2, y2;
 
+        cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
         for (col = 0; col < _config.overview_columns; ++col) {
             for (row = 0; row < _config.overview_rows; ++row) {
+                if ((col + 1) * overview_cell_width < x1 || col * overview_cell_width > x2 ||
+                        (row + 1) * overview_cell_height < y1 || row * overview_cell_height > y2)
+                    continue;
                 if (page_overview_get_page(row, col, &index, &label, FALSE)) {
-                    render_overview_window_page_thumbnail(cr, index, label, row, col);
+                    render_overview_window_page_thumbnail(cr, index, label, row, col, _config.force_notes);
                 }
             }
         }
@@ -510,7 +1195,103 @@ static void render_overview_window(cairo_t *cr, int width, int height)
     cairo_stroke(cr);
 }
 
-gpointer _main_prerender_overview_grid_thread_proc(gpointer null)
+/* hits are relative to the whole page, notes included */
+void main_render_search_hits(cairo_t *cr, int index, int width, int height, gboolean do_center,
+                             SearchHit *hits, guint hit_count)
+{
+    unsigned int w, h, pw;
+    int guess_split;
+    double scale, tmp;
+    double ox = 0.0f, oy = 0.0f;
+    guint i;
+
+    if (hit_count == 0 || page_cache_get_page_size(index, &w, &h, &guess_split) != 0)
+        return;
+
+    pw = w;
+    if ((guess_split && _config.force_notes == 0) || _config.force_notes == 1)
+        w /= 2;
+
+    scale = ((double)width)/((double)w);
+    tmp = ((double)height)/((double)h);
+    if (tmp < scale) scale = tmp;
+
+    if (do_center) {
+        ox = (width - scale * w) * 0.5f;
+        oy = (height - scale * h) * 0.5f;
+    }
+
+    cairo_save(cr);
+    cairo_translate(cr, ox, oy);
+    cairo_scale(cr, scale, scale);
+    cairo_rectangle(cr, 0.0f, 0.0f, w, h);
+    cairo_clip(cr);
+
+    for (i = 0; i < hit_count; i++) {
+        cairo_rectangle(cr, hits[i].x1 * pw, hits[i].y1 * h,
+                        (hits[i].x2 - hits[i].x1) * pw, (hits[i].y2 - hits[i].y1) * h);
+    }
+    cairo_set_source_rgba(cr, 1.0f, 0.9f, 0.0f, 0.4f);
+    cairo_fill(cr);
+
+    cairo_restore(cr);
+}
+
+/* selected result on top, the following results in a row below */
+static void render_search_window(unsigned int id, cairo_t *cr, int width, int height)
+{
+    char buffer[512];
+    cairo_text_extents_t ext;
+    SearchResult *result;
+    double bar = 40.0f;
+    double cell_width, cell_height;
+    guint i, first, count = search_results ? search_results->len : 0;
+
+    if (count > 0) {
+        result = &g_array_index(search_results, SearchResult, search_selection);
+        cairo_save(cr);
+        cairo_translate(cr, 0.0f, bar);
+        main_render_page(cr, result->page, width, (int)((height - bar) * 0.7f), 0, TRUE);
+        main_render_search_hits(cr, result->page, width, (int)((height - bar) * 0.7f), TRUE,
+                                result->hits, result->hit_count);
+        cairo_restore(cr);
+
+        cell_width = width / (double)_config.overview_columns;
+        cell_height = (height - bar) * 0.3f;
+        first = search_selection - search_selection % _config.overview_columns;
+        for (i = first; i < count && i < first + _config.overview_columns; i++) {
+            result = &g_array_index(search_results, SearchResult, i);
+            cairo_save(cr);
+            cairo_translate(cr, (i - first + 0.05f) * cell_width, bar + (height - bar) * 0.7f + 0.05f * cell_height);
+            main_render_page(cr, result->page, cell_width * 0.9f, cell_height * 0.9f, 0, FALSE);
+            main_render_search_hits(cr, result->page, cell_width * 0.9f, cell_height * 0.9f, FALSE,
+                                    result->hits, result->hit_count);
+            if (i == search_selection) {
+                cairo_set_source_rgb(cr, 1.0f, 0.0f, 0.0f);
+                cairo_rectangle(cr, -0.05f * cell_width, -0.05f * cell_height, cell_width, cell_height);
+                cairo_stroke(cr);
+            }
+            cairo_restore(cr);
+        }
+    }
+
+    if (!search_results)
+        g_snprintf(buffer, sizeof(buffer), "Find: %s_  (indexing)", search_query->str);
+    else if (count == 0)
+        g_snprintf(buffer, sizeof(buffer), "Find: %s_  (no match)", search_query->str);
+    else
+        g_snprintf(buffer, sizeof(buffer), "Find: %s_  (%u/%u%s, page %u)", search_query->str,
+                   search_selection + 1, count, count == MAIN_SEARCH_MAX_RESULTS ? "+" : "",
+                   g_array_index(search_results, SearchResult, search_selection).page + 1);
+
+    cairo_set_source_rgb(cr, 1.0f, 1.0f, 1.0f);
+    cairo_set_font_size(cr, 24);
+    cairo_text_extents(cr, buffer, &ext);
+    cairo_move_to(cr, 10.0f, (bar - ext.height) * 0.5f - ext.y_bearing);
+    cairo_show_text(cr, buffer);
+}
+
+void _main_prerender_overview_grid_job(Job *job, gpointer data)
 {
     guint rows, columns;
     guint c, r;
@@ -541,10 +1322,10 @@ gpointer _main_prerender_overview_grid_thread_proc(gpointer null)
 
     for (r = 0; r < rows; ++r) {
         for (c = 0; c < columns; ++c) {
-            if (g_atomic_int_get(&cancel_running_threads))
+            if (job_is_cancelled(job))
                 goto cancel;
             if (page_overview_get_page(r, c, &index, &label, TRUE)) {
-                render_overview_window_page_thumbnail(cr, index, label, r, c);
+                render_overview_window_page_thumbnail(cr, index, label, r, c, GPOINTER_TO_UINT(data));
             }
         }
     }
@@ -558,22 +1339,78 @@ cancel:
 done:
     g_mutex_unlock(&overview_grid_lock);
     g_atomic_int_set(&overview_grid_surface_status, success);
-
-    return NULL;
 }
 
-void main_set_overview_page_width(unsigned int width)
+/* The cache sheds its own tiers; the overview grid goes at medium pressure
+ * and the overview draws single thumbnails until it is rebuilt. */
+void main_memory_pressure(PressureLevel level, gpointer userdata)
 {
-    /* FIXME: still assumes 4:3 ratio */
-    /* FIXME: assumes 4 columns */
-    overview_cell_width = 0.25f * width;
-    overview_cell_height = 0.1875 * width;
+    page_cache_set_memory_pressure(level);
+
+    if (level >= PRESSURE_MEDIUM) {
+        main_cancel_overview_prerender();
+        g_mutex_lock(&overview_grid_lock);
+        g_atomic_int_set(&overview_grid_surface_status, 0);
+        if (overview_grid_surface)
+            cairo_surface_destroy(overview_grid_surface);
+        overview_grid_surface = NULL;
+        g_mutex_unlock(&overview_grid_lock);
+    }
+    else if (level == PRESSURE_NONE && g_atomic_int_get(&overview_grid_surface_status) == 0) {
+        main_prerender_overview_grid();
+    }
 }
 
-void main_prerender_overview_grid(void)
+/* only watched with the automatic profile */
+void main_power_changed(gpointer userdata)
 {
-    overview_grid_prerender_thread = g_thread_new("OverviewGrid", (GThreadFunc)_main_prerender_overview_grid_thread_proc, NULL);
-    g_thread_unref(overview_grid_prerender_thread);
+    PowerProfile profile = power_resolve_profile(POWER_PROFILE_AUTO);
+
+    if (profile == _config.power_profile)
+        return;
+    _config.power_profile = profile;
+    page_cache_set_power_saving(profile == POWER_PROFILE_SAVING);
+
+    /* the clock wakes up at the boundaries of the new period */
+    if (clock_source)
+        g_source_remove(clock_source);
+    main_regular_update(NULL);
+}
+
+/* page sizes looked up before were possibly guessed, labels incomplete */
+void main_document_indexed(gpointer userdata)
+{
+    unsigned int w, h;
+
+    if (page_cache_get_page_size(_state.display_page, &w, &h, &_state.page_guess_split) == 0) {
+        _state.page_width = (double)w;
+        _state.page_height = (double)h;
+    }
+    page_overview_update();
+    main_prerender_overview_grid();
+    gtk_widget_queue_draw(windows[0].win);
+    gtk_widget_queue_draw(windows[1].win);
+}
+
+void main_set_overview_page_width(unsigned int width)
+{
+    /* FIXME: still assumes 4:3 ratio */
+    /* FIXME: assumes 4 columns */
+    overview_cell_width = 0.25f * width;
+    overview_cell_height = 0.1875 * width;
+}
+
+void main_prerender_overview_grid(void)
+{
+    main_cancel_overview_prerender();
+
+    /* rebuilt once memory pressure is gone */
+    if (pressure_monitor_get_level() >= PRESSURE_MEDIUM)
+        return;
+
+    overview_grid_token = job_token_new();
+    overview_grid_job = jobs_submit(JOB_PRIORITY_THUMBNAIL, page_cache_get_generation(), overview_grid_token,
+                                    _main_prerender_overview_grid_job, GUINT_TO_POINTER(_config.force_notes), NULL);
 }
 
 int main_window_overview_get_grid_position(unsigned int id, int wx, int wy, guint *row, guint *column)
@@ -654,19 +1491,381 @@ int main_page_to_window(unsigned int id, double px, double py, int *wx, int *wy)
     return 0;
 }
 
-static void page_action_callback(unsigned int action, void *data)
+/* GDK freezes the clock while the projector is not shown */
+gboolean main_frame_clock_running(void)
+{
+    return frame_pacing.clock && gtk_widget_get_mapped(windows[0].win) && !windows[0].hidden;
+}
+
+void main_request_flip(void)
+{
+    /* not shown, nothing to be in step with */
+    if (!main_frame_clock_running()) {
+        main_apply_flip();
+        return;
+    }
+    frame_pacing.flip_pending = TRUE;
+    gdk_frame_clock_request_phase(frame_pacing.clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+}
+
+/* Key repeat and scrubbing only move the target; while changes keep coming
+ * faster than MAIN_NAVIGATION_SETTLE_MS, pages are shown from their thumbnail
+ * and only the page navigation stops at is loaded. */
+void main_apply_flip(void)
 {
-    unsigned int index;
     unsigned int w, h;
+    gint64 now = g_get_monotonic_time();
+    cairo_surface_t *thumbnail;
+    gboolean rapid = now - _state.navigation_time < MAIN_NAVIGATION_SETTLE_MS * 1000;
+    int previous = _state.display_page;
+
+    _state.navigation_time = now;
+    _state.display_page = presentation_get_current_page();
+    _state.display_thumbnail = FALSE;
+
+    if (rapid && !presentation_is_settled() &&
+            (thumbnail = page_cache_get_thumbnail(_state.display_page)) != NULL) {
+        cairo_surface_destroy(thumbnail);
+        _state.display_thumbnail = TRUE;
+        if (!_state.navigation_source)
+            _state.navigation_source = g_timeout_add(MAIN_NAVIGATION_SETTLE_MS, main_navigation_settled, NULL);
+    }
+    else {
+        presentation_settle();
+    }
+
+    main_transition_stop();
+    if (!_state.display_thumbnail && _state.display_page == previous + 1)
+        main_transition_start(previous, _state.display_page);
+
+    if (page_cache_get_page_size(_state.display_page, &w, &h, &_state.page_guess_split) == 0) {
+        _state.page_width = (double)w;
+        _state.page_height = (double)h;
+    }
+    gtk_widget_queue_draw(windows[0].win);
+    gtk_widget_queue_draw(windows[1].win);
+}
 
+/* one-shot, moved to the remaining time while navigation goes on */
+gboolean main_navigation_settled(gpointer data)
+{
+    gint64 elapsed = (g_get_monotonic_time() - _state.navigation_time) / 1000;
+
+    if (elapsed < MAIN_NAVIGATION_SETTLE_MS) {
+        _state.navigation_source = g_timeout_add((guint)(MAIN_NAVIGATION_SETTLE_MS - elapsed),
+                                                 main_navigation_settled, NULL);
+        return FALSE;
+    }
+
+    _state.navigation_source = 0;
+    presentation_settle();
+    if (_state.display_thumbnail) {
+        _state.display_thumbnail = FALSE;
+        gtk_widget_queue_draw(windows[0].win);
+        gtk_widget_queue_draw(windows[1].win);
+    }
+    return FALSE;
+}
+
+/* copies finished since the last frame are uploaded before the flip is applied */
+void main_frame_before_paint(GdkFrameClock *clock, gpointer data)
+{
+    unsigned int i;
+
+    if (!frame_pacing.flip_pending)
+        return;
+    g_mutex_lock(&scaled_pages_lock);
+    for (i = 0; i < 2; i++)
+        main_scaled_pages_upload(i);
+    g_mutex_unlock(&scaled_pages_lock);
+}
+
+void main_frame_update(GdkFrameClock *clock, gpointer data)
+{
+    if (frame_pacing.flip_pending) {
+        frame_pacing.flip_pending = FALSE;
+        frame_pacing.flip_time = gdk_frame_clock_get_frame_time(clock);
+        frame_pacing.flip_windows = 3;
+        main_apply_flip();
+    }
+    if (frame_pacing.transition)
+        main_transition_step(clock);
+}
+
+/* Only a step forward by one page is animated, and only between copies that are
+ * already scaled for the projector; anything else is a cut. */
+void main_transition_start(int from_index, int to_index)
+{
+    PopplerPageTransition *trans;
+    cairo_surface_t *from, *to;
+
+    if (_config.no_transitions || !main_frame_clock_running() ||
+            windows[0].window_mode != WINDOW_MODE_PRESENTATION)
+        return;
+    if ((trans = page_cache_get_page_transition(to_index)) == NULL)
+        return;
+
+    from = main_scaled_page_snapshot(0, from_index, windows[0].cx, windows[0].cy, 0, TRUE);
+    to = main_scaled_page_snapshot(0, to_index, windows[0].cx, windows[0].cy, 0, TRUE);
+    if (from && to)
+        frame_pacing.transition = transition_new(trans, from, to,
+                                                 gdk_frame_clock_get_frame_time(frame_pacing.clock));
+    if (from)
+        cairo_surface_destroy(from);
+    if (to)
+        cairo_surface_destroy(to);
+    poppler_page_transition_free(trans);
+
+    if (frame_pacing.transition)
+        gdk_frame_clock_request_phase(frame_pacing.clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+}
+
+void main_transition_step(GdkFrameClock *clock)
+{
+    gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+    gint64 refresh_interval = 0;
+
+    gdk_frame_clock_get_refresh_info(clock, frame_time, &refresh_interval, NULL);
+    if (refresh_interval <= 0)
+        refresh_interval = G_USEC_PER_SEC / 60;
+
+    if (transition_step(frame_pacing.transition, frame_time, refresh_interval))
+        gdk_frame_clock_request_phase(clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+    else
+        main_transition_stop();
+    gtk_widget_queue_draw(windows[0].win);
+}
+
+void main_transition_stop(void)
+{
+    if (!frame_pacing.transition)
+        return;
+    frame_pacing.missed += transition_get_missed(frame_pacing.transition);
+    transition_free(frame_pacing.transition);
+    frame_pacing.transition = NULL;
+}
+
+/* the projector keeps the images of pages on either side of a transition */
+gboolean main_transition_wanted(unsigned int id, int index)
+{
+    PopplerPageTransition *trans;
+    gboolean wanted = FALSE;
+    int i;
+
+    if (id != 0 || _config.no_transitions)
+        return FALSE;
+    for (i = index; i <= index + 1 && !wanted; i++) {
+        if ((trans = page_cache_get_page_transition(i)) == NULL)
+            continue;
+        wanted = trans->type != POPPLER_PAGE_TRANSITION_REPLACE;
+        poppler_page_transition_free(trans);
+    }
+    return wanted;
+}
+
+/* a window painting the flip later than the frame it was applied in missed it */
+void main_frame_check_flip(unsigned int id, GtkWidget *widget)
+{
+    GdkFrameClock *clock;
+    gint64 frame_time, refresh_interval = 0;
+
+    if (!(frame_pacing.flip_windows & (1 << id)))
+        return;
+    frame_pacing.flip_windows &= ~(1 << id);
+
+    if ((clock = gtk_widget_get_frame_clock(widget)) == NULL)
+        return;
+    frame_time = gdk_frame_clock_get_frame_time(clock);
+    gdk_frame_clock_get_refresh_info(clock, frame_time, &refresh_interval, NULL);
+    if (refresh_interval <= 0)
+        refresh_interval = G_USEC_PER_SEC / 60;
+
+    if (frame_time - frame_pacing.flip_time > refresh_interval / 2)
+        frame_pacing.missed++;
+}
+
+void main_overlay_set_tool(OverlayTool tool)
+{
+    UtilPoint pt;
+
+    if (overlay_get_pointer(&pt)) {
+        overlay_set_pointer(NULL);
+        main_overlay_queue_draw(&pt, &pt);
+    }
+    overlay_set_tool(overlay_get_tool() == tool ? OVERLAY_TOOL_NONE : tool);
+    overlay_latency.worst = 0;
+    overlay_latency.late = 0;
+    if (windows[1].window_mode == WINDOW_MODE_CONSOLE)
+        gtk_widget_queue_draw_area(windows[1].win, 0, windows[1].cy - MAIN_STATUS_HEIGHT,
+                                   windows[1].cx, MAIN_STATUS_HEIGHT);
+}
+
+void main_overlay_clear_page(void)
+{
+    if (overlay_clear_page(_state.display_page) == 0) {
+        gtk_widget_queue_draw(windows[0].win);
+        gtk_widget_queue_draw(windows[1].win);
+    }
+}
+
+/* Where the current slide is in the window. The console only shows it when
+ * there is neither a preview nor a notes half, so only then it has the
+ * overlay and takes input for it. */
+int main_overlay_area(unsigned int id, UtilRect *area)
+{
+    double w = _state.page_width, h = _state.page_height;
+    double width, height, scale;
+    gboolean do_center;
+    gboolean split = (_state.page_guess_split && _config.force_notes == 0) || _config.force_notes == 1;
+
+    if (windows[id].render == render_presentation_window) {
+        width = windows[id].cx;
+        height = windows[id].cy;
+        do_center = TRUE;
+    }
+    else if (windows[id].render == render_console_window && !_config.show_preview && !split) {
+        width = (int)(windows[id].cx * 0.8);
+        height = (int)(windows[id].cy * 0.8);
+        do_center = FALSE;
+    }
+    else {
+        return 1;
+    }
+
+    if (split)
+        w *= 0.5f;
+    if (w <= 0.0f || h <= 0.0f)
+        return 1;
+
+    scale = MIN(width / w, height / h);
+    area->x1 = do_center ? (width - scale * w) * 0.5f : 0.0f;
+    area->y1 = do_center ? (height - scale * h) * 0.5f : 0.0f;
+    area->x2 = area->x1 + scale * w;
+    area->y2 = area->y1 + scale * h;
+    return 0;
+}
+
+/* returns 1 if the position is not on the slide */
+int main_overlay_from_window(unsigned int id, double wx, double wy, UtilPoint *pt)
+{
+    UtilRect area;
+
+    if (main_overlay_area(id, &area) != 0)
+        return 1;
+    pt->x = (wx - area.x1) / (area.x2 - area.x1);
+    pt->y = (wy - area.y1) / (area.y2 - area.y1);
+    if (pt->x < 0.0f || pt->y < 0.0f || pt->x > 1.0f || pt->y > 1.0f)
+        return 1;
+    return 0;
+}
+
+/* invalidates the box around the points on both windows, never the whole slide;
+ * latency is measured from here to the projector's next draw */
+void main_overlay_queue_draw(UtilPoint *a, UtilPoint *b)
+{
+    UtilRect area;
+    double margin, x1, y1, x2, y2;
+    unsigned int id;
+
+    for (id = 0; id < 2; id++) {
+        if (main_overlay_area(id, &area) != 0)
+            continue;
+        if (id == 0 && !overlay_latency.input_time)
+            overlay_latency.input_time = g_get_monotonic_time();
+        margin = overlay_get_margin(area.y2 - area.y1);
+        x1 = area.x1 + MIN(a->x, b->x) * (area.x2 - area.x1) - margin;
+        y1 = area.y1 + MIN(a->y, b->y) * (area.y2 - area.y1) - margin;
+        x2 = area.x1 + MAX(a->x, b->x) * (area.x2 - area.x1) + margin;
+        y2 = area.y1 + MAX(a->y, b->y) * (area.y2 - area.y1) + margin;
+        gtk_widget_queue_draw_area(windows[id].win, (int)x1, (int)y1,
+                                   (int)(x2 - x1) + 1, (int)(y2 - y1) + 1);
+    }
+}
+
+/* adds the new segment to ink layers that were up to date before it */
+void main_overlay_ink_segment(UtilPoint *a, UtilPoint *b, guint serial)
+{
+    unsigned int id;
+    cairo_t *cr;
+
+    for (id = 0; id < 2; id++) {
+        if (!windows[id].ink.surface || windows[id].ink.page != _state.display_page ||
+                windows[id].ink.serial != serial)
+            continue;
+        cr = cairo_create(windows[id].ink.surface);
+        overlay_render_segment(cr, a, b, windows[id].ink.width, windows[id].ink.height);
+        cairo_destroy(cr);
+        windows[id].ink.serial = overlay_get_serial();
+    }
+}
+
+void main_render_overlay(unsigned int id, cairo_t *cr)
+{
+    UtilRect area;
+    UtilPoint pt;
+    int width, height;
+    cairo_t *lcr;
+
+    if (main_overlay_area(id, &area) != 0)
+        return;
+    width = (int)(area.x2 - area.x1 + 0.5f);
+    height = (int)(area.y2 - area.y1 + 0.5f);
+
+    if (overlay_has_ink(_state.display_page)) {
+        if (!windows[id].ink.surface || windows[id].ink.page != _state.display_page ||
+                windows[id].ink.width != width || windows[id].ink.height != height ||
+                windows[id].ink.serial != overlay_get_serial()) {
+            if (windows[id].ink.surface)
+                cairo_surface_destroy(windows[id].ink.surface);
+            windows[id].ink.surface = cairo_surface_create_similar(cairo_get_target(cr), CAIRO_CONTENT_COLOR_ALPHA,
+                                                                   MAX(width, 1), MAX(height, 1));
+            windows[id].ink.page = _state.display_page;
+            windows[id].ink.width = width;
+            windows[id].ink.height = height;
+            windows[id].ink.serial = overlay_get_serial();
+            lcr = cairo_create(windows[id].ink.surface);
+            overlay_render_ink(lcr, _state.display_page, width, height);
+            cairo_destroy(lcr);
+        }
+        cairo_set_source_surface(cr, windows[id].ink.surface, (int)area.x1, (int)area.y1);
+        cairo_paint_with_alpha(cr, OVERLAY_INK_ALPHA);
+    }
+
+    if (overlay_get_pointer(&pt)) {
+        cairo_save(cr);
+        cairo_translate(cr, (int)area.x1, (int)area.y1);
+        overlay_render_pointer(cr, &pt, width, height);
+        cairo_restore(cr);
+    }
+}
+
+void main_overlay_check_latency(GtkWidget *widget)
+{
+    GdkFrameClock *clock;
+    gint64 refresh_interval = 0;
+
+    if (!overlay_latency.input_time)
+        return;
+    overlay_latency.last = g_get_monotonic_time() - overlay_latency.input_time;
+    overlay_latency.input_time = 0;
+    overlay_latency.worst = MAX(overlay_latency.worst, overlay_latency.last);
+
+    if ((clock = gtk_widget_get_frame_clock(widget)) != NULL)
+        gdk_frame_clock_get_refresh_info(clock, gdk_frame_clock_get_frame_time(clock), &refresh_interval, NULL);
+    if (refresh_interval <= 0)
+        refresh_interval = G_USEC_PER_SEC / 60;
+    if (overlay_latency.last > refresh_interval)
+        overlay_latency.late++;
+}
+
+static void page_action_callback(unsigned int action, void *data)
+{
     switch (action) {
         case PRESENTATION_ACTION_PAGE_CHANGED:
-            index = presentation_get_current_page();
-            page_cache_fetch_page(index, NULL, &w, &h, &_state.page_guess_split);
-            _state.page_width = (double)w;
-            _state.page_height = (double)h;
-            gtk_widget_queue_draw(windows[0].win);
-            gtk_widget_queue_draw(windows[1].win);
+            main_request_flip();
+            break;
+        case PRESENTATION_ACTION_FIND:
+            main_search_start();
             break;
         case PRESENTATION_ACTION_QUIT:
             main_quit();
@@ -676,6 +1875,19 @@ static void page_action_callback(unsigned int action, void *data)
     }
 }
 
+gboolean _main_parse_power_option(const gchar *option_name, const gchar *value, gpointer data, GError **error)
+{
+    if (g_strcmp0(value, "auto") == 0)
+        _config.power_profile = POWER_PROFILE_AUTO;
+    else if (g_strcmp0(value, "performance") == 0)
+        _config.power_profile = POWER_PROFILE_PERFORMANCE;
+    else if (g_strcmp0(value, "saving") == 0)
+        _config.power_profile = POWER_PROFILE_SAVING;
+    else
+        return FALSE;
+    return TRUE;
+}
+
 gboolean _main_parse_option(const gchar *option_name, const gchar *value, gpointer data, GError **error)
 {
     int val;
@@ -709,6 +1921,21 @@ gboolean _main_parse_option(const gchar *option_name, const gchar *value, gpoint
     else if (g_strcmp0(option_name, "--no-cache") == 0) {
         _config.disable_cache = 1;
     }
+    else if (g_strcmp0(option_name, "--startup-timings") == 0) {
+        _config.startup_timings = 1;
+    }
+    else if (g_strcmp0(option_name, "--reserve-ui-core") == 0) {
+        _config.reserve_ui_core = 1;
+    }
+    else if (g_strcmp0(option_name, "--power-report") == 0) {
+        _config.power_report = 1;
+    }
+    else if (g_strcmp0(option_name, "--debug-wakeups") == 0) {
+        _config.debug_wakeups = 1;
+    }
+    else if (g_strcmp0(option_name, "--no-transitions") == 0) {
+        _config.no_transitions = 1;
+    }
     else if (g_strcmp0(option_name, "--preview") == 0 ||
              g_strcmp0(option_name, "-p") == 0) {
         if (value)
@@ -728,12 +1955,21 @@ static GOptionEntry entries[] = {
     { "preview", 'p', G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Show preview of next slide", "value" },
     { "height", 'h', 0, G_OPTION_ARG_INT, &_config.scale_to_height, "Use pixmap of this height for prerendering", "N" },
     { "no-cache", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Do not cache pages", NULL },
+    { "no-transitions", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Cut instead of showing page transitions", NULL },
+    { "power", 0, 0, G_OPTION_ARG_CALLBACK, _main_parse_power_option, "Power profile: auto, performance or saving", "profile" },
+    { "power-report", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Print context switches and CPU time every minute", NULL },
+    { "debug-wakeups", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Print main loop wakeups per second", NULL },
+    { "reserve-ui-core", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Keep background work off one CPU", NULL },
+    { "cache-budget", 0, 0, G_OPTION_ARG_INT, &_config.cache_budget, "Keep cached pages of all documents within N MiB", "N" },
+    { "render-workers", 0, 0, G_OPTION_ARG_INT, &_config.render_workers, "Parse and render the document in N separate processes", "N" },
+    { "startup-timings", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, _main_parse_option, "Print the time spent in each phase of startup", NULL },
     { "overview-page-width", 'w', 0, G_OPTION_ARG_INT, &_config.overview_page_width, "Prerender overview page to this width", "N" },
     { NULL }
 };
 
 void main_read_config(int argc, char **argv)
 {
+    int i;
     /* set defaults */
     memset(&_config, 0, sizeof(struct _PresenterConfig));
     _config.show_console = 1;
@@ -763,24 +1999,36 @@ void main_read_config(int argc, char **argv)
         exit(1);
     }
 
+    _config.playlist = g_malloc0(sizeof(gchar *) * argc);
+    for (i = 1; i < argc; i++)
+        _config.playlist[i - 1] = g_strdup(argv[i]);
+    _config.playlist_length = argc - 1;
     _config.filename = g_strdup(argv[1]);
 
 }
 
+void main_cancel_overview_prerender(void)
+{
+    /* stops after the current cell; returns once the job is done */
+    job_token_cancel(overview_grid_token);
+    job_wait(overview_grid_job);
+    job_unref(overview_grid_job);
+    job_token_unref(overview_grid_token);
+    overview_grid_job = NULL;
+    overview_grid_token = NULL;
+}
+
 void main_quit(void)
 {
-    /* if we are still in prerender thread, cancel it */
-    if (g_atomic_int_get(&overview_grid_surface_status) == 2) {
-        g_atomic_int_set(&cancel_running_threads, 1);
-        g_mutex_lock(&overview_grid_lock);
-        g_mutex_unlock(&overview_grid_lock);
-    }
+    main_cancel_overview_prerender();
     gtk_main_quit();
 }
 
 void main_reconfigure_windows(void)
 {
     mode_class[current_mode].handle_reconfigure();
+    /* the console may have appeared or gone */
+    main_clock_schedule();
 }
 
 void main_recalc_window_page_display(void)
@@ -811,12 +2059,35 @@ void config_toggle_console(void)
     main_reconfigure_windows();
 }
 
+/* one-shot, rescheduled for the next boundary while the console is shown */
 gboolean main_regular_update(gpointer data)
 {
-    if (_config.show_console) {
-        gtk_widget_queue_draw(windows[1].win);
+    clock_source = 0;
+    if (_config.show_console && windows[1].window_mode == WINDOW_MODE_CONSOLE) {
+        gtk_widget_queue_draw_area(windows[1].win, 0, windows[1].cy - MAIN_STATUS_HEIGHT,
+                                   windows[1].cx, MAIN_STATUS_HEIGHT);
     }
-    return TRUE;
+    main_clock_schedule();
+    return FALSE;
+}
+
+/* Wake up right after the next second (or minute) boundary, when the clock
+ * text changes, as long as the console shows the clock. */
+void main_clock_schedule(void)
+{
+    gint64 period, now;
+
+    if (!_config.show_console || windows[1].window_mode != WINDOW_MODE_CONSOLE) {
+        if (clock_source)
+            g_source_remove(clock_source);
+        clock_source = 0;
+        return;
+    }
+    if (clock_source)
+        return;
+    period = (_config.power_profile == POWER_PROFILE_SAVING ? MAIN_POWER_SAVING_UPDATE_SECONDS : 1) * G_USEC_PER_SEC;
+    now = g_get_real_time();
+    clock_source = g_timeout_add((guint)((period - now % period) / 1000) + 1, main_regular_update, NULL);
 }
 
 void main_update(void)
@@ -825,36 +2096,131 @@ void main_update(void)
     gtk_widget_queue_draw(windows[1].win);
 }
 
+/* one-shot timeout, moved to the remaining time if the pointer moved meanwhile */
 gboolean main_check_mouse_motion(gpointer data)
 {
+    gint64 elapsed = (g_get_monotonic_time() - pointer_motion_time) / 1000;
+
+    if (elapsed < MAIN_HIDE_CURSOR_MS) {
+        hide_cursor_source = g_timeout_add((guint)(MAIN_HIDE_CURSOR_MS - elapsed), main_check_mouse_motion, NULL);
+        return FALSE;
+    }
+
     if (!blank_cursor)
         blank_cursor = /*gdk_cursor_new(GDK_BLANK_CURSOR);*/
             gdk_cursor_new_from_name(gdk_display_get_default(), "none");
-    gdouble elapsed = g_timer_elapsed(hide_cursor_timer, NULL);
-    if (elapsed > 3) {
-        g_timer_stop(hide_cursor_timer);
-        g_timer_reset(hide_cursor_timer);
-        hide_cursor_source = 0;
-        gdk_window_set_cursor(gtk_widget_get_window(windows[0].win), blank_cursor);
-        gdk_window_set_cursor(gtk_widget_get_window(windows[1].win), blank_cursor);
-        return FALSE;
-    }
-    return TRUE;
+    hide_cursor_source = 0;
+    gdk_window_set_cursor(gtk_widget_get_window(windows[0].win), blank_cursor);
+    gdk_window_set_cursor(gtk_widget_get_window(windows[1].win), blank_cursor);
+    return FALSE;
+}
+
+void main_pointer_moved(void)
+{
+    pointer_motion_time = g_get_monotonic_time();
+    if (!hide_cursor_source)
+        hide_cursor_source = g_timeout_add(MAIN_HIDE_CURSOR_MS, main_check_mouse_motion, NULL);
 }
 
+/* the old version stays on screen until the new one is ready */
 void main_reload_document(void)
 {
-    page_cache_stop_caching();
-    page_cache_unload_document();
+    if (_state.reload_source) {
+        g_source_remove(_state.reload_source);
+        _state.reload_source = 0;
+    }
+    page_cache_reload_document_async(_config.filename, main_reload_document_finished, NULL);
+}
 
-    page_cache_load_document(_config.filename);
-    if (_config.disable_cache == 0)
-        page_cache_start_caching();
+void main_reload_document_finished(int result, gpointer userdata)
+{
+    if (result != 0)
+        return;
+
+    /* ink belongs to the content of a page, which may have moved */
+    overlay_clear();
 
     presentation_update();
+    if (current_mode == PRESENTATION_MODE_SEARCH)
+        main_search_update();
+
+    main_cancel_overview_prerender();
+    page_overview_update();
+    main_prerender_overview_grid();
+}
+
+/* Switch to the previous or next document of the playlist. */
+void main_playlist_switch(gint delta)
+{
+    gint index = (gint)_state.playlist_index + delta;
+    PageCacheInstance *cache;
+
+    if (index < 0 || index >= (gint)_config.playlist_length)
+        return;
+
+    if ((cache = _state.playlist_caches[index]) == NULL)
+        cache = _state.playlist_caches[index] = page_cache_instance_new();
+    /* take over a prefetch still running, load it here if there is none */
+    if (page_cache_instance_finish_loading(cache) != 0 &&
+            page_cache_instance_load_document(cache, _config.playlist[index]) != 0) {
+        fprintf(stderr, "Error loading document %s\n", _config.playlist[index]);
+        return;
+    }
+
+    g_list_free(history_list);
+    history_list = NULL;
+    overlay_clear();
+
+    presentation_switch_document(cache);
+    _state.playlist_index = index;
+    g_free(_config.filename);
+    _config.filename = g_strdup(_config.playlist[index]);
+
+    main_file_monitor_cleanup();
+    main_file_monitor_start();
+
+    if (current_mode == PRESENTATION_MODE_SEARCH)
+        main_search_update();
 
+    main_cancel_overview_prerender();
     page_overview_update();
     main_prerender_overview_grid();
+
+    main_playlist_prefetch();
+}
+
+/* Load the next document in the background, so switching to it is
+ * instant. Documents more than one step away are dropped. */
+void main_playlist_prefetch(void)
+{
+    guint i, next = _state.playlist_index + 1;
+
+    for (i = 0; i < _config.playlist_length; i++) {
+        if (i + 1 < _state.playlist_index || i > next) {
+            page_cache_instance_free(_state.playlist_caches[i]);
+            _state.playlist_caches[i] = NULL;
+        }
+    }
+
+    if (next < _config.playlist_length && _state.playlist_caches[next] == NULL) {
+        _state.playlist_caches[next] = page_cache_instance_new();
+        page_cache_instance_load_document_async(_state.playlist_caches[next], _config.playlist[next],
+                                                main_playlist_prefetch_finished, _state.playlist_caches[next]);
+    }
+}
+
+/* the document may have been switched to while it was loaded */
+void main_playlist_prefetch_finished(int result, gpointer userdata)
+{
+    if (userdata == page_cache_get_presented())
+        main_reload_document_finished(result, NULL);
+}
+
+gboolean main_reload_document_timeout(gpointer data)
+{
+    _state.reload_source = 0;
+    main_reload_document();
+    return FALSE;
 }
 
 void toggle_fullscreen(guint win_id)
@@ -888,6 +2254,10 @@ void main_file_monitor_start(void)
 
 void main_file_monitor_cleanup(void)
 {
+    if (_state.reload_source)
+        g_source_remove(_state.reload_source);
+    _state.reload_source = 0;
+
     if (_state.monitor)
         g_object_unref(_state.monitor);
     if (_state.document)
@@ -899,9 +2269,14 @@ void main_file_monitor_cleanup(void)
 
 void main_file_monitor_cb(GFileMonitor *monitor, GFile *first, GFile *second, GFileMonitorEvent event, gpointer data)
 {
-    /* TODO: Handle move; change: start timer to reload if changes_done_hint isn’t there yet */
-    if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) {
-        main_reload_document();
+    /* writers produce bursts of events; reload once the file has been quiet for a while */
+    if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+            event == G_FILE_MONITOR_EVENT_CHANGED ||
+            event == G_FILE_MONITOR_EVENT_CREATED ||
+            event == G_FILE_MONITOR_EVENT_MOVED_IN) {
+        if (_state.reload_source)
+            g_source_remove(_state.reload_source);
+        _state.reload_source = g_timeout_add(MAIN_RELOAD_DEBOUNCE_MS, main_reload_document_timeout, NULL);
     }
 }
 
@@ -923,18 +2298,28 @@ gboolean mode_normal_handle_key_press(GtkWidget *widget, GdkEventKey *event, gpo
 {
     int do_reconfigure = 0;
     switch (event->keyval) {
+        case GDK_KEY_Prior:
+            if (event->state & GDK_CONTROL_MASK) {
+                main_playlist_switch(-1);
+                break;
+            }
+            /* fall through */
         case GDK_KEY_Left:
         case GDK_KEY_Up:
-        case GDK_KEY_Prior:
             presentation_page_prev();
             break;
+        case GDK_KEY_Next:
+            if (event->state & GDK_CONTROL_MASK) {
+                main_playlist_switch(1);
+                break;
+            }
+            /* fall through */
         case GDK_KEY_Right:
         case GDK_KEY_Down:
         case GDK_KEY_KP_Space:
         case GDK_KEY_KP_Enter:
         case GDK_KEY_Return:
         case GDK_KEY_space:
-        case GDK_KEY_Next:
             presentation_page_next();
             break;
         case GDK_KEY_Home:
@@ -954,15 +2339,31 @@ gboolean mode_normal_handle_key_press(GtkWidget *widget, GdkEventKey *event, gpo
             do_reconfigure = 1;
             break;
         case GDK_KEY_f:
+            if (event->state & GDK_CONTROL_MASK) {
+                main_search_start();
+                break;
+            }
             toggle_fullscreen(GPOINTER_TO_UINT(data));
             do_reconfigure = 1;
             break;
+        case GDK_KEY_slash:
+            main_search_start();
+            break;
         case GDK_KEY_r:
             main_reload_document();
             break;
         case GDK_KEY_p:
             config_step_preview();
             break;
+        case GDK_KEY_l:
+            main_overlay_set_tool(OVERLAY_TOOL_POINTER);
+            break;
+        case GDK_KEY_i:
+            main_overlay_set_tool(OVERLAY_TOOL_INK);
+            break;
+        case GDK_KEY_e:
+            main_overlay_clear_page();
+            break;
 /*        case GDK_KEY_Escape:*/
         case GDK_KEY_o:
             if (event->state & GDK_CONTROL_MASK) {
@@ -991,8 +2392,22 @@ gboolean mode_normal_handle_button_press(GtkWidget *widget, GdkEventButton *even
     unsigned int id = GPOINTER_TO_UINT(data);
     double px, py;
     int found_link = 0;
+    UtilPoint pt, prev;
+    guint serial;
+
+    /* drawing takes the first button, the other one still goes back */
+    if (overlay_get_tool() == OVERLAY_TOOL_INK && event->button == 1 && event->type == GDK_BUTTON_PRESS &&
+            main_overlay_from_window(id, event->x, event->y, &pt) == 0) {
+        serial = overlay_get_serial();
+        overlay_stroke_begin(_state.display_page, &pt, &prev);
+        main_overlay_ink_segment(&prev, &pt, serial);
+        main_overlay_queue_draw(&prev, &pt);
+        return TRUE;
+    }
     /* TODO: Handle preview pages correctly */
-    if (!_config.show_preview && event->button == 1 && main_window_to_page(id, (int)event->x, (int)event->y, &px, &py) == 0) {
+    /* links are only loaded for the page navigation stops at */
+    if (!_config.show_preview && !_state.display_thumbnail &&
+            event->button == 1 && main_window_to_page(id, (int)event->x, (int)event->y, &px, &py) == 0) {
         if (presentation_perform_action_at(px, py) == 0) {
             found_link = 1;
         }
@@ -1022,7 +2437,35 @@ gboolean mode_normal_handle_motion_event(GtkWidget *widget, GdkEventMotion *even
     unsigned int id = GPOINTER_TO_UINT(data);
     int found_link = 0;
     double px, py;
-    if (!_config.show_preview && main_window_to_page(id, (int)event->x, (int)event->y, &px, &py) == 0) {
+    UtilPoint pt, prev;
+    gboolean on_slide, shown;
+    guint serial;
+
+    if (overlay_get_tool() != OVERLAY_TOOL_NONE) {
+        on_slide = main_overlay_from_window(id, event->x, event->y, &pt) == 0;
+
+        if (overlay_get_tool() == OVERLAY_TOOL_POINTER) {
+            if ((shown = overlay_get_pointer(&prev)) != FALSE)
+                main_overlay_queue_draw(&prev, &prev);
+            if (on_slide) {
+                overlay_set_pointer(&pt);
+                main_overlay_queue_draw(&pt, &pt);
+            }
+            else if (shown) {
+                overlay_set_pointer(NULL);
+            }
+        }
+        else if (on_slide && (event->state & GDK_BUTTON1_MASK)) {
+            serial = overlay_get_serial();
+            if (overlay_stroke_extend(_state.display_page, &pt, &prev) == 0) {
+                main_overlay_ink_segment(&prev, &pt, serial);
+                main_overlay_queue_draw(&prev, &pt);
+            }
+        }
+    }
+
+    if (!_config.show_preview && !_state.display_thumbnail &&
+            main_window_to_page(id, (int)event->x, (int)event->y, &px, &py) == 0) {
         if (page_cache_get_action_from_pos(px, py)) {
             found_link = 1;
         }
@@ -1033,11 +2476,7 @@ gboolean mode_normal_handle_motion_event(GtkWidget *widget, GdkEventMotion *even
     else {
         gdk_window_set_cursor(gtk_widget_get_window(widget), NULL);
     }
-    if (!hide_cursor_timer)
-        hide_cursor_timer = g_timer_new();
-    g_timer_start(hide_cursor_timer);
-    if (!hide_cursor_source)
-        hide_cursor_source = g_idle_add(main_check_mouse_motion, NULL);
+    main_pointer_moved();
     return FALSE;
 }
 
@@ -1056,24 +2495,46 @@ void mode_overview_reconfigure_windows(void)
     }
 }
 
+/* repaints a cell of the visible grid in every overview window */
+void main_overview_queue_draw_cell(guint row, guint column)
+{
+    unsigned int i;
+    double scale;
+
+    for (i = 0; i < 2; i++) {
+        if (windows[i].window_mode != WINDOW_MODE_OVERVIEW || windows[i].render != render_overview_window)
+            continue;
+        scale = ((double)windows[i].cx)/(_config.overview_columns * overview_cell_width);
+        /* the selection outline is stroked across the cell border */
+        gtk_widget_queue_draw_area(windows[i].win,
+                                   (int)(column * overview_cell_width * scale) - 2,
+                                   (int)(row * overview_cell_height * scale) - 2,
+                                   (int)(overview_cell_width * scale) + 4,
+                                   (int)(overview_cell_height * scale) + 4);
+    }
+}
+
 gboolean mode_overview_handle_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
+    guint row, column, new_row, new_column, offset = page_overview_get_offset();
+    gint dx = 0, dy = 0;
+
     switch (event->keyval) {
         case GDK_KEY_Tab:
         case GDK_KEY_Escape:
             main_set_mode(PRESENTATION_MODE_NORMAL);
             break;
         case GDK_KEY_Left:
-            page_overview_move(-1, 0);
+            dx = -1;
             break;
         case GDK_KEY_Right:
-            page_overview_move(1, 0);
+            dx = 1;
             break;
         case GDK_KEY_Down:
-            page_overview_move(0, 1);
+            dy = 1;
             break;
         case GDK_KEY_Up:
-            page_overview_move(0, -1);
+            dy = -1;
             break;
         case GDK_KEY_Return:
         case GDK_KEY_KP_Enter:
@@ -1102,6 +2563,18 @@ gboolean mode_overview_handle_key_press(GtkWidget *widget, GdkEventKey *event, g
             break;
     }
 
+    /* only the old and new cell change unless the grid scrolls */
+    if (dx != 0 || dy != 0) {
+        page_overview_get_selection(&row, &column);
+        page_overview_move(dx, dy);
+        page_overview_get_selection(&new_row, &new_column);
+        if (offset == page_overview_get_offset()) {
+            main_overview_queue_draw_cell(row, column);
+            main_overview_queue_draw_cell(new_row, new_column);
+            return FALSE;
+        }
+    }
+
     gtk_widget_queue_draw(windows[0].win);
     gtk_widget_queue_draw(windows[1].win);
 
@@ -1145,11 +2618,134 @@ gboolean mode_overview_handle_scroll_event(GtkWidget *widget, GdkEventScroll *ev
 gboolean mode_overview_handle_motion_event(GtkWidget *widget, GdkEventMotion *event, gpointer data)
 {
     gdk_window_set_cursor(gtk_widget_get_window(widget), NULL);
-    if (!hide_cursor_timer)
-        hide_cursor_timer = g_timer_new();
-    g_timer_start(hide_cursor_timer);
-    if (!hide_cursor_source)
-        hide_cursor_source = g_idle_add(main_check_mouse_motion, NULL);
+    main_pointer_moved();
+    return FALSE;
+}
+
+void mode_search_reconfigure_windows(void)
+{
+    windows[1].render = render_search_window;
+    windows[1].window_mode = WINDOW_MODE_SEARCH;
+
+    if (_config.show_console) {
+        windows[0].render = render_presentation_window;
+        windows[0].window_mode = WINDOW_MODE_PRESENTATION;
+    }
+    else {
+        windows[0].render = render_search_window;
+        windows[0].window_mode = WINDOW_MODE_SEARCH;
+    }
+}
+
+gboolean mode_search_handle_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    gunichar c;
+    const gchar *last;
+    guint count = search_results ? search_results->len : 0;
+
+    switch (event->keyval) {
+        case GDK_KEY_Escape:
+            main_search_finish();
+            return TRUE;
+        case GDK_KEY_Return:
+        case GDK_KEY_KP_Enter:
+            if (count > 0) {
+                main_history_mark_current();
+                presentation_page_goto(g_array_index(search_results, SearchResult, search_selection).page);
+            }
+            main_search_finish();
+            return TRUE;
+        case GDK_KEY_Left:
+        case GDK_KEY_Up:
+            if (search_selection > 0)
+                search_selection--;
+            break;
+        case GDK_KEY_Right:
+        case GDK_KEY_Down:
+            if (search_selection + 1 < count)
+                search_selection++;
+            break;
+        case GDK_KEY_BackSpace:
+            if (search_query->len > 0) {
+                last = g_utf8_find_prev_char(search_query->str, search_query->str + search_query->len);
+                g_string_truncate(search_query, last ? last - search_query->str : 0);
+                main_search_update();
+            }
+            break;
+        default:
+            c = gdk_keyval_to_unicode(event->keyval);
+            if (c == 0 || !g_unichar_isprint(c) || (event->state & GDK_CONTROL_MASK))
+                return FALSE;
+            g_string_append_unichar(search_query, c);
+            main_search_update();
+            break;
+    }
+
+    gtk_widget_queue_draw(windows[0].win);
+    gtk_widget_queue_draw(windows[1].win);
+
+    return TRUE;
+}
+
+gboolean mode_search_handle_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+    return FALSE;
+}
+
+gboolean mode_search_handle_scroll_event(GtkWidget *widget, GdkEventScroll *event, gpointer data)
+{
+    guint count = search_results ? search_results->len : 0;
+
+    if (event->direction == GDK_SCROLL_UP && search_selection > 0)
+        search_selection--;
+    else if (event->direction == GDK_SCROLL_DOWN && search_selection + 1 < count)
+        search_selection++;
+
+    gtk_widget_queue_draw(windows[0].win);
+    gtk_widget_queue_draw(windows[1].win);
+
+    return TRUE;
+}
+
+void main_search_start(void)
+{
+    if (!search_query)
+        search_query = g_string_new(NULL);
+    g_string_truncate(search_query, 0);
+    main_set_mode(PRESENTATION_MODE_SEARCH);
+    main_search_update();
+}
+
+void main_search_finish(void)
+{
+    if (search_retry_source) {
+        g_source_remove(search_retry_source);
+        search_retry_source = 0;
+    }
+    search_results_free(search_results);
+    search_results = NULL;
+    main_set_mode(PRESENTATION_MODE_NORMAL);
+}
+
+/* runs on every keystroke, the index makes this independent of the page count */
+void main_search_update(void)
+{
+    search_results_free(search_results);
+    search_results = page_cache_search(search_query->str, MAIN_SEARCH_MAX_RESULTS);
+    search_selection = 0;
+
+    if (!search_results && !search_retry_source)
+        search_retry_source = g_timeout_add(MAIN_SEARCH_RETRY_MS, main_search_retry, NULL);
+
+    gtk_widget_queue_draw(windows[0].win);
+    gtk_widget_queue_draw(windows[1].win);
+}
+
+gboolean main_search_retry(gpointer data)
+{
+    search_retry_source = 0;
+    if (current_mode == PRESENTATION_MODE_SEARCH)
+        main_search_update();
     return FALSE;
 }
 
@@ -1187,6 +2783,17 @@ void main_init_modes(void)
         mode_overview_handle_scroll_event;
     mode_class[PRESENTATION_MODE_OVERVIEW].handle_motion_event =
         mode_overview_handle_motion_event;
+
+    mode_class[PRESENTATION_MODE_SEARCH].handle_reconfigure =
+        mode_search_reconfigure_windows;
+    mode_class[PRESENTATION_MODE_SEARCH].handle_key_press =
+        mode_search_handle_key_press;
+    mode_class[PRESENTATION_MODE_SEARCH].handle_button_press =
+        mode_search_handle_button_press;
+    mode_class[PRESENTATION_MODE_SEARCH].handle_scroll_event =
+        mode_search_handle_scroll_event;
+    mode_class[PRESENTATION_MODE_SEARCH].handle_motion_event =
+        mode_overview_handle_motion_event;
 }
 
 void main_history_mark_current(void)
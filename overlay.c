@@ -0,0 +1,195 @@
+#include "overlay.h"
+
+/* sizes relative to the height of the slide */
+#define OVERLAY_INK_WIDTH           0.006
+#define OVERLAY_POINTER_RADIUS      0.012
+
+struct _Overlay {
+    OverlayTool tool;
+    UtilPoint pointer;
+    gboolean pointer_visible;
+    /* page -> GPtrArray of strokes, each a GArray of UtilPoint */
+    GHashTable *ink;
+    /* the stroke extended by motion, belongs to stroke_page */
+    GArray *stroke;
+    int stroke_page;
+    guint serial;
+} _overlay;
+
+void _overlay_free_strokes(GPtrArray *strokes);
+void _overlay_free_stroke(GArray *stroke);
+void _overlay_set_ink_style(cairo_t *cr, double height);
+
+void _overlay_free_stroke(GArray *stroke)
+{
+    g_array_free(stroke, TRUE);
+}
+
+void _overlay_free_strokes(GPtrArray *strokes)
+{
+    g_ptr_array_free(strokes, TRUE);
+}
+
+void overlay_cleanup(void)
+{
+    if (_overlay.ink)
+        g_hash_table_destroy(_overlay.ink);
+    _overlay.ink = NULL;
+    _overlay.stroke = NULL;
+}
+
+void overlay_set_tool(OverlayTool tool)
+{
+    _overlay.tool = tool;
+    _overlay.stroke = NULL;
+}
+
+OverlayTool overlay_get_tool(void)
+{
+    return _overlay.tool;
+}
+
+void overlay_set_pointer(UtilPoint *pt)
+{
+    _overlay.pointer_visible = pt != NULL;
+    if (pt)
+        _overlay.pointer = *pt;
+}
+
+gboolean overlay_get_pointer(UtilPoint *pt)
+{
+    if (pt && _overlay.pointer_visible)
+        *pt = _overlay.pointer;
+    return _overlay.pointer_visible;
+}
+
+int overlay_stroke_begin(int page, UtilPoint *pt, UtilPoint *prev)
+{
+    GPtrArray *strokes;
+
+    if (!_overlay.ink)
+        _overlay.ink = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                             (GDestroyNotify)_overlay_free_strokes);
+    strokes = g_hash_table_lookup(_overlay.ink, GINT_TO_POINTER(page));
+    if (!strokes) {
+        strokes = g_ptr_array_new_with_free_func((GDestroyNotify)_overlay_free_stroke);
+        g_hash_table_insert(_overlay.ink, GINT_TO_POINTER(page), strokes);
+    }
+
+    _overlay.stroke = g_array_new(FALSE, FALSE, sizeof(UtilPoint));
+    _overlay.stroke_page = page;
+    g_ptr_array_add(strokes, _overlay.stroke);
+
+    g_array_append_val(_overlay.stroke, *pt);
+    _overlay.serial++;
+    if (prev)
+        *prev = *pt;
+    return 0;
+}
+
+int overlay_stroke_extend(int page, UtilPoint *pt, UtilPoint *prev)
+{
+    if (!_overlay.stroke || _overlay.stroke_page != page)
+        return 1;
+
+    if (prev)
+        *prev = g_array_index(_overlay.stroke, UtilPoint, _overlay.stroke->len - 1);
+    g_array_append_val(_overlay.stroke, *pt);
+    _overlay.serial++;
+    return 0;
+}
+
+int overlay_clear_page(int page)
+{
+    if (!_overlay.ink || !g_hash_table_remove(_overlay.ink, GINT_TO_POINTER(page)))
+        return 1;
+    if (_overlay.stroke_page == page)
+        _overlay.stroke = NULL;
+    _overlay.serial++;
+    return 0;
+}
+
+void overlay_clear(void)
+{
+    if (_overlay.ink)
+        g_hash_table_remove_all(_overlay.ink);
+    _overlay.stroke = NULL;
+    _overlay.serial++;
+}
+
+gboolean overlay_has_ink(int page)
+{
+    return _overlay.ink && g_hash_table_lookup(_overlay.ink, GINT_TO_POINTER(page)) != NULL;
+}
+
+guint overlay_get_serial(void)
+{
+    return _overlay.serial;
+}
+
+void _overlay_set_ink_style(cairo_t *cr, double height)
+{
+    cairo_set_source_rgb(cr, 0.9f, 0.1f, 0.1f);
+    cairo_set_line_width(cr, OVERLAY_INK_WIDTH * height);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+}
+
+void overlay_render_ink(cairo_t *cr, int page, double width, double height)
+{
+    GPtrArray *strokes;
+    GArray *stroke;
+    UtilPoint *pt;
+    guint i, k;
+
+    if (!_overlay.ink || (strokes = g_hash_table_lookup(_overlay.ink, GINT_TO_POINTER(page))) == NULL)
+        return;
+
+    cairo_save(cr);
+    _overlay_set_ink_style(cr, height);
+    for (i = 0; i < strokes->len; i++) {
+        stroke = g_ptr_array_index(strokes, i);
+        for (k = 0; k < stroke->len; k++) {
+            pt = &g_array_index(stroke, UtilPoint, k);
+            if (k == 0) {
+                cairo_move_to(cr, pt->x * width, pt->y * height);
+                /* a single point still leaves a dot */
+                cairo_line_to(cr, pt->x * width, pt->y * height);
+            }
+            else {
+                cairo_line_to(cr, pt->x * width, pt->y * height);
+            }
+        }
+        cairo_stroke(cr);
+    }
+    cairo_restore(cr);
+}
+
+void overlay_render_segment(cairo_t *cr, UtilPoint *a, UtilPoint *b, double width, double height)
+{
+    cairo_save(cr);
+    _overlay_set_ink_style(cr, height);
+    cairo_move_to(cr, a->x * width, a->y * height);
+    cairo_line_to(cr, b->x * width, b->y * height);
+    cairo_stroke(cr);
+    cairo_restore(cr);
+}
+
+void overlay_render_pointer(cairo_t *cr, UtilPoint *pt, double width, double height)
+{
+    double radius = OVERLAY_POINTER_RADIUS * height;
+
+    cairo_save(cr);
+    cairo_set_source_rgba(cr, 1.0f, 0.0f, 0.0f, 0.35f);
+    cairo_arc(cr, pt->x * width, pt->y * height, radius, 0.0f, 2 * G_PI);
+    cairo_fill(cr);
+    cairo_set_source_rgb(cr, 1.0f, 0.1f, 0.1f);
+    cairo_arc(cr, pt->x * width, pt->y * height, radius * 0.5f, 0.0f, 2 * G_PI);
+    cairo_fill(cr);
+    cairo_restore(cr);
+}
+
+double overlay_get_margin(double height)
+{
+    return MAX(OVERLAY_POINTER_RADIUS, OVERLAY_INK_WIDTH * 0.5f) * height + 2.0f;
+}
@@ -0,0 +1,47 @@
+#ifndef __OVERLAY_H__
+#define __OVERLAY_H__
+
+#include <glib.h>
+#include <cairo.h>
+#include "utils.h"
+
+/* Laser pointer and ink drawn over the slide. Positions are relative to the
+ * slide, (0, 0) is its top left and (1, 1) its bottom right corner. */
+typedef enum {
+    OVERLAY_TOOL_NONE = 0,
+    OVERLAY_TOOL_POINTER,
+    OVERLAY_TOOL_INK
+} OverlayTool;
+
+void overlay_cleanup(void);
+
+void overlay_set_tool(OverlayTool tool);
+OverlayTool overlay_get_tool(void);
+
+/* NULL hides the pointer */
+void overlay_set_pointer(UtilPoint *pt);
+gboolean overlay_get_pointer(UtilPoint *pt);
+
+/* prev is set to the point the new segment starts at; returns 1 if there
+ * is no stroke on this page to extend */
+int overlay_stroke_begin(int page, UtilPoint *pt, UtilPoint *prev);
+int overlay_stroke_extend(int page, UtilPoint *pt, UtilPoint *prev);
+/* returns 1 if the page had no ink */
+int overlay_clear_page(int page);
+void overlay_clear(void);
+gboolean overlay_has_ink(int page);
+/* changes with every change of the ink on any page */
+guint overlay_get_serial(void);
+
+/* Ink is drawn opaque, so segments and strokes do not darken where they
+ * overlap; the layer holding it is painted with OVERLAY_INK_ALPHA. */
+#define OVERLAY_INK_ALPHA 0.9
+
+/* width and height are the size of the slide on the target */
+void overlay_render_ink(cairo_t *cr, int page, double width, double height);
+void overlay_render_segment(cairo_t *cr, UtilPoint *a, UtilPoint *b, double width, double height);
+void overlay_render_pointer(cairo_t *cr, UtilPoint *pt, double width, double height);
+/* pixels the drawing may reach beyond the points, for damage rectangles */
+double overlay_get_margin(double height);
+
+#endif
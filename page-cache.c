@@ -1,455 +1,2015 @@
 #include "page-cache.h"
 #include <memory.h>
 #include "utils.h"
+#include "render-worker.h"
+#include "page-info.h"
+#include "jobs.h"
+#include "search-index.h"
 #include <cairo.h>
 #include <glib.h>
+#include <gio/gio.h>
 #include <zlib.h>
 #include <stdio.h>
 
-#define PAGE_STATE_CREATING_SURFACE      1
-#define PAGE_STATE_COMPRESSING           2
-#define PAGE_STATE_UNCOMPRESSING         4
-#define PAGE_STATE_READY                 8
+/* page state flags, only changed with the page lock held but readable without */
+#define PAGE_STATE_COMPRESSED            1
+#define PAGE_STATE_UNCOMPRESSED          2
+#define PAGE_STATE_POOLED                4
+#define PAGE_STATE_FAILED                8
+
+/* number of released, decompressed surfaces kept for reuse */
+#define PAGE_CACHE_SURFACE_POOL_SIZE     4
+
+/* pages of a version share a fixed set of locks instead of one mutex each */
+#define PAGE_CACHE_LOCK_STRIPES          64
+
+/* pages are compressed in independent bands of this many rows */
+#define PAGE_CACHE_BAND_ROWS             128
+
+/* links of a page are sorted into a grid of this many cells per side */
+#define PAGE_CACHE_LINK_GRID_SIZE        8
+
+/* zlib levels for normal and power saving caching */
+#define PAGE_CACHE_COMPRESSION_LEVEL     6
+#define PAGE_CACHE_POWER_COMPRESSION     Z_BEST_SPEED
+
+/* when saving power, only this many pages on each side of the current one
+ * are cached, in batches with a pause in between */
+#define PAGE_CACHE_POWER_WINDOW          5
+#define PAGE_CACHE_POWER_BATCH           4
+#define PAGE_CACHE_POWER_PAUSE_SECONDS   10
+
+/* under memory pressure, surfaces beyond this are not pooled and, when it
+ * is critical, compressed pages further away from the current one dropped */
+#define PAGE_CACHE_PRESSURE_POOL_SIZE    2
+#define PAGE_CACHE_PRESSURE_KEEP         1
+
+/* height of the thumbnail kept for every cached page, shown while navigating fast */
+#define PAGE_CACHE_THUMBNAIL_HEIGHT      96
 
 struct _Page {
     unsigned int width;
     unsigned int height;
     cairo_surface_t *surf;
     unsigned char *compressed_buffer;
-    unsigned char *uncompressed_buffer;
     gsize buffer_size;
-    GMutex page_lock;
+    /* band b is stored at compressed_buffer[band_offsets[b]..band_offsets[b+1]] */
+    gsize *band_offsets;
+    unsigned int band_count;
+    /* hash of the rendered bitmap, set along with the compressed data */
+    gchar *fingerprint;
+    gint state;
     unsigned int ref_count;
+    unsigned int lease_count;
     unsigned int split_guess : 1;
-    unsigned int compressed : 1;
-    unsigned int uncompressed : 1;
+    /* set once when the page is compressed */
+    cairo_surface_t *thumbnail;
 };
 
-struct _PageCache {
+/* Uniform grid over the bounding box of all links of a page. Cell c lists
+ * the links overlapping it in cell_links[cell_start[c]..cell_start[c+1]],
+ * in the order poppler reported them. */
+struct _PageLinkGrid {
+    double x0;
+    double y0;
+    double cell_width;
+    double cell_height;
+    unsigned int link_count;
+    PopplerLinkMapping **links;
+    unsigned int cell_start[PAGE_CACHE_LINK_GRID_SIZE * PAGE_CACHE_LINK_GRID_SIZE + 1];
+    unsigned int *cell_links;
+};
+
+/* what the hit test of the current page needs; never changed once published */
+struct _PageLinkSnapshot {
+    struct _PageDocument *document;
+    int index;
+    struct _PageLinkGrid *grid;
+    double scale;
+};
+
+/* Everything about a page that does not need rendering, read once in the
+ * background so the hot paths do not have to go through poppler. */
+struct _PageMetadata {
+    double width;
+    double height;
+    gchar *label;
+    GList *links;
+    struct _PageLinkGrid *link_grid;
+    PopplerPageTransition *transition;
+};
+
+/* One version of the document. A reload prepares a new version while the old
+ * one is still presented and then swaps them; everyone working on a version
+ * holds a reference to it. */
+struct _PageDocument {
+    gint ref_count;
+    guint generation;
+    /* unique for every version, unlike generation assigned on creation */
+    guint serial;
+    /* NULL with render workers, which do all the parsing */
     PopplerDocument *doc;
-    GMutex control_lock;
-    GMutex data_lock;
+    /* file contents, shared by every PopplerDocument of this version */
+    GBytes *bytes;
+    gchar *checksum;
+    /* protects doc; background threads take one of the spare documents */
     GMutex poppler_lock;
-    GThread *cache_thread;
-    unsigned int pages_cached;
+    GMutex spare_lock;
+    GQueue spare_docs;
     unsigned int npages;
+    struct _Page *pages;
+    /* statistics, updated atomically whenever a page changes state */
+    gint pages_cached;
+    gint pages_decompressed;
+    gsize cached_size;
+    gsize decompressed_size;
+    /* set by the compress jobs once there is nothing left to compress */
+    gint caching_done;
+    GMutex pool_lock;
+    GQueue surface_pool;
+    GMutex page_locks[PAGE_CACHE_LOCK_STRIPES];
+    /* filled in page order; entries below metadata_pages are immutable */
+    struct _PageMetadata *metadata;
+    GHashTable *named_dests;
+    gint metadata_pages;
+    /* set once the index job is over, named_dests is complete with it */
+    gint metadata_done;
+    Job *index_job;
+    /* built by the text job, NULL until all pages are indexed */
+    SearchIndex *search_index;
+    Job *text_job;
+    /* cancelled once the version is replaced or dropped */
+    JobToken *token;
+    /* the version this one replaced and its compressed pages by fingerprint,
+     * kept until this one is cached; under the control lock */
+    struct _PageDocument *previous;
+    GHashTable *previous_pages;
+    /* instance presenting this version, NULL once it was dropped */
+    PageCacheInstance *cache;
+};
+
+/* One open document. All fields are protected by the control lock. */
+struct _PageCacheInstance {
+    /* never reused, unlike the address */
+    guint id;
+    struct _PageDocument *document;
+    guint reload_serial;
+    /* cancelled when a newer reload is requested */
+    JobToken *reload_token;
+    /* the latest reload until it is put in place */
+    struct _PageCacheReload *reload;
+    Job *reload_job;
+    Job *caching_job;
+    /* a compress job or a batch pause is pending */
+    int caching_pending;
+    unsigned int batch_count;
+    guint batch_source;
     unsigned int current_index;
+};
+
+/* Instances share the job threads, the band pool and the memory budget. */
+struct _PageCache {
+    GList *instances;
+    guint last_instance_id;
+    PageCacheInstance *presented;
+    guint generation;
+    GMutex control_lock;
+    GThreadPool *band_pool;
+    /* cancelled when caching stops */
+    JobToken *caching_token;
     double scale_to_height;
-    struct _Page *pages;
-    GList *page_links;
-    double current_scale;
+    /* links of the current page, replaced as a whole on page change */
+    struct _PageLinkSnapshot *links;
+    gint link_readers;
     int do_caching;
+    gint power_saving;
+    gint memory_pressure;
+    /* for the compressed pages of all instances, 0 for no limit */
+    gsize memory_budget;
+    PageCacheIndexedCallback indexed_callback;
+    gpointer indexed_userdata;
 } _page_cache;
 
-struct _Page *_page_cache_get_page(int index);
-int _page_cache_render_page(int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height);
-int _page_cache_compress_page(int index);
-int _page_cache_uncompress_page(int index);
+struct _PageCacheReload {
+    guint cache_id;
+    gchar *uri;
+    guint serial;
+    unsigned int current_index;
+    struct _PageDocument *old;
+    struct _PageDocument *document;
+    int result;
+    PageCacheReloadCallback callback;
+    gpointer userdata;
+};
+
+struct _PageBandBatch {
+    GMutex lock;
+    GCond cond;
+    guint pending;
+    int failed;
+};
+
+struct _PageBandJob {
+    unsigned char *in;
+    gsize insize;
+    unsigned char *out;
+    gsize outsize;
+    int compress;
+    int done;
+    struct _PageBandBatch *batch;
+};
+
+/* source of PageDocument serials */
+static gint _page_document_serial = 0;
+
+/* the decompressed buffer is owned by the surface created from it */
+static cairo_user_data_key_t _page_cache_buffer_key;
+
+struct _PageDocument *_page_document_new(GBytes *bytes, gchar *checksum);
+PopplerDocument *_page_document_open_instance(struct _PageDocument *d);
+PopplerDocument *_page_document_borrow(struct _PageDocument *d);
+void _page_document_return(struct _PageDocument *d, PopplerDocument *doc);
+int _page_document_page_info(struct _PageDocument *d, int index, guint flags, PageInfo *info);
+struct _PageDocument *_page_document_ref(struct _PageDocument *d);
+void _page_document_unref(struct _PageDocument *d);
+void _page_document_drop(struct _PageDocument *d);
+void _page_document_set_previous(struct _PageDocument *d, struct _PageDocument *old);
+void _page_document_forget_previous(struct _PageDocument *d);
+struct _PageDocument *_page_cache_get_document(void);
+void _page_document_index_job(Job *job, struct _PageDocument *d);
+void _page_document_index_done(struct _PageDocument *d);
+void _page_document_text_job(Job *job, struct _PageDocument *d);
+gboolean _page_document_indexed(struct _PageDocument *d);
+struct _PageMetadata *_page_document_get_metadata(struct _PageDocument *d, int index);
+int _page_document_page_size(struct _PageDocument *d, int index, double *width, double *height);
+GHashTable *_page_document_get_named_dests(struct _PageDocument *d);
+struct _PageLinkGrid *_page_link_grid_new(GList *links);
+void _page_link_grid_free(struct _PageLinkGrid *grid);
+PopplerAction *_page_link_grid_lookup(struct _PageLinkGrid *grid, double x, double y);
+void _page_cache_set_links(struct _PageLinkSnapshot *snapshot);
+void _page_cache_publish_links(struct _PageDocument *d, int index);
+struct _Page *_page_cache_get_page(struct _PageDocument *d, int index);
+#define _page_cache_page_lock(d, index) (&(d)->page_locks[(index) % PAGE_CACHE_LOCK_STRIPES])
+#define _page_cache_page_has_state(pg, flag) (g_atomic_int_get(&(pg)->state) & (flag))
+void _page_cache_page_set_state(struct _Page *pg, gint flag, gboolean set);
+gsize _page_cache_page_surface_size(struct _Page *pg);
+void _page_cache_scaled_size(double pw, double ph, unsigned int *width, unsigned int *height, double *scale);
+int _page_cache_render_page(struct _PageDocument *d, int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height);
+int _page_cache_compress_page(struct _PageDocument *d, int index);
+cairo_surface_t *_page_cache_make_thumbnail(cairo_surface_t *surf, unsigned int width, unsigned int height);
+int _page_cache_uncompress_page(struct _PageDocument *d, int index);
+int _page_cache_page_make_surface(struct _PageDocument *d, int index);
+void _page_cache_page_drop_surface(struct _PageDocument *d, struct _Page *pg);
+int _page_cache_page_acquire(struct _PageDocument *d, int index, PageCacheLease *lease);
+void _page_cache_page_release(struct _PageDocument *d, int index);
+int _page_cache_pool_add(struct _PageDocument *d, int index, struct _Page *pg);
+void _page_cache_pool_evict(struct _PageDocument *d, int index);
+void _page_cache_band_job_proc(struct _PageBandJob *job, gpointer userdata);
+void _page_cache_band_job_run(Job *job, struct _PageBandJob *band);
+int _page_cache_run_band_jobs(struct _PageBandJob *jobs, unsigned int count);
+GBytes *_page_cache_read_document(const gchar *uri, gchar **checksum);
+gchar *_page_cache_bitmap_fingerprint(unsigned char *data, unsigned int width, unsigned int height, unsigned int stride);
+int _page_cache_adopt_page(struct _PageDocument *d, const gchar *fingerprint, unsigned char **compressed,
+                           gsize **offsets, unsigned int *band_count, cairo_surface_t **thumbnail);
+void _page_cache_reload_job(Job *job, struct _PageCacheReload *reload);
+void _page_cache_reload_dispatch(struct _PageCacheReload *reload);
+gboolean _page_cache_reload_finish(struct _PageCacheReload *reload);
+void _page_cache_compress_job(Job *job, struct _PageDocument *d);
+void _page_cache_submit_caching(struct _PageDocument *d);
+int _page_cache_next_page_to_compress(struct _PageDocument *d, unsigned int current, unsigned int window);
+gboolean _page_cache_batch_timeout(gpointer data);
+void _page_cache_resume_caching(PageCacheInstance *only, PageCacheInstance *skip);
+int _page_cache_may_cache(PageCacheInstance *cache);
+gboolean _page_cache_over_budget(struct _PageDocument *d, gboolean presented);
+GList *_page_cache_ref_documents(GList **current);
+void _page_cache_instance_destroy(PageCacheInstance *cache);
+PageCacheInstance *_page_cache_find_instance(guint id);
+void _page_cache_shed_pool(struct _PageDocument *d, unsigned int current);
+gsize _page_cache_shed_compressed(struct _PageDocument *d, unsigned int current);
 int _page_cache_compress_buffer(unsigned char *in, gsize insize, unsigned char **out, gsize *outsize);
-int _page_cache_uncompress_buffer(unsigned char *in, gsize insize, unsigned char **out, gsize outsize);
+int _page_cache_uncompress_buffer(unsigned char *in, gsize insize, unsigned char *out, gsize outsize);
 
 int page_cache_init(void)
 {
     memset(&_page_cache, 0, sizeof(struct _PageCache));
 
     g_mutex_init(&_page_cache.control_lock);
-    g_mutex_init(&_page_cache.data_lock);
-    g_mutex_init(&_page_cache.poppler_lock);
+
+    /* without a pool, bands are simply processed one after another */
+    if (g_get_num_processors() > 1)
+        _page_cache.band_pool = g_thread_pool_new((GFunc)_page_cache_band_job_proc, NULL,
+                                                  g_get_num_processors(), FALSE, NULL);
+
+    _page_cache.presented = page_cache_instance_new();
 
     return 0;
 }
 
+PageCacheInstance *page_cache_instance_new(void)
+{
+    PageCacheInstance *cache = g_malloc0(sizeof(PageCacheInstance));
+
+    g_mutex_lock(&_page_cache.control_lock);
+    cache->id = ++_page_cache.last_instance_id;
+    _page_cache.instances = g_list_append(_page_cache.instances, cache);
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    return cache;
+}
+
+/* the presented instance is only freed with the cache */
+void page_cache_instance_free(PageCacheInstance *cache)
+{
+    if (cache && cache != _page_cache.presented)
+        _page_cache_instance_destroy(cache);
+}
+
+void _page_cache_instance_destroy(PageCacheInstance *cache)
+{
+    struct _PageDocument *d;
+    Job *job;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    _page_cache.instances = g_list_remove(_page_cache.instances, cache);
+    d = cache->document;
+    cache->document = NULL;
+    if (d)
+        d->cache = NULL;
+    job = cache->caching_job;
+    cache->caching_job = NULL;
+    if (cache->batch_source)
+        g_source_remove(cache->batch_source);
+    cache->batch_source = 0;
+    job_token_cancel(cache->reload_token);
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    /* a queued job returns right away, the document is no longer ours */
+    job_run_if_queued(job);
+    job_wait(job);
+    job_unref(job);
+    job_token_unref(cache->reload_token);
+    job_unref(cache->reload_job);
+    _page_document_drop(d);
+    g_free(cache);
+}
+
+/* control lock has to be held */
+PageCacheInstance *_page_cache_find_instance(guint id)
+{
+    GList *l;
+    for (l = _page_cache.instances; l; l = l->next) {
+        if (((PageCacheInstance *)l->data)->id == id)
+            return l->data;
+    }
+    return NULL;
+}
+
+gboolean page_cache_instance_has_document(PageCacheInstance *cache)
+{
+    gboolean ret;
+    g_mutex_lock(&_page_cache.control_lock);
+    ret = cache && cache->document != NULL;
+    g_mutex_unlock(&_page_cache.control_lock);
+    return ret;
+}
+
+PageCacheInstance *page_cache_get_presented(void)
+{
+    return _page_cache.presented;
+}
+
+/* Present another instance, at the page it was left at. Work queued for
+ * the previously presented one is dropped. */
+void page_cache_set_presented(PageCacheInstance *cache)
+{
+    if (!cache || cache == _page_cache.presented)
+        return;
+
+    _page_cache_set_links(NULL);
+
+    g_mutex_lock(&_page_cache.control_lock);
+    _page_cache.presented = cache;
+    ++_page_cache.generation;
+    if (cache->document)
+        cache->document->generation = _page_cache.generation;
+    jobs_set_generation(_page_cache.generation);
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    _page_cache_resume_caching(NULL, NULL);
+}
+
+unsigned int page_cache_get_current_index(void)
+{
+    unsigned int index;
+    g_mutex_lock(&_page_cache.control_lock);
+    index = _page_cache.presented ? _page_cache.presented->current_index : 0;
+    g_mutex_unlock(&_page_cache.control_lock);
+    return index;
+}
+
+void page_cache_set_memory_budget(gsize budget)
+{
+    g_mutex_lock(&_page_cache.control_lock);
+    _page_cache.memory_budget = budget;
+    g_mutex_unlock(&_page_cache.control_lock);
+}
+
 int page_cache_load_document(const gchar *uri)
 {
+    return page_cache_instance_load_document(_page_cache.presented, uri);
+}
+
+int page_cache_instance_load_document(PageCacheInstance *cache, const gchar *uri)
+{
+    GBytes *bytes;
+    gchar *checksum = NULL;
+    struct _PageDocument *d, *old;
+    if (!cache || !uri) {
+        return 1;
+    }
+    if ((bytes = _page_cache_read_document(uri, &checksum)) == NULL) {
+        return 1;
+    }
+    d = _page_document_new(bytes, checksum);
+    g_bytes_unref(bytes);
+    if (d == NULL) {
+        return 1;
+    }
+
+    g_mutex_lock(&_page_cache.control_lock);
+    old = cache->document;
+    cache->document = d;
+    d->cache = cache;
+    cache->current_index = 0;
+    if (cache == _page_cache.presented) {
+        d->generation = ++_page_cache.generation;
+        jobs_set_generation(_page_cache.generation);
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    _page_document_drop(old);
+    _page_cache_submit_caching(d);
+
+    return 0;
+}
+
+/* Load a new version of the file in the background while the old one is
+ * still presented. Pages whose content did not change take over the
+ * compressed data of the old version. The callback is called on the main
+ * loop once the new version is in place, or with PAGE_CACHE_RELOAD_UNCHANGED
+ * if the file is still the same. Only the latest request is reported. */
+void page_cache_reload_document_async(const gchar *uri, PageCacheReloadCallback callback, gpointer userdata)
+{
+    page_cache_instance_load_document_async(_page_cache.presented, uri, callback, userdata);
+}
+
+/* Like page_cache_reload_document_async() for any instance; for one without
+ * a document, this loads it in the background. */
+void page_cache_instance_load_document_async(PageCacheInstance *cache, const gchar *uri,
+                                             PageCacheReloadCallback callback, gpointer userdata)
+{
+    struct _PageCacheReload *reload;
+    Job *job, *old_job;
+    if (!cache || !uri)
+        return;
+
+    reload = g_malloc0(sizeof(struct _PageCacheReload));
+    reload->uri = g_strdup(uri);
+    reload->callback = callback;
+    reload->userdata = userdata;
+    reload->result = 1;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    reload->cache_id = cache->id;
+    reload->serial = ++cache->reload_serial;
+    reload->current_index = cache->current_index;
+    reload->old = cache->document ? _page_document_ref(cache->document) : NULL;
+    /* a superseded reload stops at its next check */
+    job_token_cancel(cache->reload_token);
+    job_token_unref(cache->reload_token);
+    cache->reload_token = job_token_new();
+    cache->reload = reload;
+    job = jobs_submit(JOB_PRIORITY_RENDER, 0, cache->reload_token,
+                      (JobFunc)_page_cache_reload_job, reload, (GDestroyNotify)_page_cache_reload_dispatch);
+    old_job = cache->reload_job;
+    cache->reload_job = job;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    job_unref(old_job);
+}
+
+/* Wait for the load started by page_cache_instance_load_document_async() and
+ * put its result in place right away instead of on the next main loop
+ * iteration. Main thread only. Returns 0 if the instance has a document. */
+int page_cache_instance_finish_loading(PageCacheInstance *cache)
+{
+    struct _PageCacheReload *reload;
+    Job *job;
+    if (!cache)
+        return 1;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    reload = cache->reload;
+    job = cache->reload_job;
+    cache->reload_job = NULL;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    if (reload) {
+        /* once the job is done, the reload waits for its idle callback,
+         * which cannot run while we are on the main loop */
+        job_wait(job);
+        g_idle_remove_by_data(reload);
+        _page_cache_reload_finish(reload);
+    }
+    job_unref(job);
+
+    return page_cache_instance_has_document(cache) ? 0 : 1;
+}
+
+void _page_cache_reload_job(Job *job, struct _PageCacheReload *reload)
+{
+    GBytes *bytes;
+    gchar *checksum = NULL;
+    struct _PageDocument *d = NULL;
+    unsigned int index;
+
+    /* keep presenting the old version if the new one cannot be read,
+     * e.g. because it is still being written */
+    if ((bytes = _page_cache_read_document(reload->uri, &checksum)) == NULL) {
+        reload->result = 1;
+    }
+    else if (reload->old && g_strcmp0(checksum, reload->old->checksum) == 0) {
+        g_bytes_unref(bytes);
+        g_free(checksum);
+        reload->result = PAGE_CACHE_RELOAD_UNCHANGED;
+    }
+    else if ((d = _page_document_new(bytes, checksum)) == NULL) {
+        g_bytes_unref(bytes);
+        reload->result = 1;
+    }
+    else {
+        g_bytes_unref(bytes);
+        if (reload->old)
+            _page_document_set_previous(d, reload->old);
+
+        /* have the current page ready before the switch */
+        if (d->npages > 0 && !job_is_cancelled(job)) {
+            index = MIN(reload->current_index, d->npages - 1);
+            g_mutex_lock(_page_cache_page_lock(d, index));
+            _page_cache_page_make_surface(d, index);
+            g_mutex_unlock(_page_cache_page_lock(d, index));
+        }
+
+        reload->document = d;
+        reload->result = job_is_cancelled(job) ? 1 : 0;
+    }
+}
+
+/* called whether the reload job ran or was dropped */
+void _page_cache_reload_dispatch(struct _PageCacheReload *reload)
+{
+    g_idle_add((GSourceFunc)_page_cache_reload_finish, reload);
+}
+
+gboolean _page_cache_reload_finish(struct _PageCacheReload *reload)
+{
+    struct _PageDocument *old = NULL, *d = NULL;
+    PageCacheInstance *cache;
+    int latest;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    /* the instance may have been freed in the meantime */
+    cache = _page_cache_find_instance(reload->cache_id);
+    latest = cache && (reload->serial == cache->reload_serial);
+    if (latest)
+        cache->reload = NULL;
+    if (latest && reload->result == 0 && reload->document) {
+        old = cache->document;
+        cache->document = reload->document;
+        cache->document->cache = cache;
+        if (cache == _page_cache.presented) {
+            cache->document->generation = ++_page_cache.generation;
+            /* work queued for the old version is dropped */
+            jobs_set_generation(_page_cache.generation);
+        }
+        if (cache->current_index >= cache->document->npages)
+            cache->current_index = cache->document->npages > 0 ? cache->document->npages - 1 : 0;
+        d = _page_document_ref(cache->document);
+        reload->document = NULL;
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    /* freed once the last thread drawing from it is done */
+    _page_document_drop(old);
+    if (d) {
+        _page_cache_submit_caching(d);
+        _page_document_unref(d);
+    }
+
+    if (latest && reload->callback)
+        reload->callback(reload->result, reload->userdata);
+
+    /* still set if this version was not put in place */
+    _page_document_drop(reload->document);
+    _page_document_unref(reload->old);
+    g_free(reload->uri);
+    g_free(reload);
+
+    return FALSE;
+}
+
+guint page_cache_get_generation(void)
+{
+    guint generation;
+    g_mutex_lock(&_page_cache.control_lock);
+    generation = _page_cache.generation;
+    g_mutex_unlock(&_page_cache.control_lock);
+    return generation;
+}
+
+/* The file is read once; the checksum and all PopplerDocuments of this
+ * version work on the same bytes. */
+GBytes *_page_cache_read_document(const gchar *uri, gchar **checksum)
+{
+    GFile *file;
+    gchar *contents;
+    gsize length;
+    GBytes *bytes = NULL;
+    gchar *_uri = util_make_uri(uri);
+
+    if (_uri == NULL)
+        return NULL;
+
+    file = g_file_new_for_uri(_uri);
+    if (g_file_load_contents(file, NULL, &contents, &length, NULL, NULL)) {
+        bytes = g_bytes_new_take(contents, length);
+        if (checksum)
+            *checksum = g_compute_checksum_for_bytes(G_CHECKSUM_SHA1, bytes);
+    }
+    g_object_unref(file);
+    g_free(_uri);
+
+    return bytes;
+}
+
+PopplerDocument *_page_document_open_instance(struct _PageDocument *d)
+{
+    return poppler_document_new_from_bytes(d->bytes, NULL, NULL);
+}
+
+/* Document to call poppler on, NULL on error; give it back with
+ * _page_document_return(). Background threads get a copy of their own, so
+ * they never hold the lock that rendering for the screen waits on. */
+PopplerDocument *_page_document_borrow(struct _PageDocument *d)
+{
+    PopplerDocument *doc;
+
+    if (!jobs_in_background_thread()) {
+        g_mutex_lock(&d->poppler_lock);
+        return d->doc;
+    }
+
+    g_mutex_lock(&d->spare_lock);
+    doc = g_queue_pop_head(&d->spare_docs);
+    g_mutex_unlock(&d->spare_lock);
+
+    return doc ? doc : _page_document_open_instance(d);
+}
+
+void _page_document_return(struct _PageDocument *d, PopplerDocument *doc)
+{
+    if (!jobs_in_background_thread()) {
+        g_mutex_unlock(&d->poppler_lock);
+    }
+    else if (doc) {
+        g_mutex_lock(&d->spare_lock);
+        g_queue_push_head(&d->spare_docs, doc);
+        g_mutex_unlock(&d->spare_lock);
+    }
+}
+
+/* What page_info_read() returns for a page, read by a render worker if
+ * there are any. */
+int _page_document_page_info(struct _PageDocument *d, int index, guint flags, PageInfo *info)
+{
+    PopplerDocument *doc;
+    PopplerPage *page;
+    int ret;
+
+    if (render_worker_enabled())
+        return render_worker_page_info(d->serial, d->bytes, index, flags, info);
+
+    doc = _page_document_borrow(d);
+    page = doc ? poppler_document_get_page(doc, index) : NULL;
+    ret = page_info_read(page, flags, info);
+    if (page)
+        g_object_unref(page);
+    _page_document_return(d, doc);
+
+    return ret;
+}
+
+/* takes over checksum, adds a reference to bytes; NULL if the bytes are no pdf */
+struct _PageDocument *_page_document_new(GBytes *bytes, gchar *checksum)
+{
+    struct _PageDocument *d = g_malloc0(sizeof(struct _PageDocument));
+    int npages = -1;
+    unsigned int i;
+
+    d->bytes = g_bytes_ref(bytes);
+    d->serial = (guint)g_atomic_int_add(&_page_document_serial, 1) + 1;
+    /* with render workers, the presenter never parses the document itself */
+    if (render_worker_enabled())
+        npages = render_worker_page_count(d->serial, d->bytes);
+    else if ((d->doc = _page_document_open_instance(d)) != NULL)
+        npages = poppler_document_get_n_pages(d->doc);
+    if (npages < 0) {
+        if (d->doc)
+            g_object_unref(d->doc);
+        g_bytes_unref(d->bytes);
+        g_free(d);
+        g_free(checksum);
+        return NULL;
+    }
+
+    d->ref_count = 1;
+    d->checksum = checksum;
+    g_mutex_init(&d->poppler_lock);
+    g_mutex_init(&d->spare_lock);
+    g_queue_init(&d->spare_docs);
+    g_mutex_init(&d->pool_lock);
+    g_queue_init(&d->surface_pool);
+    for (i = 0; i < PAGE_CACHE_LOCK_STRIPES; i++)
+        g_mutex_init(&d->page_locks[i]);
+
+    d->npages = npages;
+    d->pages = g_malloc0(sizeof(struct _Page)*d->npages);
+
+    d->metadata = g_malloc0(sizeof(struct _PageMetadata)*d->npages);
+    d->token = job_token_new();
+    d->index_job = jobs_submit(JOB_PRIORITY_INDEX, 0, d->token, (JobFunc)_page_document_index_job,
+                               _page_document_ref(d), (GDestroyNotify)_page_document_index_done);
+    d->text_job = jobs_submit(JOB_PRIORITY_THUMBNAIL, 0, d->token, (JobFunc)_page_document_text_job,
+                              _page_document_ref(d), (GDestroyNotify)_page_document_unref);
+
+    return d;
+}
+
+struct _PageDocument *_page_document_ref(struct _PageDocument *d)
+{
+    if (d)
+        g_atomic_int_inc(&d->ref_count);
+    return d;
+}
+
+void _page_document_unref(struct _PageDocument *d)
+{
+    PopplerDocument *doc;
+    unsigned int i;
+    if (!d || !g_atomic_int_dec_and_test(&d->ref_count))
+        return;
+
+    for (i = 0; i < d->npages; i++) {
+        if (d->pages[i].surf)
+            cairo_surface_destroy(d->pages[i].surf);
+        g_free(d->pages[i].compressed_buffer);
+        g_free(d->pages[i].band_offsets);
+        g_free(d->pages[i].fingerprint);
+        if (d->pages[i].thumbnail)
+            cairo_surface_destroy(d->pages[i].thumbnail);
+    }
+    g_free(d->pages);
+
+    for (i = 0; i < d->metadata_pages; i++) {
+        g_free(d->metadata[i].label);
+        poppler_page_free_link_mapping(d->metadata[i].links);
+        _page_link_grid_free(d->metadata[i].link_grid);
+        if (d->metadata[i].transition)
+            poppler_page_transition_free(d->metadata[i].transition);
+    }
+    g_free(d->metadata);
+    if (d->named_dests)
+        g_hash_table_destroy(d->named_dests);
+    job_unref(d->index_job);
+    job_unref(d->text_job);
+    job_token_unref(d->token);
+    if (d->previous_pages)
+        g_hash_table_destroy(d->previous_pages);
+    _page_document_unref(d->previous);
+    search_index_free(d->search_index);
+
+    g_queue_clear(&d->surface_pool);
+    g_mutex_clear(&d->pool_lock);
+    for (i = 0; i < PAGE_CACHE_LOCK_STRIPES; i++)
+        g_mutex_clear(&d->page_locks[i]);
+    g_mutex_clear(&d->poppler_lock);
+    while ((doc = g_queue_pop_head(&d->spare_docs)) != NULL)
+        g_object_unref(doc);
+    g_mutex_clear(&d->spare_lock);
+
+    if (d->doc)
+        g_object_unref(d->doc);
+    render_worker_forget(d->serial);
+    g_bytes_unref(d->bytes);
+    g_free(d->checksum);
+    g_free(d);
+}
+
+/* Release a version that is no longer presented; its indexing and text
+ * extraction stop, even if threads still draw from it. */
+void _page_document_drop(struct _PageDocument *d)
+{
+    if (!d)
+        return;
+    job_token_cancel(d->token);
+    _page_document_forget_previous(d);
+    _page_document_unref(d);
+}
+
+/* reference to the version currently presented */
+struct _PageDocument *_page_cache_get_document(void)
+{
+    struct _PageDocument *d;
+    g_mutex_lock(&_page_cache.control_lock);
+    d = _page_document_ref(_page_cache.presented ? _page_cache.presented->document : NULL);
+    g_mutex_unlock(&_page_cache.control_lock);
+    return d;
+}
+
+void _page_document_index_job(Job *job, struct _PageDocument *d)
+{
+    PopplerDocument *doc;
+    struct _PageMetadata *md;
+    PageInfo info;
+    GHashTable *named_dests;
+    unsigned int i;
+
+    for (i = 0; i < d->npages; i++) {
+        if (job_is_cancelled(job))
+            return;
+
+        md = &d->metadata[i];
+        if (_page_document_page_info(d, i, PAGE_INFO_METADATA, &info) == 0) {
+            md->width = info.width;
+            md->height = info.height;
+            md->label = info.label;
+            md->links = info.links;
+            md->link_grid = _page_link_grid_new(md->links);
+            md->transition = info.transition;
+            info.label = NULL;
+            info.links = NULL;
+            info.transition = NULL;
+            page_info_clear(&info);
+        }
+
+        g_atomic_int_set(&d->metadata_pages, i + 1);
+    }
+
+    if (render_worker_enabled()) {
+        named_dests = render_worker_named_dests(d->serial, d->bytes);
+    }
+    else {
+        doc = _page_document_borrow(d);
+        named_dests = doc ? page_info_read_named_dests(doc) : NULL;
+        _page_document_return(d, doc);
+    }
+    d->named_dests = named_dests;
+}
+
+void _page_document_text_job(Job *job, struct _PageDocument *d)
+{
+    SearchIndexBuilder *builder = search_index_builder_new();
+    PageInfo info;
     unsigned int i;
-    gchar *_uri;
-    if (!uri) {
+
+    for (i = 0; i < d->npages; i++) {
+        if (job_is_cancelled(job)) {
+            search_index_builder_free(builder);
+            return;
+        }
+
+        if (_page_document_page_info(d, i, PAGE_INFO_TEXT, &info) == 0) {
+            if (info.text)
+                search_index_builder_add_page(builder, i, info.text, info.rects, info.n_rects,
+                                              info.width, info.height);
+            page_info_clear(&info);
+        }
+    }
+
+    g_atomic_pointer_set(&d->search_index, search_index_builder_finish(builder));
+}
+
+/* also called if the index job never ran */
+void _page_document_index_done(struct _PageDocument *d)
+{
+    g_atomic_int_set(&d->metadata_done, 1);
+
+    /* what was shown before is completed on the main loop */
+    if (g_atomic_int_get(&d->metadata_pages) == (gint)d->npages)
+        g_idle_add((GSourceFunc)_page_document_indexed, d);
+    else
+        _page_document_unref(d);
+}
+
+/* main loop, takes over the reference to d */
+gboolean _page_document_indexed(struct _PageDocument *d)
+{
+    struct _PageLinkSnapshot *links;
+    gboolean presented;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    presented = _page_cache.presented && _page_cache.presented->document == d;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    if (presented) {
+        /* only the main loop publishes links */
+        links = g_atomic_pointer_get(&_page_cache.links);
+        if (links && links->document == d && !links->grid)
+            _page_cache_publish_links(_page_document_ref(d), links->index);
+        if (_page_cache.indexed_callback)
+            _page_cache.indexed_callback(_page_cache.indexed_userdata);
+    }
+
+    _page_document_unref(d);
+    return FALSE;
+}
+
+/* Called on the main loop once the metadata of the presented version is
+ * complete, so everything drawn from guesses can be updated. */
+void page_cache_set_indexed_callback(PageCacheIndexedCallback callback, gpointer userdata)
+{
+    _page_cache.indexed_callback = callback;
+    _page_cache.indexed_userdata = userdata;
+}
+
+/* NULL while the page is not indexed yet; the result is immutable */
+struct _PageMetadata *_page_document_get_metadata(struct _PageDocument *d, int index)
+{
+    if (d == NULL || index < 0 || index >= d->npages)
+        return NULL;
+    return g_atomic_int_get(&d->metadata_pages) > index ? &d->metadata[index] : NULL;
+}
+
+/* Size of a page in points without waiting: from the index, from the in
+ * process document if nobody else is using it or, as a guess, from the last
+ * indexed page. With render workers, there is no document in process. */
+int _page_document_page_size(struct _PageDocument *d, int index, double *width, double *height)
+{
+    struct _PageMetadata *md;
+    PopplerPage *page;
+    gint indexed;
+
+    if ((md = _page_document_get_metadata(d, index)) != NULL && md->height > 0) {
+        *width = md->width;
+        *height = md->height;
+        return 0;
+    }
+    if (d == NULL || index < 0 || index >= d->npages)
+        return 1;
+
+    if (d->doc && g_mutex_trylock(&d->poppler_lock)) {
+        page = poppler_document_get_page(d->doc, index);
+        if (page) {
+            poppler_page_get_size(page, width, height);
+            g_object_unref(page);
+        }
+        g_mutex_unlock(&d->poppler_lock);
+        if (page && *height > 0)
+            return 0;
+    }
+
+    if ((indexed = g_atomic_int_get(&d->metadata_pages)) > 0 && d->metadata[indexed - 1].height > 0) {
+        *width = d->metadata[indexed - 1].width;
+        *height = d->metadata[indexed - 1].height;
+        return 0;
+    }
+    return 1;
+}
+
+/* NULL until the index is complete */
+GHashTable *_page_document_get_named_dests(struct _PageDocument *d)
+{
+    if (d == NULL || !g_atomic_int_get(&d->metadata_done))
+        return NULL;
+    return d->named_dests;
+}
+
+/* only the pages indexed so far; the indexed callback tells when all are */
+void page_cache_enum_labels(PageCacheEnumLabelsProc callback, gpointer userdata)
+{
+    struct _PageDocument *d;
+    struct _PageMetadata *md;
+    gchar *last_label = NULL;
+    gint index;
+
+    if (!callback || (d = _page_cache_get_document()) == NULL)
+        return;
+
+    for (index = 0; index < d->npages; ++index) {
+        if ((md = _page_document_get_metadata(d, index)) == NULL)
+            break;
+        if (g_strcmp0(md->label, last_label) != 0 || md->label == NULL) {
+            callback(md->label, index, userdata);
+            last_label = md->label;
+        }
+    }
+
+    _page_document_unref(d);
+}
+
+void page_cache_set_scale_to_height(double scale_to_height)
+{
+    _page_cache.scale_to_height = scale_to_height;
+}
+
+void page_cache_unload_document(void)
+{
+    struct _PageDocument *d;
+
+    _page_cache_set_links(NULL);
+
+    g_mutex_lock(&_page_cache.control_lock);
+    d = _page_cache.presented ? _page_cache.presented->document : NULL;
+    if (d) {
+        _page_cache.presented->document = NULL;
+        d->cache = NULL;
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    _page_document_drop(d);
+}
+
+void page_cache_cleanup(void)
+{
+    _page_cache_set_links(NULL);
+
+    while (_page_cache.instances)
+        _page_cache_instance_destroy(_page_cache.instances->data);
+    _page_cache.presented = NULL;
+
+    if (_page_cache.band_pool) {
+        g_thread_pool_free(_page_cache.band_pool, FALSE, TRUE);
+        _page_cache.band_pool = NULL;
+    }
+
+    g_mutex_clear(&_page_cache.control_lock);
+}
+
+unsigned int page_cache_get_page_count(void)
+{
+    unsigned int npages;
+    g_mutex_lock(&_page_cache.control_lock);
+    npages = _page_cache.presented && _page_cache.presented->document ?
+             _page_cache.presented->document->npages : 0;
+    g_mutex_unlock(&_page_cache.control_lock);
+    return npages;
+}
+
+void page_cache_get_status(PageCacheStatus *status)
+{
+    struct _PageDocument *d;
+    if (!status)
+        return;
+    memset(status, 0, sizeof(PageCacheStatus));
+    status->background_cpu = jobs_get_cpu_share();
+    if ((d = _page_cache_get_document()) == NULL)
+        return;
+
+    status->pages_cached = g_atomic_int_get(&d->pages_cached);
+    status->page_count = d->npages;
+    status->cached_size = (gsize)g_atomic_pointer_get(&d->cached_size);
+    status->pages_decompressed = g_atomic_int_get(&d->pages_decompressed);
+    status->decompressed_size = (gsize)g_atomic_pointer_get(&d->decompressed_size);
+
+    _page_document_unref(d);
+}
+
+/* Find a page that still has to be compressed, looking at the pages after
+ * the current one first. With a window, only pages that close to the current
+ * one are considered. Returns -1 if there is none. */
+int _page_cache_next_page_to_compress(struct _PageDocument *d, unsigned int current, unsigned int window)
+{
+    struct _Page *pg;
+    unsigned int k, count;
+    int i;
+
+    if (current >= d->npages)
+        current = 0;
+    count = window ? MIN(window, d->npages) : d->npages;
+    /* after the current page, wrapping around if there is no window */
+    for (k = 1; k <= count; k++) {
+        i = current + k;
+        if (i >= (int)d->npages) {
+            if (window)
+                break;
+            i -= d->npages;
+        }
+        pg = _page_cache_get_page(d, i);
+        if (pg && !_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED | PAGE_STATE_FAILED))
+            return i;
+    }
+    /* the current page and, with a window, the ones before it */
+    for (k = 0; k <= window && k <= current; k++) {
+        i = current - k;
+        pg = _page_cache_get_page(d, i);
+        if (pg && !_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED | PAGE_STATE_FAILED))
+            return i;
+    }
+    return -1;
+}
+
+/* Compress one page, preferring those after the current one, and queue the
+ * next job. Going page by page lets more urgent jobs run in between. When
+ * saving power, jobs run in short batches with pauses in between, so the
+ * CPU can stay idle for longer. */
+void _page_cache_compress_job(Job *job, struct _PageDocument *d)
+{
+    PageCacheInstance *cache;
+    struct _Page *pg = NULL;
+    unsigned int current, window = 0;
+    int i, presented, resubmit = 0;
+    gboolean power_saving = g_atomic_int_get(&_page_cache.power_saving);
+
+    /* the instance stays valid while this job runs, but may let go of d */
+    g_mutex_lock(&_page_cache.control_lock);
+    cache = d->cache;
+    if (!cache || cache->document != d) {
+        g_mutex_unlock(&_page_cache.control_lock);
+        return;
+    }
+    current = cache->current_index;
+    presented = (cache == _page_cache.presented);
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    if (g_atomic_int_get(&_page_cache.memory_pressure) >= PRESSURE_CRITICAL)
+        window = PAGE_CACHE_PRESSURE_KEEP;
+    else if (power_saving)
+        window = PAGE_CACHE_POWER_WINDOW;
+
+    if ((i = _page_cache_next_page_to_compress(d, current, window)) < 0) {
+        if (!window) {
+            g_atomic_int_set(&d->caching_done, 1);
+            _page_document_forget_previous(d);
+        }
+        /* the window is complete, until the current page changes */
+        g_mutex_lock(&_page_cache.control_lock);
+        if (d->cache == cache) {
+            if (!window || cache->current_index == current)
+                cache->caching_pending = 0;
+            else
+                resubmit = 1;
+        }
+        g_mutex_unlock(&_page_cache.control_lock);
+        if (resubmit)
+            _page_cache_submit_caching(d);
+        else if (presented)
+            _page_cache_resume_caching(NULL, cache);
+        return;
+    }
+
+    if (_page_cache_over_budget(d, presented)) {
+        g_mutex_lock(&_page_cache.control_lock);
+        if (d->cache == cache)
+            cache->caching_pending = 0;
+        g_mutex_unlock(&_page_cache.control_lock);
+        return;
+    }
+
+    /* takes the page lock only to publish the result */
+    pg = _page_cache_get_page(d, i);
+    if (!_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED) &&
+            _page_cache_compress_page(d, i) != 0)
+        _page_cache_page_set_state(pg, PAGE_STATE_FAILED, TRUE);
+
+    if (job_is_cancelled(job))
+        return;
+
+    if (power_saving) {
+        g_mutex_lock(&_page_cache.control_lock);
+        if (d->cache == cache && ++cache->batch_count >= PAGE_CACHE_POWER_BATCH && _page_cache.do_caching) {
+            cache->batch_count = 0;
+            if (!cache->batch_source)
+                cache->batch_source = g_timeout_add_seconds(PAGE_CACHE_POWER_PAUSE_SECONDS,
+                                                            _page_cache_batch_timeout, cache);
+            g_mutex_unlock(&_page_cache.control_lock);
+            return;
+        }
+        g_mutex_unlock(&_page_cache.control_lock);
+    }
+
+    _page_cache_submit_caching(d);
+}
+
+/* Keep the compressed pages of all instances within the memory budget. The
+ * presented instance takes memory from the others if it has to. */
+gboolean _page_cache_over_budget(struct _PageDocument *d, gboolean presented)
+{
+    GList *documents, *current, *l, *c;
+    gsize budget, total = 0;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    budget = _page_cache.memory_budget;
+    g_mutex_unlock(&_page_cache.control_lock);
+    if (!budget)
+        return FALSE;
+
+    documents = _page_cache_ref_documents(&current);
+    for (l = documents; l; l = l->next)
+        total += (gsize)g_atomic_pointer_get(&((struct _PageDocument *)l->data)->cached_size);
+
+    if (total >= budget && presented) {
+        for (l = documents, c = current; l && total >= budget; l = l->next, c = c->next) {
+            if (l->data != d)
+                total -= _page_cache_shed_compressed(l->data, GPOINTER_TO_UINT(c->data));
+        }
+    }
+
+    g_list_free_full(documents, (GDestroyNotify)_page_document_unref);
+    g_list_free(current);
+
+    return total >= budget;
+}
+
+/* references to the documents of all instances and their current pages */
+GList *_page_cache_ref_documents(GList **current)
+{
+    GList *documents = NULL, *l;
+    PageCacheInstance *cache;
+
+    *current = NULL;
+    g_mutex_lock(&_page_cache.control_lock);
+    for (l = _page_cache.instances; l; l = l->next) {
+        cache = l->data;
+        if (cache->document) {
+            documents = g_list_prepend(documents, _page_document_ref(cache->document));
+            *current = g_list_prepend(*current, GUINT_TO_POINTER(cache->current_index));
+        }
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    return documents;
+}
+
+/* end of a pause between two batches */
+gboolean _page_cache_batch_timeout(gpointer data)
+{
+    PageCacheInstance *cache = data;
+    struct _PageDocument *d;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    cache->batch_source = 0;
+    d = _page_document_ref(cache->document);
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    if (d) {
+        _page_cache_submit_caching(d);
+        _page_document_unref(d);
+    }
+
+    return FALSE;
+}
+
+/* Cache only around the current page, with cheaper compression and in
+ * batches. Switching back to normal caching continues with the whole
+ * document. */
+void page_cache_set_power_saving(gboolean power_saving)
+{
+    g_atomic_int_set(&_page_cache.power_saving, power_saving ? 1 : 0);
+    _page_cache_resume_caching(NULL, NULL);
+}
+
+/* Give memory back in tiers: pooled surfaces first, then, when pressure is
+ * critical, compressed pages away from the current one. Caching stays close
+ * to the current page until the pressure is gone and then rebuilds the rest
+ * in the background. */
+void page_cache_set_memory_pressure(PressureLevel level)
+{
+    GList *documents, *current, *l, *c;
+    gint old = g_atomic_int_get(&_page_cache.memory_pressure);
+
+    g_atomic_int_set(&_page_cache.memory_pressure, level);
+
+    documents = _page_cache_ref_documents(&current);
+    for (l = documents, c = current; l; l = l->next, c = c->next) {
+        if (level >= PRESSURE_LOW)
+            _page_cache_shed_pool(l->data, GPOINTER_TO_UINT(c->data));
+        if (level >= PRESSURE_CRITICAL) {
+            _page_document_forget_previous(l->data);
+            _page_cache_shed_compressed(l->data, GPOINTER_TO_UINT(c->data));
+        }
+        if (level < PRESSURE_CRITICAL && old >= PRESSURE_CRITICAL)
+            g_atomic_int_set(&((struct _PageDocument *)l->data)->caching_done, 0);
+    }
+    g_list_free_full(documents, (GDestroyNotify)_page_document_unref);
+    g_list_free(current);
+
+    if (level < PRESSURE_CRITICAL && old >= PRESSURE_CRITICAL)
+        _page_cache_resume_caching(NULL, NULL);
+}
+
+/* evict pooled surfaces, except those of the neighbours of the current page */
+void _page_cache_shed_pool(struct _PageDocument *d, unsigned int current)
+{
+    GList *evict = NULL, *l, *next;
+    int index;
+
+    g_mutex_lock(&d->pool_lock);
+    for (l = d->surface_pool.head; l; l = next) {
+        next = l->next;
+        index = GPOINTER_TO_INT(l->data);
+        if (ABS(index - (int)current) > PAGE_CACHE_PRESSURE_KEEP) {
+            evict = g_list_prepend(evict, l->data);
+            g_queue_delete_link(&d->surface_pool, l);
+        }
+    }
+    g_mutex_unlock(&d->pool_lock);
+
+    for (l = evict; l; l = l->next)
+        _page_cache_pool_evict(d, GPOINTER_TO_INT(l->data));
+    g_list_free(evict);
+}
+
+/* returns the number of bytes freed */
+gsize _page_cache_shed_compressed(struct _PageDocument *d, unsigned int current)
+{
+    struct _Page *pg;
+    unsigned int i;
+    gsize freed = 0;
+
+    for (i = 0; i < d->npages; i++) {
+        if (ABS((int)i - (int)current) <= PAGE_CACHE_PRESSURE_KEEP)
+            continue;
+        pg = &d->pages[i];
+        g_mutex_lock(_page_cache_page_lock(d, i));
+        if (_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED) && pg->compressed_buffer) {
+            g_atomic_int_add(&d->pages_cached, -1);
+            g_atomic_pointer_add(&d->cached_size, -(gssize)pg->buffer_size);
+            freed += pg->buffer_size;
+            g_free(pg->compressed_buffer);
+            pg->compressed_buffer = NULL;
+            g_free(pg->band_offsets);
+            pg->band_offsets = NULL;
+            pg->buffer_size = 0;
+            pg->band_count = 0;
+            _page_cache_page_set_state(pg, PAGE_STATE_COMPRESSED, FALSE);
+        }
+        g_mutex_unlock(_page_cache_page_lock(d, i));
+    }
+
+    return freed;
+}
+
+/* queue a compress job for an instance, or all but skip if only is NULL,
+ * whose caching stopped at the end of a window */
+void _page_cache_resume_caching(PageCacheInstance *only, PageCacheInstance *skip)
+{
+    GList *documents = NULL, *l;
+    PageCacheInstance *cache;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    for (l = _page_cache.instances; l && _page_cache.do_caching; l = l->next) {
+        cache = l->data;
+        if ((!only || cache == only) && cache != skip && cache->document &&
+                !cache->caching_pending && !cache->batch_source)
+            documents = g_list_prepend(documents, _page_document_ref(cache->document));
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    for (l = documents; l; l = l->next)
+        _page_cache_submit_caching(l->data);
+    g_list_free_full(documents, (GDestroyNotify)_page_document_unref);
+}
+
+/* queue the next compress job if d is still the version of its instance */
+void _page_cache_submit_caching(struct _PageDocument *d)
+{
+    PageCacheInstance *cache;
+    Job *job = NULL;
+
+    if (!d)
+        return;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    cache = d->cache;
+    if (cache && cache->document == d) {
+        if (_page_cache.do_caching && !g_atomic_int_get(&d->caching_done) && _page_cache_may_cache(cache)) {
+            job = cache->caching_job;
+            cache->caching_pending = 1;
+            cache->caching_job = jobs_submit(JOB_PRIORITY_COMPRESS, 0, _page_cache.caching_token,
+                                             (JobFunc)_page_cache_compress_job, _page_document_ref(d),
+                                             (GDestroyNotify)_page_document_unref);
+        }
+        else {
+            cache->caching_pending = 0;
+        }
+    }
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    job_unref(job);
+}
+
+/* Control lock has to be held. Other instances wait while the presented
+ * one still has work to do. */
+int _page_cache_may_cache(PageCacheInstance *cache)
+{
+    PageCacheInstance *presented = _page_cache.presented;
+    return cache == presented || !presented || !presented->document ||
+           (!presented->caching_pending && !presented->batch_source);
+}
+
+void page_cache_start_caching(void)
+{
+    g_mutex_lock(&_page_cache.control_lock);
+    if (_page_cache.do_caching) {
+        g_mutex_unlock(&_page_cache.control_lock);
+        return;
+    }
+    _page_cache.do_caching = 1;
+    _page_cache.caching_token = job_token_new();
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    _page_cache_resume_caching(NULL, NULL);
+}
+
+void page_cache_stop_caching(void)
+{
+    JobToken *token;
+    GList *jobs = NULL, *l;
+    PageCacheInstance *cache;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    _page_cache.do_caching = 0;
+    for (l = _page_cache.instances; l; l = l->next) {
+        cache = l->data;
+        cache->caching_pending = 0;
+        if (cache->batch_source) {
+            g_source_remove(cache->batch_source);
+            cache->batch_source = 0;
+        }
+        if (cache->caching_job)
+            jobs = g_list_prepend(jobs, cache->caching_job);
+        cache->caching_job = NULL;
+    }
+    token = _page_cache.caching_token;
+    _page_cache.caching_token = NULL;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    /* a queued job is dropped, a running one finishes its page */
+    job_token_cancel(token);
+    for (l = jobs; l; l = l->next)
+        job_wait(l->data);
+    g_list_free_full(jobs, (GDestroyNotify)job_unref);
+    job_token_unref(token);
+}
+
+int page_cache_load_page(int index)
+{
+    struct _PageDocument *d;
+    PageCacheLease lease;
+
+    if ((d = _page_cache_get_document()) == NULL)
+        return 1;
+    /* make sure the current page is decompressed and stays so */
+    if (_page_cache_page_acquire(d, index, &lease) != 0) {
+        _page_document_unref(d);
+        return 1;
+    }
+    page_cache_page_reference(index);
+    _page_cache_page_release(d, index);
+    _page_cache_publish_links(d, index);
+
+    g_mutex_lock(&_page_cache.control_lock);
+    if (_page_cache.presented)
+        _page_cache.presented->current_index = index;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    /* the window moved, caching may have to go on */
+    if (g_atomic_int_get(&_page_cache.power_saving) ||
+            g_atomic_int_get(&_page_cache.memory_pressure) >= PRESSURE_CRITICAL)
+        _page_cache_resume_caching(_page_cache.presented, NULL);
+
+    return 0;
+}
+
+/* Get a reference to the decompressed surface of the page. Every successful
+ * call has to be matched by page_cache_page_release(). The lease keeps the
+ * version of the document it was taken from alive. */
+int page_cache_page_acquire(int index, PageCacheLease *lease)
+{
+    struct _PageDocument *d;
+    if (!lease)
+        return 1;
+    if ((d = _page_cache_get_document()) == NULL)
+        return 1;
+    if (_page_cache_page_acquire(d, index, lease) != 0) {
+        _page_document_unref(d);
+        return 1;
+    }
+    lease->surface = cairo_surface_reference(lease->surface);
+    lease->index = index;
+    lease->document = d;
+    return 0;
+}
+
+void page_cache_page_release(PageCacheLease *lease)
+{
+    if (!lease || !lease->document)
+        return;
+
+    /* the surface keeps its pixel buffer alive even if the page drops it */
+    if (lease->surface)
+        cairo_surface_destroy(lease->surface);
+
+    _page_cache_page_release(lease->document, lease->index);
+    _page_document_unref(lease->document);
+
+    lease->surface = NULL;
+    lease->document = NULL;
+}
+
+/* fills in the lease, but does not reference surface or document */
+int _page_cache_page_acquire(struct _PageDocument *d, int index, PageCacheLease *lease)
+{
+    struct _Page *pg = _page_cache_get_page(d, index);
+    if (!pg) {
+        return 1;
+    }
+    g_mutex_lock(_page_cache_page_lock(d, index));
+    if (_page_cache_page_make_surface(d, index) != 0) {
+        g_mutex_unlock(_page_cache_page_lock(d, index));
+        return 1;
+    }
+
+    pg->lease_count++;
+    if (_page_cache_page_has_state(pg, PAGE_STATE_POOLED)) {
+        g_mutex_lock(&d->pool_lock);
+        g_queue_remove(&d->surface_pool, GINT_TO_POINTER(index));
+        g_mutex_unlock(&d->pool_lock);
+        _page_cache_page_set_state(pg, PAGE_STATE_POOLED, FALSE);
+    }
+
+    lease->surface = pg->surf;
+    lease->width = pg->width;
+    lease->height = pg->height;
+    lease->guess_split = pg->split_guess;
+
+    g_mutex_unlock(_page_cache_page_lock(d, index));
+    return 0;
+}
+
+void _page_cache_page_release(struct _PageDocument *d, int index)
+{
+    struct _Page *pg;
+    int evict = -1;
+
+    if ((pg = _page_cache_get_page(d, index)) == NULL)
+        return;
+
+    g_mutex_lock(_page_cache_page_lock(d, index));
+    if (pg->lease_count)
+        pg->lease_count--;
+    if (pg->lease_count == 0 && pg->ref_count == 0 && pg->surf)
+        evict = _page_cache_pool_add(d, index, pg);
+    g_mutex_unlock(_page_cache_page_lock(d, index));
+
+    if (evict >= 0)
+        _page_cache_pool_evict(d, evict);
+}
+
+/* Size of the rendered page. If the page was not rendered yet, this does not
+ * wait for it: until the page is indexed the size may be a guess, and if
+ * there is none, 1 is returned and the caller keeps its own. */
+int page_cache_get_page_size(int index, unsigned int *width, unsigned int *height, int *guess_split)
+{
+    struct _PageDocument *d;
+    struct _Page *pg;
+    PageCacheLease lease;
+    double pw, ph;
+    int ret = 0;
+
+    if ((d = _page_cache_get_document()) == NULL)
+        return 1;
+    if ((pg = _page_cache_get_page(d, index)) == NULL) {
+        _page_document_unref(d);
         return 1;
     }
-    _uri = util_make_uri(uri);
-    _page_cache.doc = poppler_document_new_from_file(_uri, NULL, NULL);
-    g_free(_uri);
+    g_mutex_lock(_page_cache_page_lock(d, index));
+    if (_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED | PAGE_STATE_UNCOMPRESSED)) {
+        lease.width = pg->width;
+        lease.height = pg->height;
+        lease.guess_split = pg->split_guess;
+        g_mutex_unlock(_page_cache_page_lock(d, index));
+    }
+    else {
+        g_mutex_unlock(_page_cache_page_lock(d, index));
+        if (_page_document_page_size(d, index, &pw, &ph) == 0) {
+            _page_cache_scaled_size(pw, ph, &lease.width, &lease.height, NULL);
+            lease.guess_split = (lease.width > 2*lease.height ? 1 : 0);
+        }
+        else
+            ret = 1;
+    }
 
-    if (!_page_cache.doc) {
-        return 1;
+    if (ret == 0) {
+        if (width) *width = lease.width;
+        if (height) *height = lease.height;
+        if (guess_split) *guess_split = lease.guess_split;
     }
 
-    _page_cache.current_index = 0;
-    _page_cache.npages = poppler_document_get_n_pages(_page_cache.doc);
+    _page_document_unref(d);
+    return ret;
+}
 
-    _page_cache.pages = g_malloc0(sizeof(struct _Page)*_page_cache.npages);
-    for (i = 0; i < _page_cache.npages; i++) {
-        g_mutex_init(&_page_cache.pages[i].page_lock);
+void page_cache_page_reference(int index)
+{
+    struct _PageDocument *d = _page_cache_get_document();
+    struct _Page *pg = _page_cache_get_page(d, index);
+    if (pg) {
+        g_mutex_lock(_page_cache_page_lock(d, index));
+        pg->ref_count++;
+        g_mutex_unlock(_page_cache_page_lock(d, index));
     }
-    return 0;
+    _page_document_unref(d);
 }
 
-void page_cache_enum_labels(PageCacheEnumLabelsProc callback, gpointer userdata)
+void page_cache_page_unref(int index)
 {
-    if (!callback || !_page_cache.doc)
-        return;
-
-    PopplerPage *page;
-    gchar *last_label = NULL;
-    gchar *label = NULL;
-    gint index;
-
-    for (index = 0; index < _page_cache.npages; ++index) {
-        page = poppler_document_get_page(_page_cache.doc, index);
-        if (page) {
-            label = poppler_page_get_label(page);
-            if (g_strcmp0(label, last_label) != 0 || label == NULL) {
-                callback(label, index, userdata);
-                g_free(last_label);
-                last_label = label;
-            }
-            else {
-                g_free(label);
-                label = NULL;
-            }
+    struct _PageDocument *d = _page_cache_get_document();
+    struct _Page *pg = _page_cache_get_page(d, index);
+    int evict = -1;
+    if (pg) {
+        g_mutex_lock(_page_cache_page_lock(d, index));
+        if (pg->ref_count) {
+            pg->ref_count--;
+        }
+        if (pg->ref_count == 0 && pg->lease_count == 0 && pg->surf) {
+            evict = _page_cache_pool_add(d, index, pg);
         }
+        g_mutex_unlock(_page_cache_page_lock(d, index));
     }
-
-    g_free(label);
+    if (evict >= 0)
+        _page_cache_pool_evict(d, evict);
+    _page_document_unref(d);
 }
 
-void page_cache_set_scale_to_height(double scale_to_height)
+/* page lock has to be held; returns the index of a page to evict or -1 */
+int _page_cache_pool_add(struct _PageDocument *d, int index, struct _Page *pg)
 {
-    _page_cache.scale_to_height = scale_to_height;
+    int evict = -1;
+    if (_page_cache_page_has_state(pg, PAGE_STATE_POOLED))
+        return -1;
+
+    g_mutex_lock(&d->pool_lock);
+    g_queue_push_tail(&d->surface_pool, GINT_TO_POINTER(index));
+    _page_cache_page_set_state(pg, PAGE_STATE_POOLED, TRUE);
+    if (d->surface_pool.length > (g_atomic_int_get(&_page_cache.memory_pressure) >= PRESSURE_LOW ?
+                                  PAGE_CACHE_PRESSURE_POOL_SIZE : PAGE_CACHE_SURFACE_POOL_SIZE))
+        evict = GPOINTER_TO_INT(g_queue_pop_head(&d->surface_pool));
+    g_mutex_unlock(&d->pool_lock);
+
+    return evict;
 }
 
-void page_cache_clear_cache(void)
+/* page lock must not be held */
+void _page_cache_pool_evict(struct _PageDocument *d, int index)
 {
-    unsigned int i;
-    for (i = 0; i < _page_cache.npages && _page_cache.pages; i++) {
-        g_mutex_clear(&_page_cache.pages[i].page_lock);
-        if (_page_cache.pages[i].surf)
-            cairo_surface_destroy(_page_cache.pages[i].surf);
-        if (_page_cache.pages[i].compressed_buffer)
-            g_free(_page_cache.pages[i].compressed_buffer);
-        if (_page_cache.pages[i].uncompressed_buffer)
-            g_free(_page_cache.pages[i].uncompressed_buffer);
+    struct _Page *pg = _page_cache_get_page(d, index);
+    if (!pg)
+        return;
+    g_mutex_lock(_page_cache_page_lock(d, index));
+    /* page may have been leased again since it was taken from the pool */
+    if (_page_cache_page_has_state(pg, PAGE_STATE_POOLED) &&
+            pg->lease_count == 0 && pg->ref_count == 0) {
+        _page_cache_page_drop_surface(d, pg);
+        _page_cache_page_set_state(pg, PAGE_STATE_POOLED, FALSE);
     }
-    g_free(_page_cache.pages);
-    _page_cache.pages = NULL;
-
-    _page_cache.pages_cached = 0;
+    g_mutex_unlock(_page_cache_page_lock(d, index));
 }
 
-void page_cache_unload_document(void)
+void _page_cache_page_drop_surface(struct _PageDocument *d, struct _Page *pg)
 {
-    if (_page_cache.page_links) {
-        poppler_page_free_link_mapping(_page_cache.page_links);
-        _page_cache.page_links = NULL;
+    if (pg->surf) {
+        cairo_surface_destroy(pg->surf);
+        pg->surf = NULL;
+        g_atomic_int_add(&d->pages_decompressed, -1);
+        g_atomic_pointer_add(&d->decompressed_size, -(gssize)_page_cache_page_surface_size(pg));
     }
+    _page_cache_page_set_state(pg, PAGE_STATE_UNCOMPRESSED, FALSE);
+}
+
+void _page_cache_page_set_state(struct _Page *pg, gint flag, gboolean set)
+{
+    if (set)
+        g_atomic_int_or((guint *)&pg->state, (guint)flag);
+    else
+        g_atomic_int_and((guint *)&pg->state, ~(guint)flag);
+}
 
-    page_cache_clear_cache();
+gsize _page_cache_page_surface_size(struct _Page *pg)
+{
+    return (gsize)pg->height * cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, pg->width);
+}
 
-    if (_page_cache.doc)
-        g_object_unref(_page_cache.doc);
+/* Never blocks: the snapshot cannot go away while link_readers is set. */
+PopplerAction *page_cache_get_action_from_pos(double x, double y)
+{
+    struct _PageLinkSnapshot *links;
+    PopplerAction *action = NULL;
 
-    _page_cache.doc = NULL;
+    g_atomic_int_inc(&_page_cache.link_readers);
+    links = g_atomic_pointer_get(&_page_cache.links);
+    if (links && links->grid)
+        action = _page_link_grid_lookup(links->grid, x / links->scale, y / links->scale);
+    g_atomic_int_add(&_page_cache.link_readers, -1);
 
-    _page_cache.npages = 0;
+    return action;
 }
 
-void page_cache_cleanup(void)
+/* Links come from the index, which is kept alive with its document; a page
+ * that is not indexed yet gets its links once it is. Takes over the
+ * reference to d. Main loop only. */
+void _page_cache_publish_links(struct _PageDocument *d, int index)
 {
-    page_cache_unload_document();
+    struct _PageMetadata *md = _page_document_get_metadata(d, index);
+    struct _PageLinkSnapshot *links = g_malloc0(sizeof(struct _PageLinkSnapshot));
+    unsigned int height;
 
-    g_mutex_clear(&_page_cache.control_lock);
-    g_mutex_clear(&_page_cache.data_lock);
-    g_mutex_clear(&_page_cache.poppler_lock);
+    links->document = d;
+    links->index = index;
+    if (md && md->height > 0) {
+        _page_cache_scaled_size(md->width, md->height, NULL, &height, NULL);
+        links->grid = md->link_grid;
+        links->scale = height/md->height;
+    }
+    _page_cache_set_links(links);
 }
 
-unsigned int page_cache_get_page_count(void)
+/* publish a new snapshot and free the old one once no hit test uses it */
+void _page_cache_set_links(struct _PageLinkSnapshot *snapshot)
 {
-    return _page_cache.npages;
+    struct _PageLinkSnapshot *old;
+
+    old = g_atomic_pointer_exchange(&_page_cache.links, snapshot);
+    if (!old)
+        return;
+    while (g_atomic_int_get(&_page_cache.link_readers))
+        g_thread_yield();
+
+    _page_document_unref(old->document);
+    g_free(old);
 }
 
-void page_cache_get_status(PageCacheStatus *status)
+struct _PageLinkGrid *_page_link_grid_new(GList *links)
 {
-    unsigned int i;
-    if (status) {
-        status->pages_cached = _page_cache.pages_cached;
-        status->page_count = _page_cache.npages;
-        status->cached_size = 0;
-        for (i = 0; i < status->page_count; i++) {
-            if (g_mutex_trylock(&_page_cache.pages[i].page_lock)) {
-                status->cached_size += _page_cache.pages[i].buffer_size;
-                g_mutex_unlock(&_page_cache.pages[i].page_lock);
+    struct _PageLinkGrid *grid;
+    PopplerRectangle *area;
+    GList *tmp;
+    unsigned int i, l, cx, cy, cx1, cx2, cy1, cy2, pos;
+    unsigned int counts[PAGE_CACHE_LINK_GRID_SIZE * PAGE_CACHE_LINK_GRID_SIZE];
+    double x1, y1, x2, y2;
+
+    if (links == NULL)
+        return NULL;
+
+    grid = g_malloc0(sizeof(struct _PageLinkGrid));
+    grid->link_count = g_list_length(links);
+    grid->links = g_malloc(sizeof(PopplerLinkMapping *) * grid->link_count);
+
+    x1 = y1 = G_MAXDOUBLE;
+    x2 = y2 = -G_MAXDOUBLE;
+    for (tmp = links, l = 0; tmp; tmp = tmp->next, l++) {
+        grid->links[l] = (PopplerLinkMapping *)tmp->data;
+        area = &grid->links[l]->area;
+        x1 = MIN(x1, MIN(area->x1, area->x2));
+        x2 = MAX(x2, MAX(area->x1, area->x2));
+        y1 = MIN(y1, MIN(area->y1, area->y2));
+        y2 = MAX(y2, MAX(area->y1, area->y2));
+    }
+    grid->x0 = x1;
+    grid->y0 = y1;
+    grid->cell_width = MAX(x2 - x1, 1.0) / PAGE_CACHE_LINK_GRID_SIZE;
+    grid->cell_height = MAX(y2 - y1, 1.0) / PAGE_CACHE_LINK_GRID_SIZE;
+
+    /* count, then fill, the links of each cell */
+    memset(counts, 0, sizeof(counts));
+    for (pos = 0; pos < 2; pos++) {
+        for (l = 0; l < grid->link_count; l++) {
+            area = &grid->links[l]->area;
+            cx1 = MIN((unsigned int)((MIN(area->x1, area->x2) - grid->x0) / grid->cell_width), PAGE_CACHE_LINK_GRID_SIZE - 1);
+            cx2 = MIN((unsigned int)((MAX(area->x1, area->x2) - grid->x0) / grid->cell_width), PAGE_CACHE_LINK_GRID_SIZE - 1);
+            cy1 = MIN((unsigned int)((MIN(area->y1, area->y2) - grid->y0) / grid->cell_height), PAGE_CACHE_LINK_GRID_SIZE - 1);
+            cy2 = MIN((unsigned int)((MAX(area->y1, area->y2) - grid->y0) / grid->cell_height), PAGE_CACHE_LINK_GRID_SIZE - 1);
+            for (cy = cy1; cy <= cy2; cy++) {
+                for (cx = cx1; cx <= cx2; cx++) {
+                    i = cy * PAGE_CACHE_LINK_GRID_SIZE + cx;
+                    if (pos == 0)
+                        counts[i]++;
+                    else
+                        grid->cell_links[grid->cell_start[i] + counts[i]++] = l;
+                }
+            }
+        }
+        if (pos == 0) {
+            for (i = 0; i < PAGE_CACHE_LINK_GRID_SIZE * PAGE_CACHE_LINK_GRID_SIZE; i++) {
+                grid->cell_start[i + 1] = grid->cell_start[i] + counts[i];
+                counts[i] = 0;
             }
+            grid->cell_links = g_malloc(sizeof(unsigned int) *
+                    MAX(grid->cell_start[PAGE_CACHE_LINK_GRID_SIZE * PAGE_CACHE_LINK_GRID_SIZE], 1));
         }
     }
+
+    return grid;
 }
 
-gpointer _page_cache_caching_thread(gpointer data)
+void _page_link_grid_free(struct _PageLinkGrid *grid)
 {
-    unsigned int i;
-    int do_caching = 1;
-    struct _Page *pg = NULL;
-    int next;
-    while (1) {
-        g_mutex_lock(&_page_cache.control_lock);
-        i = _page_cache.current_index + 1;
-        if (_page_cache.pages_cached == _page_cache.npages)
-            _page_cache.do_caching = 0;
-        do_caching = _page_cache.do_caching;
-        g_mutex_unlock(&_page_cache.control_lock);
-        if (!do_caching)
-            break;
-        next = 0;
-        while (!next) {
-            if (i == _page_cache.npages) {
-                i = 0;
-            }
-            pg = _page_cache_get_page(i);
-            if (pg) {
-                g_mutex_lock(&pg->page_lock);
-                if (!pg->compressed)
-                    next = 1;
-                g_mutex_unlock(&pg->page_lock);
-            }
-            if (!next) {
-                if (i == _page_cache.current_index)
-                    break;
-                i++;
-            }
-        }
-        if (next) {
-            pg = _page_cache_get_page(i);
-            if (pg) {
-                g_mutex_lock(&pg->page_lock);
-                if (_page_cache_compress_page(i) == 0) {
-                    g_mutex_lock(&_page_cache.control_lock);
-                    _page_cache.pages_cached++;
-                    g_mutex_unlock(&_page_cache.control_lock);
-                }
-                g_mutex_unlock(&pg->page_lock);
-            }
-        }
+    if (grid == NULL)
+        return;
+    g_free(grid->links);
+    g_free(grid->cell_links);
+    g_free(grid);
+}
+
+PopplerAction *_page_link_grid_lookup(struct _PageLinkGrid *grid, double x, double y)
+{
+    UtilPoint pt = { x, y };
+    UtilRect r;
+    PopplerLinkMapping *mapping;
+    double fx, fy;
+    unsigned int i, c;
+
+    fx = (x - grid->x0) / grid->cell_width;
+    fy = (y - grid->y0) / grid->cell_height;
+    if (fx < 0.0 || fy < 0.0 || fx > PAGE_CACHE_LINK_GRID_SIZE || fy > PAGE_CACHE_LINK_GRID_SIZE)
+        return NULL;
+    c = MIN((unsigned int)fy, PAGE_CACHE_LINK_GRID_SIZE - 1) * PAGE_CACHE_LINK_GRID_SIZE +
+        MIN((unsigned int)fx, PAGE_CACHE_LINK_GRID_SIZE - 1);
+
+    for (i = grid->cell_start[c]; i < grid->cell_start[c + 1]; i++) {
+        mapping = grid->links[grid->cell_links[i]];
+        r.x1 = mapping->area.x1;
+        r.x2 = mapping->area.x2;
+        r.y1 = mapping->area.y1;
+        r.y2 = mapping->area.y2;
+        if (util_point_in_rect(&pt, &r))
+            return mapping->action;
     }
-    _page_cache.cache_thread = NULL;
     return NULL;
 }
 
-void page_cache_start_caching(void)
+PopplerDest *page_cache_get_named_dest(const gchar *dest)
 {
-    _page_cache.do_caching = 1;
-    _page_cache.cache_thread =
-        g_thread_new("PageCache", _page_cache_caching_thread, NULL);
+    struct _PageDocument *d = _page_cache_get_document();
+    GHashTable *named_dests;
+    PopplerDest *dst = NULL;
+    if (d) {
+        named_dests = _page_document_get_named_dests(d);
+        if (named_dests && dest)
+            dst = g_hash_table_lookup(named_dests, dest);
+        if (dst)
+            dst = poppler_dest_copy(dst);
+        _page_document_unref(d);
+    }
+    return dst;
 }
 
-void page_cache_stop_caching(void)
+/* the caller has to free the result with poppler_page_transition_free() */
+PopplerPageTransition *page_cache_get_page_transition(int index)
 {
-    g_mutex_lock(&_page_cache.control_lock);
-    _page_cache.do_caching = 0;
-    g_mutex_unlock(&_page_cache.control_lock);
-    if (_page_cache.cache_thread)
-        g_thread_join(_page_cache.cache_thread);
+    struct _PageDocument *d = _page_cache_get_document();
+    struct _PageMetadata *md = _page_document_get_metadata(d, index);
+    PopplerPageTransition *transition = NULL;
+    if (md && md->transition)
+        transition = poppler_page_transition_copy(md->transition);
+    _page_document_unref(d);
+    return transition;
 }
 
-int page_cache_load_page(int index)
+GArray *page_cache_search(const gchar *query, guint max_results)
 {
-    PopplerPage *page;
-    double h;
-    unsigned int ph;
-    if (page_cache_fetch_page(index, NULL, NULL, &ph, NULL) != 0) {
-        return 1;
-    }
-    page_cache_page_reference(index);
-    /* load links */
-    g_mutex_lock(&_page_cache.data_lock);
-    g_mutex_lock(&_page_cache.poppler_lock);
-    if (_page_cache.page_links) {
-        poppler_page_free_link_mapping(_page_cache.page_links);
-        _page_cache.page_links = NULL;
-    }
-    page = poppler_document_get_page(_page_cache.doc, index);
-    if (page) {
-        _page_cache.page_links = poppler_page_get_link_mapping(page);
-        poppler_page_get_size(page, NULL, &h);
-        _page_cache.current_scale = ph/h;
-        g_object_unref(page);
-    }
-    g_mutex_unlock(&_page_cache.poppler_lock);
-    g_mutex_lock(&_page_cache.control_lock);
-    _page_cache.current_index = index;
-    g_mutex_unlock(&_page_cache.control_lock);
-    g_mutex_unlock(&_page_cache.data_lock);
+    struct _PageDocument *d = _page_cache_get_document();
+    SearchIndex *index = d ? g_atomic_pointer_get(&d->search_index) : NULL;
+    GArray *results = index ? search_index_query(index, query, max_results) : NULL;
+    _page_document_unref(d);
+    return results;
+}
 
-    return 0;
+struct _Page *_page_cache_get_page(struct _PageDocument *d, int index)
+{
+    if (d == NULL || index < 0 || index >= d->npages || d->pages == NULL) {
+        return NULL;
+    }
+    return &d->pages[index];
 }
 
-int page_cache_fetch_page(int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height, int *guess_split)
+/* page lock has to be held */
+int _page_cache_page_make_surface(struct _PageDocument *d, int index)
 {
-    struct _Page *pg = _page_cache_get_page(index);
-    if (!pg) {
+    struct _Page *pg = _page_cache_get_page(d, index);
+    if (!pg)
         return 1;
-    }
-    /* if surface exists (and is set) get surface */
-    /* else if compressed exists, uncompress, get surface */
+    /* if surface exists (and is set) use surface */
+    /* else if compressed exists, uncompress */
     /* else init width, height, surface (render) */
-    g_mutex_lock(&pg->page_lock);
-    if (pg->uncompressed && pg->surf) {
-        if (surf) *surf = pg->surf;
-        if (width) *width = pg->width;
-        if (height) *height = pg->height;
-    }
-    else if (pg->compressed && pg->compressed_buffer) {
-        if (_page_cache_uncompress_page(index) != 0) {
-            g_mutex_unlock(&pg->page_lock);
+    if (_page_cache_page_has_state(pg, PAGE_STATE_UNCOMPRESSED) && pg->surf) {
+        return 0;
+    }
+    else if (_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED) && pg->compressed_buffer) {
+        if (_page_cache_uncompress_page(d, index) != 0) {
             fprintf(stderr, "could not uncompress page\n");
             return 1;
         }
-        if (surf) *surf = pg->surf;
-        if (width) *width = pg->width;
-        if (height) *height = pg->height;
     }
     else {
-        if (_page_cache_render_page(index, &pg->surf, &pg->width, &pg->height) != 0) {
-            g_mutex_unlock(&pg->page_lock);
+        if (_page_cache_render_page(d, index, &pg->surf, &pg->width, &pg->height) != 0) {
             fprintf(stderr, "render page return non null\n");
             return 1;
         }
-        if (pg->width > 2*pg->height) {
-            pg->split_guess = 1;
-        }
-        else {
-            pg->split_guess = 0;
-        }
-
-        pg->uncompressed = 1;
-
-        if (surf) *surf = pg->surf;
-        if (width) *width = pg->width;
-        if (height) *height = pg->height;
+        _page_cache_page_set_state(pg, PAGE_STATE_UNCOMPRESSED, TRUE);
     }
 
     pg->split_guess = (pg->width > 2*pg->height ? 1 : 0);
-    if (guess_split) *guess_split = pg->split_guess;
-
-    g_mutex_unlock(&pg->page_lock);
-    return 0;
-}
-
-void page_cache_page_reference(int index)
-{
-    struct _Page *pg = _page_cache_get_page(index);
-    if (pg) {
-        g_mutex_lock(&pg->page_lock);
-        pg->ref_count++;
-        g_mutex_unlock(&pg->page_lock);
-    }
-}
-
-void page_cache_page_unref(int index)
-{
-    struct _Page *pg = _page_cache_get_page(index);
-    if (pg) {
-        g_mutex_lock(&pg->page_lock);
-        if (pg->ref_count) {
-            pg->ref_count--;
-        }
-        if (pg->ref_count == 0) {
-            if (pg->surf) {
-                cairo_surface_destroy(pg->surf);
-                pg->surf = NULL;
-            }
-            if (pg->uncompressed_buffer) {
-                g_free(pg->uncompressed_buffer);
-                pg->uncompressed_buffer = NULL;
-            }
-            pg->uncompressed = 0;
-        }
-        g_mutex_unlock(&pg->page_lock);
-    }
-}
 
-PopplerAction *page_cache_get_action_from_pos(double x, double y)
-{
-    g_mutex_lock(&_page_cache.data_lock);
-    g_mutex_lock(&_page_cache.poppler_lock);
-    PopplerAction *ret = NULL;
-    GList *tmp = _page_cache.page_links;
-    UtilPoint pt = { x / _page_cache.current_scale,
-                     y / _page_cache.current_scale
-                   };
-    UtilRect r;
+    g_atomic_int_inc(&d->pages_decompressed);
+    g_atomic_pointer_add(&d->decompressed_size, (gssize)_page_cache_page_surface_size(pg));
 
-    while (tmp) {
-        r.x1 = ((PopplerLinkMapping *)tmp->data)->area.x1;
-        r.x2 = ((PopplerLinkMapping *)tmp->data)->area.x2;
-        r.y1 = ((PopplerLinkMapping *)tmp->data)->area.y1;
-        r.y2 = ((PopplerLinkMapping *)tmp->data)->area.y2;
-        if (util_point_in_rect(&pt, &r)) {
-            ret = ((PopplerLinkMapping *)tmp->data)->action;
-            g_mutex_unlock(&_page_cache.poppler_lock);
-            g_mutex_unlock(&_page_cache.data_lock);
-            return ret;
-        }
-        tmp = tmp->next;
-    }
-    g_mutex_unlock(&_page_cache.poppler_lock);
-    g_mutex_unlock(&_page_cache.data_lock);
-    return NULL;
+    return 0;
 }
 
-PopplerDest *page_cache_get_named_dest(const gchar *dest)
+/* size of the rendering of a page of pw x ph points */
+void _page_cache_scaled_size(double pw, double ph, unsigned int *width, unsigned int *height, double *scale)
 {
-    g_mutex_lock(&_page_cache.poppler_lock);
-    PopplerDest *d = poppler_document_find_dest(_page_cache.doc, dest);
-    g_mutex_unlock(&_page_cache.poppler_lock);
-    return d;
-}
+    /* cut of one inch, did not affect working pdfs but fixed wrong margin on some tex-a4paper-pdf */
+    double s = _page_cache.scale_to_height / (ph-72);
 
-struct _Page *_page_cache_get_page(int index)
-{
-    if (index < 0 || index >= _page_cache.npages || _page_cache.pages == NULL || _page_cache.doc == NULL) {
-        return NULL;
-    }
-    return &_page_cache.pages[index];
+    if (width) *width = (unsigned int)(s * pw + 0.75f);
+    if (height) *height = (unsigned int)(s * ph + 0.75f);
+    if (scale) *scale = s;
 }
 
-int _page_cache_render_page(int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height)
+int _page_cache_render_page(struct _PageDocument *d, int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height)
 {
+    PopplerDocument *doc;
     PopplerPage *page;
     unsigned int w, h;
     double ph, pw;
     double scale;
     cairo_t *c;
+    struct _PageMetadata *md;
+    PageInfo info;
     /*  PopplerRectangle cropbox;*/
-    if (_page_cache.doc == NULL)
+    if (d == NULL)
         return 1;
     if (!surf) return 1;
 
-    g_mutex_lock(&_page_cache.poppler_lock);
-    page = poppler_document_get_page(_page_cache.doc, index);
+    /* workers have their own copy of the document and need no poppler lock */
+    if (render_worker_enabled()) {
+        if ((md = _page_document_get_metadata(d, index)) != NULL && md->height > 0) {
+            pw = md->width;
+            ph = md->height;
+        }
+        else if (_page_document_page_info(d, index, 0, &info) == 0 && info.height > 0) {
+            pw = info.width;
+            ph = info.height;
+        }
+        else {
+            return 1;
+        }
+        _page_cache_scaled_size(pw, ph, &w, &h, &scale);
+        if (render_worker_render(d->serial, d->bytes, index, scale, w, h, surf) != 0)
+            return 1;
+        if (width) *width = w;
+        if (height) *height = h;
+        return 0;
+    }
+
+    if (d->doc == NULL)
+        return 1;
+
+    doc = _page_document_borrow(d);
+    page = doc ? poppler_document_get_page(doc, index) : NULL;
     if (!page) {
-        g_mutex_unlock(&_page_cache.poppler_lock);
+        _page_document_return(d, doc);
         return 1;
     }
     poppler_page_get_size(page, &pw, &ph);
-    /* cut of one inch, did not affect working pdfs but fixed wrong margin on some tex-a4paper-pdf */
-    scale = _page_cache.scale_to_height / (ph-72);
+    _page_cache_scaled_size(pw, ph, &w, &h, &scale);
 
     /*  poppler_page_get_crop_box(page, &cropbox);
       fprintf(stderr, "cropbox: %f, %f, %f, %f\n", cropbox.x1, cropbox.y1, cropbox.x2, cropbox.y2);*/
 
-    w = (unsigned int)(scale * pw + 0.75f);
-    h = (unsigned int)(scale * ph + 0.75f);
-
     *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int)w, (int)h);
     if (!(*surf)) {
         g_object_unref(page);
-        g_mutex_unlock(&_page_cache.poppler_lock);
+        _page_document_return(d, doc);
         return 1;
     }
 
     c = cairo_create(*surf);
     if (!c) {
         g_object_unref(page);
-        g_mutex_unlock(&_page_cache.poppler_lock);
+        _page_document_return(d, doc);
         return 1;
     }
 
@@ -464,7 +2024,7 @@ int _page_cache_render_page(int index, cairo_surface_t **surf, unsigned int *wid
     cairo_destroy(c);
     g_object_unref(page);
 
-    g_mutex_unlock(&_page_cache.poppler_lock);
+    _page_document_return(d, doc);
 
     if (width) *width = w;
     if (height) *height = h;
@@ -472,59 +2032,365 @@ int _page_cache_render_page(int index, cairo_surface_t **surf, unsigned int *wid
     return 0;
 }
 
-int _page_cache_compress_page(int index)
+/* Render and compress the page without holding its lock, which is only
+ * taken to publish the result. An identical page of the previous version
+ * is copied instead of compressed again. */
+int _page_cache_compress_page(struct _PageDocument *d, int index)
 {
-    cairo_surface_t *pgsurf = NULL;
-    unsigned char *buffer = NULL;
+    cairo_surface_t *pgsurf = NULL, *thumbnail;
+    unsigned char *buffer = NULL, *compressed;
     unsigned int width, height, stride;
-    gsize bufsize;
-    struct _Page *pg = _page_cache_get_page(index);
+    unsigned int b, band_count, rows;
+    struct _PageBandJob *jobs;
+    gsize *offsets;
+    gchar *fingerprint;
+    struct _Page *pg = _page_cache_get_page(d, index);
     if (!pg)
         return 1;
-    if (_page_cache_render_page(index, &pgsurf, &width, &height) != 0) {
+
+    if (_page_cache_render_page(d, index, &pgsurf, &width, &height) != 0) {
         return 1;
     }
     stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
-    bufsize = stride * height;
 
     buffer = cairo_image_surface_get_data(pgsurf);
-    if (buffer) {
-        if (_page_cache_compress_buffer(buffer, bufsize, &pg->compressed_buffer, &pg->buffer_size) != 0) {
-            return 1;
-        }
-        pg->compressed = 1;
-        pg->width = width;
-        pg->height = height;
+    if (!buffer) {
+        cairo_surface_destroy(pgsurf);
+        return 1;
+    }
+
+    fingerprint = _page_cache_bitmap_fingerprint(buffer, width, height, stride);
+    if (_page_cache_adopt_page(d, fingerprint, &compressed, &offsets, &band_count, &thumbnail) == 0) {
+        cairo_surface_destroy(pgsurf);
+        goto publish;
+    }
+
+    band_count = (height + PAGE_CACHE_BAND_ROWS - 1) / PAGE_CACHE_BAND_ROWS;
+    jobs = g_malloc0(sizeof(struct _PageBandJob) * band_count);
+    for (b = 0; b < band_count; b++) {
+        rows = MIN(PAGE_CACHE_BAND_ROWS, height - b * PAGE_CACHE_BAND_ROWS);
+        jobs[b].in = buffer + (gsize)b * PAGE_CACHE_BAND_ROWS * stride;
+        jobs[b].insize = (gsize)rows * stride;
+        jobs[b].compress = 1;
+    }
+
+    if (_page_cache_run_band_jobs(jobs, band_count) != 0) {
+        for (b = 0; b < band_count; b++)
+            g_free(jobs[b].out);
+        g_free(jobs);
+        cairo_surface_destroy(pgsurf);
+        g_free(fingerprint);
+        return 1;
+    }
+
+    offsets = g_malloc(sizeof(gsize) * (band_count + 1));
+    offsets[0] = 0;
+    for (b = 0; b < band_count; b++)
+        offsets[b + 1] = offsets[b] + jobs[b].outsize;
+
+    compressed = g_malloc(offsets[band_count]);
+    for (b = 0; b < band_count; b++) {
+        memcpy(compressed + offsets[b], jobs[b].out, jobs[b].outsize);
+        g_free(jobs[b].out);
     }
+    g_free(jobs);
 
+    thumbnail = _page_cache_make_thumbnail(pgsurf, width, height);
     cairo_surface_destroy(pgsurf);
 
+publish:
+    g_mutex_lock(_page_cache_page_lock(d, index));
+    if (_page_cache_page_has_state(pg, PAGE_STATE_COMPRESSED)) {
+        g_mutex_unlock(_page_cache_page_lock(d, index));
+        g_free(compressed);
+        g_free(offsets);
+        g_free(fingerprint);
+        if (thumbnail)
+            cairo_surface_destroy(thumbnail);
+        return 0;
+    }
+    pg->compressed_buffer = compressed;
+    pg->buffer_size = offsets[band_count];
+    pg->band_offsets = offsets;
+    pg->band_count = band_count;
+    g_free(pg->fingerprint);
+    pg->fingerprint = fingerprint;
+    pg->width = width;
+    pg->height = height;
+    pg->split_guess = (width > 2*height ? 1 : 0);
+    if (!pg->thumbnail) {
+        pg->thumbnail = thumbnail;
+        thumbnail = NULL;
+    }
+    _page_cache_page_set_state(pg, PAGE_STATE_COMPRESSED, TRUE);
+    g_atomic_int_inc(&d->pages_cached);
+    g_atomic_pointer_add(&d->cached_size, (gssize)pg->buffer_size);
+    g_mutex_unlock(_page_cache_page_lock(d, index));
+
+    if (thumbnail)
+        cairo_surface_destroy(thumbnail);
+
     return 0;
 }
 
-int _page_cache_uncompress_page(int index)
+cairo_surface_t *_page_cache_make_thumbnail(cairo_surface_t *surf, unsigned int width, unsigned int height)
+{
+    cairo_surface_t *thumbnail;
+    unsigned int tw, th;
+    cairo_t *cr;
+
+    if (height == 0)
+        return NULL;
+    th = MIN(PAGE_CACHE_THUMBNAIL_HEIGHT, height);
+    tw = MAX(1, width * th / height);
+
+    thumbnail = cairo_image_surface_create(CAIRO_FORMAT_RGB24, tw, th);
+    cr = cairo_create(thumbnail);
+    cairo_scale(cr, (double)tw / width, (double)th / height);
+    cairo_set_source_surface(cr, surf, 0.0f, 0.0f);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    return thumbnail;
+}
+
+cairo_surface_t *page_cache_get_thumbnail(int index)
+{
+    struct _PageDocument *d = _page_cache_get_document();
+    struct _Page *pg = _page_cache_get_page(d, index);
+    cairo_surface_t *thumbnail = NULL;
+
+    if (pg) {
+        g_mutex_lock(_page_cache_page_lock(d, index));
+        if (pg->thumbnail)
+            thumbnail = cairo_surface_reference(pg->thumbnail);
+        g_mutex_unlock(_page_cache_page_lock(d, index));
+    }
+    _page_document_unref(d);
+
+    return thumbnail;
+}
+
+int _page_cache_uncompress_page(struct _PageDocument *d, int index)
 {
-    struct _Page *pg = _page_cache_get_page(index);
-    gsize bufsize;
+    struct _Page *pg = _page_cache_get_page(d, index);
+    unsigned char *buffer = NULL;
+    struct _PageBandJob *jobs;
+    unsigned int b, rows;
     unsigned int stride;
     if (!pg)
         return 1;
     stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, pg->width);
-    bufsize = pg->height*stride;
-    if (_page_cache_uncompress_buffer(pg->compressed_buffer, pg->buffer_size, &pg->uncompressed_buffer, bufsize) != 0) {
-        return 1;
+    buffer = g_malloc((gsize)pg->height * stride);
+
+    jobs = g_malloc0(sizeof(struct _PageBandJob) * pg->band_count);
+    for (b = 0; b < pg->band_count; b++) {
+        rows = MIN(PAGE_CACHE_BAND_ROWS, pg->height - b * PAGE_CACHE_BAND_ROWS);
+        jobs[b].in = pg->compressed_buffer + pg->band_offsets[b];
+        jobs[b].insize = pg->band_offsets[b + 1] - pg->band_offsets[b];
+        jobs[b].out = buffer + (gsize)b * PAGE_CACHE_BAND_ROWS * stride;
+        jobs[b].outsize = (gsize)rows * stride;
+        jobs[b].compress = 0;
     }
-    if (pg->uncompressed_buffer) {
-        pg->surf = cairo_image_surface_create_for_data(pg->uncompressed_buffer,
-                   CAIRO_FORMAT_ARGB32, pg->width, pg->height, stride);
-        pg->uncompressed = 1;
+    if (_page_cache_run_band_jobs(jobs, pg->band_count) != 0) {
+        g_free(jobs);
+        g_free(buffer);
+        return 1;
     }
-    else {
+    g_free(jobs);
+
+    pg->surf = cairo_image_surface_create_for_data(buffer,
+               CAIRO_FORMAT_ARGB32, pg->width, pg->height, stride);
+    if (cairo_surface_set_user_data(pg->surf, &_page_cache_buffer_key, buffer, g_free) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(pg->surf);
+        pg->surf = NULL;
+        g_free(buffer);
         return 1;
     }
+    _page_cache_page_set_state(pg, PAGE_STATE_UNCOMPRESSED, TRUE);
     return 0;
 }
 
+/* see page_info_read(), NULL on error */
+/* Pages rendered at the same size with the same pixels have the same
+ * fingerprint. */
+gchar *_page_cache_bitmap_fingerprint(unsigned char *data, unsigned int width, unsigned int height, unsigned int stride)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA1);
+    gchar *fingerprint;
+
+    g_checksum_update(sum, (guchar *)&width, sizeof(unsigned int));
+    g_checksum_update(sum, (guchar *)&height, sizeof(unsigned int));
+    g_checksum_update(sum, data, (gssize)stride * height);
+    fingerprint = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+
+    return fingerprint;
+}
+
+/* Remember the compressed pages of the version being replaced. d is not
+ * published yet; old is still in use. */
+void _page_document_set_previous(struct _PageDocument *d, struct _PageDocument *old)
+{
+    GHashTable *pages;
+    struct _Page *opg;
+    unsigned int i;
+
+    pages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < old->npages; i++) {
+        opg = &old->pages[i];
+        g_mutex_lock(_page_cache_page_lock(old, i));
+        if (_page_cache_page_has_state(opg, PAGE_STATE_COMPRESSED) && opg->fingerprint)
+            g_hash_table_insert(pages, g_strdup(opg->fingerprint), GUINT_TO_POINTER(i));
+        g_mutex_unlock(_page_cache_page_lock(old, i));
+    }
+    if (g_hash_table_size(pages) == 0) {
+        g_hash_table_destroy(pages);
+        return;
+    }
+
+    d->previous = _page_document_ref(old);
+    d->previous_pages = pages;
+}
+
+/* once d is cached, or memory is short, the previous version may go */
+void _page_document_forget_previous(struct _PageDocument *d)
+{
+    struct _PageDocument *previous;
+    GHashTable *pages;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    previous = d->previous;
+    pages = d->previous_pages;
+    d->previous = NULL;
+    d->previous_pages = NULL;
+    g_mutex_unlock(&_page_cache.control_lock);
+
+    if (pages)
+        g_hash_table_destroy(pages);
+    _page_document_unref(previous);
+}
+
+/* Copy the compressed data of the page of the previous version with this
+ * fingerprint; returns 1 if there is none. */
+int _page_cache_adopt_page(struct _PageDocument *d, const gchar *fingerprint, unsigned char **compressed,
+                           gsize **offsets, unsigned int *band_count, cairo_surface_t **thumbnail)
+{
+    struct _PageDocument *old;
+    struct _Page *opg;
+    gpointer oindex = NULL;
+    int ret = 1;
+
+    g_mutex_lock(&_page_cache.control_lock);
+    old = d->previous_pages &&
+          g_hash_table_lookup_extended(d->previous_pages, fingerprint, NULL, &oindex) ?
+          _page_document_ref(d->previous) : NULL;
+    g_mutex_unlock(&_page_cache.control_lock);
+    if (!old)
+        return 1;
+
+    opg = &old->pages[GPOINTER_TO_UINT(oindex)];
+    g_mutex_lock(_page_cache_page_lock(old, GPOINTER_TO_UINT(oindex)));
+    /* the page may have been shed since */
+    if (_page_cache_page_has_state(opg, PAGE_STATE_COMPRESSED) && opg->compressed_buffer &&
+            g_strcmp0(opg->fingerprint, fingerprint) == 0) {
+        *compressed = g_malloc(opg->buffer_size);
+        memcpy(*compressed, opg->compressed_buffer, opg->buffer_size);
+        *offsets = g_malloc(sizeof(gsize) * (opg->band_count + 1));
+        memcpy(*offsets, opg->band_offsets, sizeof(gsize) * (opg->band_count + 1));
+        *band_count = opg->band_count;
+        *thumbnail = opg->thumbnail ? cairo_surface_reference(opg->thumbnail) : NULL;
+        ret = 0;
+    }
+    g_mutex_unlock(_page_cache_page_lock(old, GPOINTER_TO_UINT(oindex)));
+
+    _page_document_unref(old);
+    return ret;
+}
+
+void _page_cache_band_job_proc(struct _PageBandJob *job, gpointer userdata)
+{
+    int ret;
+    if (job->compress)
+        ret = _page_cache_compress_buffer(job->in, job->insize, &job->out, &job->outsize);
+    else
+        ret = _page_cache_uncompress_buffer(job->in, job->insize, job->out, job->outsize);
+
+    g_mutex_lock(&job->batch->lock);
+    job->done = 1;
+    if (ret != 0)
+        job->batch->failed = 1;
+    if (--job->batch->pending == 0)
+        g_cond_signal(&job->batch->cond);
+    g_mutex_unlock(&job->batch->lock);
+}
+
+void _page_cache_band_job_run(Job *job, struct _PageBandJob *band)
+{
+    _page_cache_band_job_proc(band, NULL);
+}
+
+/* Run all band jobs, spreading them over the band pool. The calling thread
+ * takes the first band itself and waits for the others. Background threads
+ * leave the band pool, which runs at normal priority for the UI, alone and
+ * queue their bands as compress jobs for the other background threads. */
+int _page_cache_run_band_jobs(struct _PageBandJob *jobs, unsigned int count)
+{
+    struct _PageBandBatch batch;
+    Job **queued = NULL;
+    unsigned int b;
+
+    if (count == 0)
+        return 1;
+
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.cond);
+    batch.pending = count;
+    batch.failed = 0;
+
+    for (b = 0; b < count; b++)
+        jobs[b].batch = &batch;
+
+    if (jobs_in_background_thread() && count > 1) {
+        queued = g_malloc0(sizeof(Job *) * count);
+        for (b = 1; b < count; b++)
+            queued[b] = jobs_submit(JOB_PRIORITY_COMPRESS, 0, NULL, (JobFunc)_page_cache_band_job_run,
+                                    &jobs[b], NULL);
+    }
+    else {
+        for (b = 1; b < count; b++) {
+            if (!_page_cache.band_pool || !g_thread_pool_push(_page_cache.band_pool, &jobs[b], NULL))
+                _page_cache_band_job_proc(&jobs[b], NULL);
+        }
+    }
+    _page_cache_band_job_proc(&jobs[0], NULL);
+
+    if (queued) {
+        /* bands no other thread took yet are done here */
+        for (b = 1; b < count; b++) {
+            job_wait(queued[b]);
+            job_unref(queued[b]);
+        }
+        g_free(queued);
+        /* dropped without running when the jobs shut down */
+        for (b = 1; b < count; b++) {
+            if (!jobs[b].done)
+                _page_cache_band_job_proc(&jobs[b], NULL);
+        }
+    }
+
+    g_mutex_lock(&batch.lock);
+    while (batch.pending)
+        g_cond_wait(&batch.cond, &batch.lock);
+    g_mutex_unlock(&batch.lock);
+
+    g_cond_clear(&batch.cond);
+    g_mutex_clear(&batch.lock);
+
+    return batch.failed;
+}
+
 int _page_cache_compress_buffer(unsigned char *in, gsize insize, unsigned char **out, gsize *outsize)
 {
     int ret;
@@ -535,7 +2401,8 @@ int _page_cache_compress_buffer(unsigned char *in, gsize insize, unsigned char *
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, 6);
+    ret = deflateInit(&strm, g_atomic_int_get(&_page_cache.power_saving) ?
+                             PAGE_CACHE_POWER_COMPRESSION : PAGE_CACHE_COMPRESSION_LEVEL);
     if (ret != Z_OK)
         return 1;
     bound = deflateBound(&strm, insize);
@@ -565,7 +2432,7 @@ int _page_cache_compress_buffer(unsigned char *in, gsize insize, unsigned char *
     return 0;
 }
 
-int _page_cache_uncompress_buffer(unsigned char *in, gsize insize, unsigned char **out, gsize outsize)
+int _page_cache_uncompress_buffer(unsigned char *in, gsize insize, unsigned char *out, gsize outsize)
 {
     int ret;
     z_stream strm;
@@ -580,24 +2447,16 @@ int _page_cache_uncompress_buffer(unsigned char *in, gsize insize, unsigned char
     if (ret != Z_OK) {
         return 1;
     }
-    *out = g_malloc(outsize);
 
     strm.avail_in = insize;
     strm.next_in = in;
     strm.avail_out = outsize;
-    strm.next_out = *out;
-    ret = inflate(&strm, Z_NO_FLUSH);
-    if (ret == Z_STREAM_ERROR) {
-        g_free(*out);
-        inflateEnd(&strm);
-        return 1;
-    }
-    if (strm.avail_in != 0) {
-        g_free(*out);
-        inflateEnd(&strm);
+    strm.next_out = out;
+    ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.avail_out != 0) {
         return 1;
     }
-    inflateEnd(&strm);
 
     return 0;
 }
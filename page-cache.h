@@ -4,30 +4,86 @@
 #include <glib.h>
 #include <cairo.h>
 #include <poppler.h>
+#include "pressure.h"
+#include "search-index.h"
 
 typedef struct _PageCacheStatus {
     unsigned int pages_cached;
     unsigned int page_count;
     gsize cached_size;
+    unsigned int pages_decompressed;
+    gsize decompressed_size;
+    double background_cpu; /* share of one CPU since the last call */
 } PageCacheStatus;
 
+typedef struct _PageCacheLease {
+    cairo_surface_t *surface;
+    unsigned int width;
+    unsigned int height;
+    int guess_split;
+    int index;
+    /* version of the document the surface belongs to */
+    gpointer document;
+} PageCacheLease;
+
+/* One open document. Instances share the job threads and one memory budget;
+ * the functions without an instance work on the presented one. */
+typedef struct _PageCacheInstance PageCacheInstance;
+
+/* result is PAGE_CACHE_RELOAD_UNCHANGED if the file is still the same */
+#define PAGE_CACHE_RELOAD_UNCHANGED -1
+typedef void (*PageCacheReloadCallback)(int, gpointer);
+
 int page_cache_init(void);
 void page_cache_cleanup(void);
 int page_cache_load_document(const gchar *uri);
+void page_cache_reload_document_async(const gchar *uri, PageCacheReloadCallback callback, gpointer userdata);
+guint page_cache_get_generation(void);
 void page_cache_unload_document(void);
 
+PageCacheInstance *page_cache_instance_new(void);
+void page_cache_instance_free(PageCacheInstance *cache);
+int page_cache_instance_load_document(PageCacheInstance *cache, const gchar *uri);
+void page_cache_instance_load_document_async(PageCacheInstance *cache, const gchar *uri,
+                                             PageCacheReloadCallback callback, gpointer userdata);
+int page_cache_instance_finish_loading(PageCacheInstance *cache);
+gboolean page_cache_instance_has_document(PageCacheInstance *cache);
+PageCacheInstance *page_cache_get_presented(void);
+void page_cache_set_presented(PageCacheInstance *cache);
+unsigned int page_cache_get_current_index(void);
+/* limit for the compressed pages of all instances, 0 for none */
+void page_cache_set_memory_budget(gsize budget);
+
 void page_cache_set_scale_to_height(double scale_to_height);
 
 unsigned int page_cache_get_page_count(void);
 void page_cache_get_status(PageCacheStatus *status);
 void page_cache_start_caching(void);
 void page_cache_stop_caching(void);
+void page_cache_set_power_saving(gboolean power_saving);
+void page_cache_set_memory_pressure(PressureLevel level);
 int page_cache_load_page(int index);
-int page_cache_fetch_page(int index, cairo_surface_t **surf, unsigned int *width, unsigned int *height, int *guess_split);
+int page_cache_page_acquire(int index, PageCacheLease *lease);
+void page_cache_page_release(PageCacheLease *lease);
+/* does not block; until the page is indexed, the size may be a guess */
+int page_cache_get_page_size(int index, unsigned int *width, unsigned int *height, int *guess_split);
+/* small copy kept for every cached page, NULL if the page was not cached yet;
+ * release with cairo_surface_destroy() */
+cairo_surface_t *page_cache_get_thumbnail(int index);
 void page_cache_page_reference(int index);
 void page_cache_page_unref(int index);
 PopplerAction *page_cache_get_action_from_pos(double x, double y);
+/* these do not block and return NULL until the document is indexed */
 PopplerDest *page_cache_get_named_dest(const gchar *dest);
+PopplerPageTransition *page_cache_get_page_transition(int index);
+/* results of search_index_query() on the presented document,
+ * NULL while its text is still being indexed */
+GArray *page_cache_search(const gchar *query, guint max_results);
+
+/* called on the main loop once sizes, labels, links and transitions of the
+ * presented document are all known */
+typedef void (*PageCacheIndexedCallback)(gpointer);
+void page_cache_set_indexed_callback(PageCacheIndexedCallback callback, gpointer userdata);
 
 /* label, index of first page, userdata */
 typedef void (*PageCacheEnumLabelsProc)(gchar *, gint, gpointer);
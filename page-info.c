@@ -0,0 +1,437 @@
+#include "page-info.h"
+#include <memory.h>
+
+/* reads from serialized data, failed is set on the first read past the end */
+struct _PageInfoReader {
+    const guchar *data;
+    gsize size;
+    gsize pos;
+    int failed;
+};
+
+void _page_info_put(GByteArray *buf, gconstpointer data, gsize size);
+void _page_info_put_u32(GByteArray *buf, guint32 value);
+void _page_info_put_double(GByteArray *buf, double value);
+void _page_info_put_string(GByteArray *buf, const gchar *str);
+void _page_info_put_dest(GByteArray *buf, PopplerDest *dest);
+void _page_info_put_action(GByteArray *buf, PopplerAction *action);
+int _page_info_get(struct _PageInfoReader *reader, gpointer data, gsize size);
+guint32 _page_info_get_u32(struct _PageInfoReader *reader);
+double _page_info_get_double(struct _PageInfoReader *reader);
+gchar *_page_info_get_string(struct _PageInfoReader *reader);
+PopplerDest *_page_info_get_dest(struct _PageInfoReader *reader);
+PopplerAction *_page_info_get_action(struct _PageInfoReader *reader);
+gboolean _page_info_add_named_dest(gchar *name, PopplerDest *dest, GHashTable *named_dests);
+
+int page_info_read(PopplerPage *page, guint flags, PageInfo *info)
+{
+    memset(info, 0, sizeof(PageInfo));
+    if (page == NULL)
+        return 1;
+
+    info->flags = flags;
+    poppler_page_get_size(page, &info->width, &info->height);
+
+    if (flags & PAGE_INFO_METADATA) {
+        info->label = poppler_page_get_label(page);
+        info->links = poppler_page_get_link_mapping(page);
+        info->transition = poppler_page_get_transition(page);
+    }
+    if (flags & PAGE_INFO_TEXT) {
+        info->text = poppler_page_get_text(page);
+        if (!poppler_page_get_text_layout(page, &info->rects, &info->n_rects)) {
+            info->rects = NULL;
+            info->n_rects = 0;
+        }
+    }
+
+    return 0;
+}
+
+void page_info_clear(PageInfo *info)
+{
+    if (info == NULL)
+        return;
+    g_free(info->label);
+    poppler_page_free_link_mapping(info->links);
+    if (info->transition)
+        poppler_page_transition_free(info->transition);
+    g_free(info->text);
+    g_free(info->rects);
+    memset(info, 0, sizeof(PageInfo));
+}
+
+/* Only the parts selected by flags are written. Links keep the fields of
+ * the actions the presenter knows about, others become unknown actions. */
+GBytes *page_info_serialize(PageInfo *info)
+{
+    GByteArray *buf = g_byte_array_new();
+    PopplerLinkMapping *mapping;
+    PopplerPageTransition *trans;
+    GList *tmp;
+    guint i;
+
+    _page_info_put_u32(buf, info->flags);
+    _page_info_put_double(buf, info->width);
+    _page_info_put_double(buf, info->height);
+
+    if (info->flags & PAGE_INFO_METADATA) {
+        _page_info_put_string(buf, info->label);
+        _page_info_put_u32(buf, g_list_length(info->links));
+        for (tmp = info->links; tmp; tmp = tmp->next) {
+            mapping = (PopplerLinkMapping *)tmp->data;
+            _page_info_put(buf, &mapping->area, sizeof(PopplerRectangle));
+            _page_info_put_action(buf, mapping->action);
+        }
+        _page_info_put_u32(buf, info->transition ? 1 : 0);
+        if ((trans = info->transition) != NULL) {
+            _page_info_put_u32(buf, trans->type);
+            _page_info_put_u32(buf, trans->alignment);
+            _page_info_put_u32(buf, trans->direction);
+            _page_info_put_u32(buf, (guint32)trans->duration);
+            _page_info_put_u32(buf, (guint32)trans->angle);
+            _page_info_put_double(buf, trans->scale);
+            _page_info_put_u32(buf, trans->rectangular ? 1 : 0);
+            _page_info_put_double(buf, trans->duration_real);
+        }
+    }
+
+    if (info->flags & PAGE_INFO_TEXT) {
+        _page_info_put_string(buf, info->text);
+        _page_info_put_u32(buf, info->n_rects);
+        for (i = 0; i < info->n_rects; i++)
+            _page_info_put(buf, &info->rects[i], sizeof(PopplerRectangle));
+    }
+
+    return g_byte_array_free_to_bytes(buf);
+}
+
+int page_info_deserialize(GBytes *bytes, PageInfo *info)
+{
+    struct _PageInfoReader reader = { NULL, 0, 0, 0 };
+    PopplerLinkMapping *mapping;
+    PopplerPageTransition *trans;
+    guint32 count, i;
+
+    memset(info, 0, sizeof(PageInfo));
+    if (bytes == NULL)
+        return 1;
+    reader.data = g_bytes_get_data(bytes, &reader.size);
+
+    info->flags = _page_info_get_u32(&reader);
+    info->width = _page_info_get_double(&reader);
+    info->height = _page_info_get_double(&reader);
+
+    if (info->flags & PAGE_INFO_METADATA) {
+        info->label = _page_info_get_string(&reader);
+        count = _page_info_get_u32(&reader);
+        for (i = 0; i < count && !reader.failed; i++) {
+            mapping = poppler_link_mapping_new();
+            _page_info_get(&reader, &mapping->area, sizeof(PopplerRectangle));
+            mapping->action = _page_info_get_action(&reader);
+            info->links = g_list_prepend(info->links, mapping);
+        }
+        info->links = g_list_reverse(info->links);
+        if (_page_info_get_u32(&reader)) {
+            trans = info->transition = poppler_page_transition_new();
+            trans->type = _page_info_get_u32(&reader);
+            trans->alignment = _page_info_get_u32(&reader);
+            trans->direction = _page_info_get_u32(&reader);
+            trans->duration = (gint)_page_info_get_u32(&reader);
+            trans->angle = (gint)_page_info_get_u32(&reader);
+            trans->scale = _page_info_get_double(&reader);
+            trans->rectangular = _page_info_get_u32(&reader) ? TRUE : FALSE;
+            trans->duration_real = _page_info_get_double(&reader);
+        }
+    }
+
+    if (info->flags & PAGE_INFO_TEXT) {
+        info->text = _page_info_get_string(&reader);
+        count = _page_info_get_u32(&reader);
+        /* the boxes have to be there before anything is allocated for them */
+        if (count > (reader.size - reader.pos) / sizeof(PopplerRectangle))
+            reader.failed = 1;
+        else if (count > 0) {
+            info->rects = g_malloc(sizeof(PopplerRectangle) * count);
+            info->n_rects = count;
+            _page_info_get(&reader, info->rects, sizeof(PopplerRectangle) * count);
+        }
+    }
+
+    if (reader.failed) {
+        page_info_clear(info);
+        return 1;
+    }
+    return 0;
+}
+
+gboolean _page_info_add_named_dest(gchar *name, PopplerDest *dest, GHashTable *named_dests)
+{
+    g_hash_table_insert(named_dests, g_strdup(name), poppler_dest_copy(dest));
+    return FALSE;
+}
+
+GHashTable *page_info_read_named_dests(PopplerDocument *doc)
+{
+    GHashTable *named_dests;
+    GTree *dests;
+
+    named_dests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)poppler_dest_free);
+    if (doc && (dests = poppler_document_create_dests_tree(doc)) != NULL) {
+        g_tree_foreach(dests, (GTraverseFunc)_page_info_add_named_dest, named_dests);
+        g_tree_destroy(dests);
+    }
+    return named_dests;
+}
+
+GBytes *page_info_serialize_named_dests(GHashTable *named_dests)
+{
+    GByteArray *buf = g_byte_array_new();
+    GHashTableIter iter;
+    gpointer name, dest;
+
+    _page_info_put_u32(buf, g_hash_table_size(named_dests));
+    g_hash_table_iter_init(&iter, named_dests);
+    while (g_hash_table_iter_next(&iter, &name, &dest)) {
+        _page_info_put_string(buf, name);
+        _page_info_put_dest(buf, dest);
+    }
+
+    return g_byte_array_free_to_bytes(buf);
+}
+
+/* NULL if the data is malformed */
+GHashTable *page_info_deserialize_named_dests(GBytes *bytes)
+{
+    struct _PageInfoReader reader = { NULL, 0, 0, 0 };
+    GHashTable *named_dests;
+    PopplerDest *dest;
+    gchar *name;
+    guint32 count, i;
+
+    if (bytes == NULL)
+        return NULL;
+    reader.data = g_bytes_get_data(bytes, &reader.size);
+
+    named_dests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)poppler_dest_free);
+    count = _page_info_get_u32(&reader);
+    for (i = 0; i < count && !reader.failed; i++) {
+        name = _page_info_get_string(&reader);
+        dest = _page_info_get_dest(&reader);
+        if (name && dest) {
+            g_hash_table_insert(named_dests, name, dest);
+        }
+        else {
+            g_free(name);
+            if (dest)
+                poppler_dest_free(dest);
+        }
+    }
+
+    if (reader.failed) {
+        g_hash_table_destroy(named_dests);
+        return NULL;
+    }
+    return named_dests;
+}
+
+void _page_info_put(GByteArray *buf, gconstpointer data, gsize size)
+{
+    g_byte_array_append(buf, data, size);
+}
+
+void _page_info_put_u32(GByteArray *buf, guint32 value)
+{
+    _page_info_put(buf, &value, sizeof(guint32));
+}
+
+void _page_info_put_double(GByteArray *buf, double value)
+{
+    _page_info_put(buf, &value, sizeof(double));
+}
+
+/* length including the terminating zero, 0 for NULL */
+void _page_info_put_string(GByteArray *buf, const gchar *str)
+{
+    guint32 length = str ? strlen(str) + 1 : 0;
+    _page_info_put_u32(buf, length);
+    if (length > 1)
+        _page_info_put(buf, str, length - 1);
+}
+
+void _page_info_put_dest(GByteArray *buf, PopplerDest *dest)
+{
+    _page_info_put_u32(buf, dest ? 1 : 0);
+    if (dest == NULL)
+        return;
+    _page_info_put_u32(buf, dest->type);
+    _page_info_put_u32(buf, (guint32)dest->page_num);
+    _page_info_put_double(buf, dest->left);
+    _page_info_put_double(buf, dest->bottom);
+    _page_info_put_double(buf, dest->right);
+    _page_info_put_double(buf, dest->top);
+    _page_info_put_double(buf, dest->zoom);
+    _page_info_put_string(buf, dest->named_dest);
+    _page_info_put_u32(buf, (dest->change_left ? 1 : 0) | (dest->change_top ? 2 : 0) |
+                            (dest->change_zoom ? 4 : 0));
+}
+
+void _page_info_put_action(GByteArray *buf, PopplerAction *action)
+{
+    PopplerActionType type = action ? action->type : POPPLER_ACTION_UNKNOWN;
+
+    switch (type) {
+        case POPPLER_ACTION_NONE:
+        case POPPLER_ACTION_GOTO_DEST:
+        case POPPLER_ACTION_GOTO_REMOTE:
+        case POPPLER_ACTION_LAUNCH:
+        case POPPLER_ACTION_URI:
+        case POPPLER_ACTION_NAMED:
+            break;
+        default:
+            type = POPPLER_ACTION_UNKNOWN;
+            break;
+    }
+
+    _page_info_put_u32(buf, type);
+    _page_info_put_string(buf, action ? action->any.title : NULL);
+    switch (type) {
+        case POPPLER_ACTION_GOTO_DEST:
+            _page_info_put_dest(buf, action->goto_dest.dest);
+            break;
+        case POPPLER_ACTION_GOTO_REMOTE:
+            _page_info_put_string(buf, action->goto_remote.file_name);
+            _page_info_put_dest(buf, action->goto_remote.dest);
+            break;
+        case POPPLER_ACTION_LAUNCH:
+            _page_info_put_string(buf, action->launch.file_name);
+            _page_info_put_string(buf, action->launch.params);
+            break;
+        case POPPLER_ACTION_URI:
+            _page_info_put_string(buf, action->uri.uri);
+            break;
+        case POPPLER_ACTION_NAMED:
+            _page_info_put_string(buf, action->named.named_dest);
+            break;
+        default:
+            break;
+    }
+}
+
+int _page_info_get(struct _PageInfoReader *reader, gpointer data, gsize size)
+{
+    if (reader->failed || size > reader->size - reader->pos) {
+        reader->failed = 1;
+        memset(data, 0, size);
+        return 1;
+    }
+    memcpy(data, reader->data + reader->pos, size);
+    reader->pos += size;
+    return 0;
+}
+
+guint32 _page_info_get_u32(struct _PageInfoReader *reader)
+{
+    guint32 value;
+    _page_info_get(reader, &value, sizeof(guint32));
+    return value;
+}
+
+double _page_info_get_double(struct _PageInfoReader *reader)
+{
+    double value;
+    _page_info_get(reader, &value, sizeof(double));
+    return value;
+}
+
+gchar *_page_info_get_string(struct _PageInfoReader *reader)
+{
+    guint32 length = _page_info_get_u32(reader);
+    gchar *str;
+
+    if (length == 0 || reader->failed)
+        return NULL;
+    if (length - 1 > reader->size - reader->pos) {
+        reader->failed = 1;
+        return NULL;
+    }
+    str = g_strndup((const gchar *)reader->data + reader->pos, length - 1);
+    reader->pos += length - 1;
+    return str;
+}
+
+PopplerDest *_page_info_get_dest(struct _PageInfoReader *reader)
+{
+    PopplerDest dest, *result;
+    guint32 changes;
+
+    if (!_page_info_get_u32(reader) || reader->failed)
+        return NULL;
+
+    memset(&dest, 0, sizeof(PopplerDest));
+    dest.type = _page_info_get_u32(reader);
+    dest.page_num = (gint)_page_info_get_u32(reader);
+    dest.left = _page_info_get_double(reader);
+    dest.bottom = _page_info_get_double(reader);
+    dest.right = _page_info_get_double(reader);
+    dest.top = _page_info_get_double(reader);
+    dest.zoom = _page_info_get_double(reader);
+    dest.named_dest = _page_info_get_string(reader);
+    changes = _page_info_get_u32(reader);
+    dest.change_left = (changes & 1) ? 1 : 0;
+    dest.change_top = (changes & 2) ? 1 : 0;
+    dest.change_zoom = (changes & 4) ? 1 : 0;
+
+    result = reader->failed ? NULL : poppler_dest_copy(&dest);
+    g_free(dest.named_dest);
+    return result;
+}
+
+/* never NULL, unknown or malformed actions come back as POPPLER_ACTION_UNKNOWN */
+PopplerAction *_page_info_get_action(struct _PageInfoReader *reader)
+{
+    PopplerAction action, *result;
+    gchar *str1 = NULL, *str2 = NULL;
+    PopplerDest *dest = NULL;
+
+    memset(&action, 0, sizeof(PopplerAction));
+    action.type = _page_info_get_u32(reader);
+    action.any.title = _page_info_get_string(reader);
+
+    switch (action.type) {
+        case POPPLER_ACTION_NONE:
+            break;
+        case POPPLER_ACTION_GOTO_DEST:
+            action.goto_dest.dest = dest = _page_info_get_dest(reader);
+            break;
+        case POPPLER_ACTION_GOTO_REMOTE:
+            action.goto_remote.file_name = str1 = _page_info_get_string(reader);
+            action.goto_remote.dest = dest = _page_info_get_dest(reader);
+            break;
+        case POPPLER_ACTION_LAUNCH:
+            action.launch.file_name = str1 = _page_info_get_string(reader);
+            action.launch.params = str2 = _page_info_get_string(reader);
+            break;
+        case POPPLER_ACTION_URI:
+            action.uri.uri = str1 = _page_info_get_string(reader);
+            break;
+        case POPPLER_ACTION_NAMED:
+            action.named.named_dest = str1 = _page_info_get_string(reader);
+            break;
+        default:
+            action.type = POPPLER_ACTION_UNKNOWN;
+            break;
+    }
+    if (reader->failed)
+        action.type = POPPLER_ACTION_UNKNOWN;
+
+    result = poppler_action_copy(&action);
+
+    g_free(action.any.title);
+    g_free(str1);
+    g_free(str2);
+    if (dest)
+        poppler_dest_free(dest);
+
+    return result;
+}
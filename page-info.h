@@ -0,0 +1,39 @@
+#ifndef __PAGE_INFO_H__
+#define __PAGE_INFO_H__
+
+#include <glib.h>
+#include <poppler.h>
+
+/* what to read besides the size, which is always there */
+#define PAGE_INFO_METADATA       1
+#define PAGE_INFO_TEXT           2
+
+/* Everything about a page that does not need a full rendering. It is read
+ * either in process or by a render worker, which sends it serialized. */
+typedef struct _PageInfo {
+    guint flags;
+    double width;
+    double height;
+    /* PAGE_INFO_METADATA */
+    gchar *label;
+    GList *links;
+    PopplerPageTransition *transition;
+    /* PAGE_INFO_TEXT, one box per character of text */
+    gchar *text;
+    PopplerRectangle *rects;
+    guint n_rects;
+} PageInfo;
+
+int page_info_read(PopplerPage *page, guint flags, PageInfo *info);
+void page_info_clear(PageInfo *info);
+
+GBytes *page_info_serialize(PageInfo *info);
+/* returns 1 if the data is malformed */
+int page_info_deserialize(GBytes *bytes, PageInfo *info);
+
+/* name -> PopplerDest */
+GHashTable *page_info_read_named_dests(PopplerDocument *doc);
+GBytes *page_info_serialize_named_dests(GHashTable *named_dests);
+GHashTable *page_info_deserialize_named_dests(GBytes *bytes);
+
+#endif
@@ -0,0 +1,231 @@
+#include "power.h"
+#include <gio/gio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <memory.h>
+
+#define POWER_SUPPLY_PATH      "/sys/class/power_supply"
+#define POWER_REPORT_INTERVAL  60
+#define POWER_WAKEUP_INTERVAL  10
+
+struct _PowerReport {
+    guint source;
+    struct rusage last;
+} _power_report;
+
+struct _PowerWatch {
+    PowerChangedCallback callback;
+    gpointer userdata;
+    GPowerProfileMonitor *profile_monitor;
+    gulong profile_handler;
+    GDBusProxy *upower;
+    GCancellable *cancellable;
+} _power_watch;
+
+struct _PowerWakeups {
+    guint source;
+    GPollFunc poll;
+    guint count;
+    gint64 since;
+} _power_wakeups;
+
+gchar *_power_read_attribute(const gchar *supply, const gchar *attribute);
+gboolean _power_report_timeout(gpointer data);
+void _power_watch_changed(GObject *object, gpointer arg, gpointer data);
+void _power_watch_upower_ready(GObject *source, GAsyncResult *result, gpointer data);
+gint _power_wakeups_poll(GPollFD *fds, guint nfds, gint timeout);
+gboolean _power_wakeups_timeout(gpointer data);
+
+gchar *_power_read_attribute(const gchar *supply, const gchar *attribute)
+{
+    gchar *path = g_build_filename(POWER_SUPPLY_PATH, supply, attribute, NULL);
+    gchar *contents = NULL;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+        g_strstrip(contents);
+    g_free(path);
+
+    return contents;
+}
+
+/* on battery if no mains supply is online and a battery is discharging */
+gboolean power_on_battery(void)
+{
+    GDir *dir;
+    const gchar *name;
+    gchar *type, *value;
+    gboolean mains_online = FALSE, discharging = FALSE;
+
+    if ((dir = g_dir_open(POWER_SUPPLY_PATH, 0, NULL)) == NULL)
+        return FALSE;
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if ((type = _power_read_attribute(name, "type")) == NULL)
+            continue;
+        if (g_strcmp0(type, "Mains") == 0) {
+            value = _power_read_attribute(name, "online");
+            if (g_strcmp0(value, "1") == 0)
+                mains_online = TRUE;
+            g_free(value);
+        }
+        else if (g_strcmp0(type, "Battery") == 0) {
+            value = _power_read_attribute(name, "status");
+            if (g_strcmp0(value, "Discharging") == 0)
+                discharging = TRUE;
+            g_free(value);
+        }
+        g_free(type);
+    }
+    g_dir_close(dir);
+
+    return discharging && !mains_online;
+}
+
+PowerProfile power_resolve_profile(PowerProfile profile)
+{
+    if (profile != POWER_PROFILE_AUTO)
+        return profile;
+    if (_power_watch.profile_monitor &&
+            g_power_profile_monitor_get_power_saver_enabled(_power_watch.profile_monitor))
+        return POWER_PROFILE_SAVING;
+    return power_on_battery() ? POWER_PROFILE_SAVING : POWER_PROFILE_PERFORMANCE;
+}
+
+/* Calls back on the main loop when the system's power saver mode is switched
+ * or UPower reports a change, e.g. the charger being plugged in or out. Also
+ * has power_resolve_profile() take the power saver mode into account. */
+void power_watch_start(PowerChangedCallback callback, gpointer userdata)
+{
+    if (_power_watch.callback)
+        return;
+    _power_watch.callback = callback;
+    _power_watch.userdata = userdata;
+
+    if ((_power_watch.profile_monitor = g_power_profile_monitor_dup_default()) != NULL)
+        _power_watch.profile_handler = g_signal_connect(_power_watch.profile_monitor, "notify::power-saver-enabled",
+                                                        G_CALLBACK(_power_watch_changed), NULL);
+
+    /* not every system runs UPower, connecting must not hold up startup */
+    _power_watch.cancellable = g_cancellable_new();
+    g_dbus_proxy_new_for_bus(G_BUS_TYPE_SYSTEM, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START, NULL,
+                             "org.freedesktop.UPower", "/org/freedesktop/UPower", "org.freedesktop.UPower",
+                             _power_watch.cancellable, _power_watch_upower_ready, NULL);
+}
+
+void power_watch_stop(void)
+{
+    if (_power_watch.cancellable) {
+        g_cancellable_cancel(_power_watch.cancellable);
+        g_object_unref(_power_watch.cancellable);
+    }
+    if (_power_watch.upower)
+        g_object_unref(_power_watch.upower);
+    if (_power_watch.profile_monitor) {
+        g_signal_handler_disconnect(_power_watch.profile_monitor, _power_watch.profile_handler);
+        g_object_unref(_power_watch.profile_monitor);
+    }
+    memset(&_power_watch, 0, sizeof(struct _PowerWatch));
+}
+
+void _power_watch_upower_ready(GObject *source, GAsyncResult *result, gpointer data)
+{
+    GError *error = NULL;
+    GDBusProxy *proxy = g_dbus_proxy_new_for_bus_finish(result, &error);
+
+    if (proxy == NULL) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            fprintf(stderr, "Not watching the power supply: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    _power_watch.upower = proxy;
+    g_signal_connect(proxy, "g-properties-changed", G_CALLBACK(_power_watch_changed), NULL);
+}
+
+/* the supply is read again from sysfs, the signal only says when */
+void _power_watch_changed(GObject *object, gpointer arg, gpointer data)
+{
+    if (_power_watch.callback)
+        _power_watch.callback(_power_watch.userdata);
+}
+
+/* voluntary context switches of all threads, i.e. how often they blocked */
+gboolean _power_report_timeout(gpointer data)
+{
+    struct rusage now;
+    double cpu;
+
+    if (getrusage(RUSAGE_SELF, &now) != 0)
+        return TRUE;
+
+    cpu = (now.ru_utime.tv_sec - _power_report.last.ru_utime.tv_sec) +
+          (now.ru_stime.tv_sec - _power_report.last.ru_stime.tv_sec) +
+          ((now.ru_utime.tv_usec - _power_report.last.ru_utime.tv_usec) +
+           (now.ru_stime.tv_usec - _power_report.last.ru_stime.tv_usec)) / 1e6;
+
+    fprintf(stderr, "Power: %ld context switches, %.2f s CPU in the last minute\n",
+            now.ru_nvcsw - _power_report.last.ru_nvcsw, cpu);
+
+    _power_report.last = now;
+
+    return TRUE;
+}
+
+void power_report_start(void)
+{
+    if (_power_report.source)
+        return;
+    memset(&_power_report.last, 0, sizeof(struct rusage));
+    getrusage(RUSAGE_SELF, &_power_report.last);
+    _power_report.source = g_timeout_add_seconds(POWER_REPORT_INTERVAL, _power_report_timeout, NULL);
+}
+
+void power_report_stop(void)
+{
+    if (_power_report.source) {
+        g_source_remove(_power_report.source);
+        _power_report.source = 0;
+    }
+}
+
+/* every return from poll is one iteration of the main loop */
+gint _power_wakeups_poll(GPollFD *fds, guint nfds, gint timeout)
+{
+    gint result = _power_wakeups.poll(fds, nfds, timeout);
+    g_atomic_int_inc((gint *)&_power_wakeups.count);
+    return result;
+}
+
+gboolean _power_wakeups_timeout(gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+    guint count = g_atomic_int_and(&_power_wakeups.count, 0);
+
+    /* leave out the wakeup of this report */
+    fprintf(stderr, "Main loop: %.2f wakeups/s\n",
+            (count > 0 ? count - 1 : 0) * (double)G_USEC_PER_SEC / (now - _power_wakeups.since));
+    _power_wakeups.since = now;
+
+    return TRUE;
+}
+
+void power_wakeups_start(void)
+{
+    if (_power_wakeups.source)
+        return;
+    _power_wakeups.poll = g_main_context_get_poll_func(NULL);
+    g_main_context_set_poll_func(NULL, _power_wakeups_poll);
+    g_atomic_int_set((gint *)&_power_wakeups.count, 0);
+    _power_wakeups.since = g_get_monotonic_time();
+    _power_wakeups.source = g_timeout_add_seconds(POWER_WAKEUP_INTERVAL, _power_wakeups_timeout, NULL);
+}
+
+void power_wakeups_stop(void)
+{
+    if (_power_wakeups.source) {
+        g_source_remove(_power_wakeups.source);
+        g_main_context_set_poll_func(NULL, _power_wakeups.poll);
+        _power_wakeups.source = 0;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include <glib.h>
+
+typedef enum {
+    POWER_PROFILE_AUTO = 0,
+    POWER_PROFILE_PERFORMANCE,
+    POWER_PROFILE_SAVING
+} PowerProfile;
+
+/* resolves POWER_PROFILE_AUTO by looking at the power supply */
+PowerProfile power_resolve_profile(PowerProfile profile);
+gboolean power_on_battery(void);
+
+/* called when the result of power_resolve_profile() may have changed */
+typedef void (*PowerChangedCallback)(gpointer);
+void power_watch_start(PowerChangedCallback callback, gpointer userdata);
+void power_watch_stop(void);
+
+/* print voluntary context switches and CPU time of the process once a minute */
+void power_report_start(void);
+void power_report_stop(void);
+
+/* count main loop wakeups and print them per second every few seconds */
+void power_wakeups_start(void);
+void power_wakeups_stop(void);
+
+#endif
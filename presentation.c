@@ -7,17 +7,22 @@
 
 struct _Presentation {
     unsigned int current_index;
+    /* page that is referenced and has its links loaded; navigation only moves
+     * current_index, so pages skipped before presentation_settle() are never loaded */
+    unsigned int loaded_index;
     unsigned int page_count;
     void (*action_cb)(unsigned int, void *);
     void *action_cb_data;
 } _presentation;
 
 void _presentation_call_action_cb(int action);
+void _presentation_set_index(unsigned int index);
 
 void presentation_init(void (*cb)(unsigned int, void *), void *userdata)
 {
     _presentation.page_count = page_cache_get_page_count();
     _presentation.current_index = 0;
+    _presentation.loaded_index = 0;
     _presentation.action_cb = cb;
     _presentation.action_cb_data = userdata;
     page_cache_load_page(_presentation.current_index);
@@ -29,10 +34,32 @@ void presentation_update(void)
     if (_presentation.current_index >= _presentation.page_count)
         _presentation.current_index = _presentation.page_count - 1;
 
+    _presentation.loaded_index = _presentation.current_index;
     page_cache_load_page(_presentation.current_index);
     _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
 }
 
+/* load the page navigation ended up at */
+void presentation_settle(void)
+{
+    if (_presentation.loaded_index == _presentation.current_index)
+        return;
+    page_cache_page_unref(_presentation.loaded_index);
+    _presentation.loaded_index = _presentation.current_index;
+    page_cache_load_page(_presentation.loaded_index);
+}
+
+gboolean presentation_is_settled(void)
+{
+    return _presentation.loaded_index == _presentation.current_index;
+}
+
+void _presentation_set_index(unsigned int index)
+{
+    _presentation.current_index = index;
+    _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
+}
+
 unsigned int presentation_get_current_page(void)
 {
     return _presentation.current_index;
@@ -40,51 +67,49 @@ unsigned int presentation_get_current_page(void)
 
 void presentation_page_next(void)
 {
-    if (_presentation.current_index < _presentation.page_count-1) {
-        page_cache_page_unref(_presentation.current_index);
-        page_cache_load_page(++_presentation.current_index);
-        _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
-    }
+    if (_presentation.current_index < _presentation.page_count-1)
+        _presentation_set_index(_presentation.current_index + 1);
 }
 
 void presentation_page_prev(void)
 {
-    if (_presentation.current_index > 0) {
-        page_cache_page_unref(_presentation.current_index);
-        page_cache_load_page(--_presentation.current_index);
-        _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
-    }
+    if (_presentation.current_index > 0)
+        _presentation_set_index(_presentation.current_index - 1);
 }
 
 void presentation_page_first(void)
 {
-    if (_presentation.current_index != 0) {
-        page_cache_page_unref(_presentation.current_index);
-        _presentation.current_index = 0;
-        page_cache_load_page(_presentation.current_index);
-        _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
-    }
+    if (_presentation.current_index != 0)
+        _presentation_set_index(0);
 }
 
 void presentation_page_last(void)
 {
-    if (_presentation.current_index != _presentation.page_count-1) {
-        page_cache_page_unref(_presentation.current_index);
-        _presentation.current_index = _presentation.page_count-1;
-        page_cache_load_page(_presentation.current_index);
-        _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
-    }
+    if (_presentation.current_index != _presentation.page_count-1)
+        _presentation_set_index(_presentation.page_count-1);
 }
 
 void presentation_page_goto(unsigned int index)
 {
     if (_presentation.current_index != index &&
-            index <= _presentation.page_count -1) {
-        page_cache_page_unref(_presentation.current_index);
-        _presentation.current_index = index;
-        page_cache_load_page(_presentation.current_index);
-        _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
-    }
+            index <= _presentation.page_count -1)
+        _presentation_set_index(index);
+}
+
+/* Present the document of another cache instance, at the page it was left at. */
+void presentation_switch_document(PageCacheInstance *cache)
+{
+    page_cache_page_unref(_presentation.loaded_index);
+    page_cache_set_presented(cache);
+
+    _presentation.page_count = page_cache_get_page_count();
+    _presentation.current_index = page_cache_get_current_index();
+    if (_presentation.current_index >= _presentation.page_count)
+        _presentation.current_index = 0;
+    _presentation.loaded_index = _presentation.current_index;
+
+    page_cache_load_page(_presentation.current_index);
+    _presentation_call_action_cb(PRESENTATION_ACTION_PAGE_CHANGED);
 }
 
 void _presentation_call_action_cb(int action)
@@ -130,11 +155,11 @@ void _perform_action_goto_dest(PopplerActionGotoDest *action)
     PopplerDest *dest = NULL;
     int goto_index = 0;
     if (action->dest->type == POPPLER_DEST_NAMED) {
-        dest = page_cache_get_named_dest(action->dest->named_dest);
-        if (dest) {
-            goto_index = dest->page_num-1;
-            poppler_dest_free(dest);
-        }
+        /* unknown, or not indexed yet */
+        if ((dest = page_cache_get_named_dest(action->dest->named_dest)) == NULL)
+            return;
+        goto_index = dest->page_num-1;
+        poppler_dest_free(dest);
     }
     else {
         goto_index = action->dest->page_num-1;
@@ -190,6 +215,9 @@ void presentation_get_status(PresentationStatus *status)
         page_cache_get_status(&pcstate);
         status->cached_pages = pcstate.pages_cached;
         status->cached_size = pcstate.cached_size;
+        status->decompressed_pages = pcstate.pages_decompressed;
+        status->decompressed_size = pcstate.decompressed_size;
+        status->background_cpu = pcstate.background_cpu;
     }
 }
 
@@ -3,6 +3,7 @@
 
 #include <glib.h>
 #include <cairo.h>
+#include "page-cache.h"
 
 #define PRESENTATION_ACTION_PAGE_CHANGED                 1
 #define PRESENTATION_ACTION_FIND                         2
@@ -20,18 +21,25 @@ typedef struct _PresentationStatus {
     unsigned int num_pages;
     unsigned int cached_pages;
     gsize cached_size;
+    unsigned int decompressed_pages;
+    gsize decompressed_size;
+    double background_cpu;
 } PresentationStatus;
 
 void presentation_init(
     void (*cb)(unsigned int, void *),
     void *userdata);
 void presentation_update(void);
+/* navigation is lazy, this references the current page and loads its links */
+void presentation_settle(void);
+gboolean presentation_is_settled(void);
 unsigned int presentation_get_current_page(void);
 void presentation_page_next(void);
 void presentation_page_prev(void);
 void presentation_page_first(void);
 void presentation_page_last(void);
 void presentation_page_goto(unsigned int index);
+void presentation_switch_document(PageCacheInstance *cache);
 int presentation_has_action_at(double x, double y);
 int presentation_perform_action_at(double x, double y);
 void presentation_get_status(PresentationStatus *status);
@@ -0,0 +1,253 @@
+#include "pressure.h"
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define PRESSURE_CGROUP_ROOT          "/sys/fs/cgroup"
+#define PRESSURE_SYSTEM_PSI           "/proc/pressure/memory"
+
+/* PSI triggers: stall time in a window, both in microseconds; without
+ * privileges the window has to be a multiple of two seconds */
+#define PRESSURE_PSI_SOME_TRIGGER     "some 300000 2000000"
+#define PRESSURE_PSI_FULL_TRIGGER     "full 200000 2000000"
+
+/* how often usage is compared to memory.high, if that is set */
+#define PRESSURE_HIGH_CHECK_SECONDS   5
+/* usage above this share of memory.high counts as medium pressure */
+#define PRESSURE_HIGH_MEDIUM_PERCENT  90
+
+/* the level goes down one step after this long without a new warning */
+#define PRESSURE_RECOVERY_SECONDS     30
+
+struct _PressureMonitor {
+    PressureCallback callback;
+    gpointer userdata;
+    PressureLevel level;
+    GMemoryMonitor *memory_monitor;
+    gulong warning_handler;
+    int psi_fds[2];
+    guint psi_sources[2];
+    gchar *cgroup_path;
+    guint64 memory_high;
+    guint high_source;
+    guint recovery_source;
+} _pressure;
+
+void _pressure_raise(PressureLevel level);
+gboolean _pressure_recovery_timeout(gpointer data);
+void _pressure_low_memory_warning(GMemoryMonitor *monitor, GMemoryMonitorWarningLevel level, gpointer data);
+gchar *_pressure_find_cgroup(void);
+int _pressure_psi_open(const gchar *path, const gchar *trigger);
+gboolean _pressure_psi_event(gint fd, GIOCondition condition, gpointer data);
+gboolean _pressure_read_u64(const gchar *path, guint64 *value);
+gboolean _pressure_check_high(gpointer data);
+
+int pressure_monitor_init(PressureCallback callback, gpointer userdata)
+{
+    gchar *path;
+    guint64 value;
+
+    memset(&_pressure, 0, sizeof(struct _PressureMonitor));
+    _pressure.callback = callback;
+    _pressure.userdata = userdata;
+    _pressure.psi_fds[0] = _pressure.psi_fds[1] = -1;
+
+    if ((_pressure.memory_monitor = g_memory_monitor_dup_default()) != NULL)
+        _pressure.warning_handler = g_signal_connect(_pressure.memory_monitor, "low-memory-warning",
+                                                     G_CALLBACK(_pressure_low_memory_warning), NULL);
+
+    /* PSI of our own cgroup, or of the whole system if that is not possible */
+    _pressure.cgroup_path = _pressure_find_cgroup();
+    if (_pressure.cgroup_path) {
+        path = g_build_filename(_pressure.cgroup_path, "memory.pressure", NULL);
+        _pressure.psi_fds[0] = _pressure_psi_open(path, PRESSURE_PSI_SOME_TRIGGER);
+        _pressure.psi_fds[1] = _pressure_psi_open(path, PRESSURE_PSI_FULL_TRIGGER);
+        g_free(path);
+    }
+    if (_pressure.psi_fds[0] < 0)
+        _pressure.psi_fds[0] = _pressure_psi_open(PRESSURE_SYSTEM_PSI, PRESSURE_PSI_SOME_TRIGGER);
+    if (_pressure.psi_fds[1] < 0)
+        _pressure.psi_fds[1] = _pressure_psi_open(PRESSURE_SYSTEM_PSI, PRESSURE_PSI_FULL_TRIGGER);
+
+    if (_pressure.psi_fds[0] >= 0)
+        _pressure.psi_sources[0] = g_unix_fd_add(_pressure.psi_fds[0], G_IO_PRI,
+                                                 _pressure_psi_event, GINT_TO_POINTER(PRESSURE_MEDIUM));
+    if (_pressure.psi_fds[1] >= 0)
+        _pressure.psi_sources[1] = g_unix_fd_add(_pressure.psi_fds[1], G_IO_PRI,
+                                                 _pressure_psi_event, GINT_TO_POINTER(PRESSURE_CRITICAL));
+
+    /* memory.high is "max" if not set, which does not parse as a number */
+    if (_pressure.cgroup_path) {
+        path = g_build_filename(_pressure.cgroup_path, "memory.high", NULL);
+        if (_pressure_read_u64(path, &value)) {
+            _pressure.memory_high = value;
+            _pressure.high_source = g_timeout_add_seconds(PRESSURE_HIGH_CHECK_SECONDS, _pressure_check_high, NULL);
+        }
+        g_free(path);
+    }
+
+    return 0;
+}
+
+void pressure_monitor_cleanup(void)
+{
+    unsigned int i;
+
+    if (_pressure.memory_monitor) {
+        g_signal_handler_disconnect(_pressure.memory_monitor, _pressure.warning_handler);
+        g_object_unref(_pressure.memory_monitor);
+        _pressure.memory_monitor = NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        if (_pressure.psi_sources[i])
+            g_source_remove(_pressure.psi_sources[i]);
+        _pressure.psi_sources[i] = 0;
+        if (_pressure.psi_fds[i] >= 0)
+            close(_pressure.psi_fds[i]);
+        _pressure.psi_fds[i] = -1;
+    }
+    if (_pressure.high_source)
+        g_source_remove(_pressure.high_source);
+    _pressure.high_source = 0;
+    if (_pressure.recovery_source)
+        g_source_remove(_pressure.recovery_source);
+    _pressure.recovery_source = 0;
+    g_free(_pressure.cgroup_path);
+    _pressure.cgroup_path = NULL;
+}
+
+PressureLevel pressure_monitor_get_level(void)
+{
+    return _pressure.level;
+}
+
+/* Keep the highest level reported until things have been quiet for a while,
+ * so the cache is not rebuilt between two warnings, then step down one level
+ * at a time. */
+void _pressure_raise(PressureLevel level)
+{
+    if (level == PRESSURE_NONE)
+        return;
+
+    if (_pressure.recovery_source)
+        g_source_remove(_pressure.recovery_source);
+    _pressure.recovery_source = g_timeout_add_seconds(PRESSURE_RECOVERY_SECONDS, _pressure_recovery_timeout, NULL);
+
+    if (level <= _pressure.level)
+        return;
+    _pressure.level = level;
+    if (_pressure.callback)
+        _pressure.callback(level, _pressure.userdata);
+}
+
+gboolean _pressure_recovery_timeout(gpointer data)
+{
+    if (_pressure.level > PRESSURE_NONE)
+        _pressure.level--;
+    if (_pressure.callback)
+        _pressure.callback(_pressure.level, _pressure.userdata);
+    if (_pressure.level > PRESSURE_NONE)
+        return TRUE;
+    _pressure.recovery_source = 0;
+    return FALSE;
+}
+
+void _pressure_low_memory_warning(GMemoryMonitor *monitor, GMemoryMonitorWarningLevel level, gpointer data)
+{
+    if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+        _pressure_raise(PRESSURE_CRITICAL);
+    else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+        _pressure_raise(PRESSURE_MEDIUM);
+    else
+        _pressure_raise(PRESSURE_LOW);
+}
+
+/* directory of the cgroup v2 the process is in, from the "0::" line */
+gchar *_pressure_find_cgroup(void)
+{
+    gchar *contents = NULL;
+    gchar **lines;
+    gchar *path = NULL;
+    unsigned int i;
+
+    if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] && !path; i++) {
+        if (g_str_has_prefix(lines[i], "0::"))
+            path = g_build_filename(PRESSURE_CGROUP_ROOT, lines[i] + 3, NULL);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return path;
+}
+
+/* a PSI trigger signals POLLPRI whenever the threshold is crossed */
+int _pressure_psi_open(const gchar *path, const gchar *trigger)
+{
+    int fd;
+
+    /* no PSI in this kernel or cgroup is not worth a message */
+    if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Cannot open %s for a memory pressure trigger: %s\n", path, g_strerror(errno));
+        return -1;
+    }
+    if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+        fprintf(stderr, "Cannot register memory pressure trigger \"%s\" on %s: %s\n",
+                trigger, path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+gboolean _pressure_psi_event(gint fd, GIOCondition condition, gpointer data)
+{
+    if (condition & G_IO_ERR) {
+        fprintf(stderr, "Memory pressure trigger failed\n");
+        return FALSE;
+    }
+    _pressure_raise((PressureLevel)GPOINTER_TO_INT(data));
+    return TRUE;
+}
+
+gboolean _pressure_read_u64(const gchar *path, guint64 *value)
+{
+    gchar *contents = NULL;
+    gchar *end = NULL;
+    gboolean ret = FALSE;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return FALSE;
+    g_strstrip(contents);
+    *value = g_ascii_strtoull(contents, &end, 10);
+    ret = end != contents && *end == '\0';
+    g_free(contents);
+
+    return ret;
+}
+
+gboolean _pressure_check_high(gpointer data)
+{
+    gchar *path;
+    guint64 current;
+
+    path = g_build_filename(_pressure.cgroup_path, "memory.current", NULL);
+    if (_pressure_read_u64(path, &current)) {
+        if (current >= _pressure.memory_high)
+            _pressure_raise(PRESSURE_CRITICAL);
+        else if (current >= _pressure.memory_high / 100 * PRESSURE_HIGH_MEDIUM_PERCENT)
+            _pressure_raise(PRESSURE_MEDIUM);
+    }
+    g_free(path);
+
+    return TRUE;
+}
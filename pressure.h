@@ -0,0 +1,21 @@
+#ifndef __PRESSURE_H__
+#define __PRESSURE_H__
+
+#include <glib.h>
+
+/* each level sheds one more tier of cached data */
+typedef enum {
+    PRESSURE_NONE = 0,
+    PRESSURE_LOW,
+    PRESSURE_MEDIUM,
+    PRESSURE_CRITICAL
+} PressureLevel;
+
+/* called in the main loop whenever the level changes */
+typedef void (*PressureCallback)(PressureLevel level, gpointer userdata);
+
+int pressure_monitor_init(PressureCallback callback, gpointer userdata);
+void pressure_monitor_cleanup(void);
+PressureLevel pressure_monitor_get_level(void);
+
+#endif
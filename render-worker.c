@@ -0,0 +1,876 @@
+#define _GNU_SOURCE
+#include "render-worker.h"
+#include "page-info.h"
+#include <gio/gio.h>
+#include <poppler.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <memory.h>
+#include <stdio.h>
+
+/* a job taking longer than this is abandoned and the worker restarted */
+#define RENDER_WORKER_TIMEOUT_MS         5000
+
+/* a page the worker failed on is tried again at this fraction of the size */
+#define RENDER_WORKER_FALLBACK_DIVISOR   4
+
+/* the playlist keeps the documents next to the presented one loaded */
+#define RENDER_WORKER_INSTANCES          3
+
+/* number of documents kept in shared memory and loaded by every worker,
+ * each instance may have a reload next to its document */
+#define RENDER_WORKER_DOCUMENTS          (2 * RENDER_WORKER_INSTANCES)
+
+enum {
+    RENDER_WORKER_LOAD = 1,
+    RENDER_WORKER_RENDER,
+    RENDER_WORKER_INFO
+};
+
+/* Sent with a memfd: the document for LOAD, the pixel buffer for RENDER.
+ * LOAD puts the document into slot index of the worker, the others name
+ * it by serial. INFO with index -1 asks for the named destinations. */
+struct _RenderWorkerRequest {
+    guint32 type;
+    guint32 serial;
+    gint32 index;
+    guint32 flags;
+    guint32 width;
+    guint32 height;
+    guint32 stride;
+    guint64 size;
+    double scale;
+};
+
+/* INFO is answered with a memfd of size bytes */
+struct _RenderWorkerReply {
+    guint32 type;
+    gint32 status;
+    /* number of pages for LOAD */
+    gint32 pages;
+    guint64 size;
+};
+
+struct _RenderWorkerMapping {
+    void *data;
+    gsize size;
+};
+
+struct _RenderWorker {
+    GSubprocess *process;
+    int fd;
+    /* queue the worker goes back to when it is done */
+    GAsyncQueue *lane;
+    /* documents the worker has loaded, 0 for an empty slot */
+    guint serials[RENDER_WORKER_DOCUMENTS];
+    gint pages[RENDER_WORKER_DOCUMENTS];
+    unsigned int next_slot;
+};
+
+/* worker side */
+struct _RenderWorkerLoaded {
+    guint serial;
+    PopplerDocument *doc;
+};
+
+struct _RenderWorkerDocument {
+    guint serial;
+    int fd;
+    gsize size;
+    guint last_used;
+};
+
+struct _RenderWorkerPool {
+    struct _RenderWorker *workers;
+    unsigned int count;
+    GAsyncQueue *idle;
+    /* the first worker only serves the thread the pool was started on, so
+     * drawing never waits behind prefetching and caching */
+    GAsyncQueue *foreground;
+    GThread *ui_thread;
+    GMutex document_lock;
+    struct _RenderWorkerDocument documents[RENDER_WORKER_DOCUMENTS];
+    guint document_uses;
+} _render_worker;
+
+static cairo_user_data_key_t _render_worker_mapping_key;
+
+int _render_worker_spawn(struct _RenderWorker *worker);
+struct _RenderWorker *_render_worker_acquire(void);
+void _render_worker_release(struct _RenderWorker *worker);
+gboolean _render_worker_document_live(guint serial);
+void _render_worker_stop(struct _RenderWorker *worker);
+int _render_worker_send(int fd, gpointer msg, gsize len, int payload);
+int _render_worker_receive(int fd, gpointer msg, gsize len, int *payload, int timeout);
+int _render_worker_memfd(const gchar *name, const guchar *data, gsize length);
+int _render_worker_document_fd(guint serial, GBytes *document, gsize *size);
+int _render_worker_load(struct _RenderWorker *worker, guint serial, GBytes *document, gint *pages);
+int _render_worker_job(struct _RenderWorker *worker, guint serial, GBytes *document, int index,
+                       double scale, unsigned int width, unsigned int height, cairo_surface_t **surf);
+int _render_worker_info_job(struct _RenderWorker *worker, guint serial, GBytes *document, int index,
+                            guint flags, GBytes **result);
+GBytes *_render_worker_query(guint serial, GBytes *document, int index, guint flags);
+struct _RenderWorkerMapping *_render_worker_map(int fd, gsize size, int prot);
+void _render_worker_unmap(struct _RenderWorkerMapping *mapping);
+cairo_surface_t *_render_worker_scale_surface(cairo_surface_t *surf, unsigned int width, unsigned int height);
+int _render_worker_render_page(PopplerDocument *doc, struct _RenderWorkerRequest *req, int fd);
+int _render_worker_page_info(PopplerDocument *doc, struct _RenderWorkerRequest *req,
+                             struct _RenderWorkerReply *reply, int *payload);
+PopplerDocument *_render_worker_find_document(struct _RenderWorkerLoaded *loaded, guint serial);
+
+int render_worker_init(unsigned int count)
+{
+    unsigned int i;
+    memset(&_render_worker, 0, sizeof(struct _RenderWorkerPool));
+
+    if (count == 0)
+        return 0;
+
+    g_mutex_init(&_render_worker.document_lock);
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++)
+        _render_worker.documents[i].fd = -1;
+
+    _render_worker.idle = g_async_queue_new();
+    _render_worker.foreground = g_async_queue_new();
+    _render_worker.ui_thread = g_thread_self();
+    _render_worker.workers = g_malloc0(sizeof(struct _RenderWorker) * (count + 1));
+    _render_worker.count = count + 1;
+    for (i = 0; i < _render_worker.count; i++) {
+        _render_worker.workers[i].lane = (i == 0 ? _render_worker.foreground : _render_worker.idle);
+        if (_render_worker_spawn(&_render_worker.workers[i]) != 0) {
+            render_worker_cleanup();
+            return 1;
+        }
+        g_async_queue_push(_render_worker.workers[i].lane, &_render_worker.workers[i]);
+    }
+
+    return 0;
+}
+
+void render_worker_cleanup(void)
+{
+    unsigned int i;
+    if (_render_worker.count == 0)
+        return;
+
+    for (i = 0; i < _render_worker.count; i++)
+        _render_worker_stop(&_render_worker.workers[i]);
+    g_free(_render_worker.workers);
+    _render_worker.workers = NULL;
+    _render_worker.count = 0;
+
+    g_async_queue_unref(_render_worker.idle);
+    _render_worker.idle = NULL;
+    g_async_queue_unref(_render_worker.foreground);
+    _render_worker.foreground = NULL;
+
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++) {
+        if (_render_worker.documents[i].fd >= 0)
+            close(_render_worker.documents[i].fd);
+        _render_worker.documents[i].fd = -1;
+    }
+    g_mutex_clear(&_render_worker.document_lock);
+}
+
+gboolean render_worker_enabled(void)
+{
+    return _render_worker.count > 0;
+}
+
+struct _RenderWorker *_render_worker_acquire(void)
+{
+    if (g_thread_self() == _render_worker.ui_thread)
+        return g_async_queue_pop(_render_worker.foreground);
+    return g_async_queue_pop(_render_worker.idle);
+}
+
+void _render_worker_release(struct _RenderWorker *worker)
+{
+    g_async_queue_push(worker->lane, worker);
+}
+
+/* Render the page in one of the workers into shared memory, which becomes
+ * the pixel buffer of the returned surface. A worker that hangs or crashes
+ * is replaced, so a broken page never stops the presentation. A page that
+ * timed out is left blank, one the worker failed on is rendered at a lower
+ * resolution. */
+int render_worker_render(guint serial, GBytes *document, int index, double scale,
+                         unsigned int width, unsigned int height, cairo_surface_t **surf)
+{
+    struct _RenderWorker *worker;
+    cairo_surface_t *lowres = NULL;
+    int ret;
+
+    if (!render_worker_enabled() || !surf)
+        return 1;
+
+    worker = _render_worker_acquire();
+
+    ret = _render_worker_job(worker, serial, document, index, scale, width, height, surf);
+    if (ret != 0) {
+        fprintf(stderr, "render worker %s on page %d, restarting\n",
+                ret == 2 ? "timed out" : "failed", index);
+        _render_worker_stop(worker);
+        _render_worker_spawn(worker);
+
+        /* trying again would only wait as long once more */
+        if (ret != 2 &&
+                _render_worker_job(worker, serial, document, index,
+                                   scale / RENDER_WORKER_FALLBACK_DIVISOR,
+                                   MAX(width / RENDER_WORKER_FALLBACK_DIVISOR, 1),
+                                   MAX(height / RENDER_WORKER_FALLBACK_DIVISOR, 1),
+                                   &lowres) != 0) {
+            _render_worker_stop(worker);
+            _render_worker_spawn(worker);
+        }
+        *surf = _render_worker_scale_surface(lowres, width, height);
+        if (lowres)
+            cairo_surface_destroy(lowres);
+        ret = *surf ? 0 : 1;
+    }
+
+    _render_worker_release(worker);
+
+    return ret;
+}
+
+/* returns 0 on success, 1 if the worker is broken and 2 on timeout */
+int _render_worker_job(struct _RenderWorker *worker, guint serial, GBytes *document, int index,
+                       double scale, unsigned int width, unsigned int height, cairo_surface_t **surf)
+{
+    struct _RenderWorkerRequest req;
+    struct _RenderWorkerReply reply;
+    struct _RenderWorkerMapping *mapping;
+    int fd, ret;
+
+    if ((ret = _render_worker_load(worker, serial, document, NULL)) != 0)
+        return ret == 3 ? 1 : ret;
+
+    memset(&req, 0, sizeof(struct _RenderWorkerRequest));
+    req.type = RENDER_WORKER_RENDER;
+    req.serial = serial;
+    req.index = index;
+    req.width = width;
+    req.height = height;
+    req.stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    req.size = (guint64)req.stride * height;
+    req.scale = scale;
+
+    if ((fd = memfd_create("pdfpresent-page", MFD_CLOEXEC)) < 0)
+        return 1;
+    if (ftruncate(fd, req.size) != 0 ||
+            (mapping = _render_worker_map(fd, req.size, PROT_READ | PROT_WRITE)) == NULL) {
+        close(fd);
+        return 1;
+    }
+    ret = _render_worker_send(worker->fd, &req, sizeof(req), fd);
+    close(fd);
+    if (ret == 0)
+        ret = _render_worker_receive(worker->fd, &reply, sizeof(reply), NULL, RENDER_WORKER_TIMEOUT_MS);
+    if (ret == 0 && reply.status != 0)
+        ret = 1;
+    if (ret != 0) {
+        _render_worker_unmap(mapping);
+        return ret;
+    }
+
+    /* the mapping is released with the surface */
+    *surf = cairo_image_surface_create_for_data(mapping->data, CAIRO_FORMAT_ARGB32,
+                                                width, height, req.stride);
+    if (cairo_surface_set_user_data(*surf, &_render_worker_mapping_key, mapping,
+                                    (cairo_destroy_func_t)_render_worker_unmap) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(*surf);
+        *surf = NULL;
+        _render_worker_unmap(mapping);
+        return 1;
+    }
+    cairo_surface_mark_dirty(*surf);
+
+    return 0;
+}
+
+/* Make sure the worker has the document loaded, replacing one that was
+ * forgotten or else the one loaded longest ago. Returns 0 on success, 1 if the worker is broken, 2 on timeout
+ * and 3 if the document cannot be loaded. */
+int _render_worker_load(struct _RenderWorker *worker, guint serial, GBytes *document, gint *pages)
+{
+    struct _RenderWorkerRequest req;
+    struct _RenderWorkerReply reply;
+    unsigned int slot;
+    gsize size;
+    int fd, ret;
+
+    if (worker->process == NULL)
+        return 1;
+
+    for (slot = 0; slot < RENDER_WORKER_DOCUMENTS; slot++) {
+        if (worker->serials[slot] == serial) {
+            if (pages)
+                *pages = worker->pages[slot];
+            return 0;
+        }
+    }
+
+    for (slot = 0; slot < RENDER_WORKER_DOCUMENTS; slot++) {
+        if (!worker->serials[slot] || !_render_worker_document_live(worker->serials[slot]))
+            break;
+    }
+    if (slot == RENDER_WORKER_DOCUMENTS)
+        slot = worker->next_slot;
+    worker->serials[slot] = 0;
+    if ((fd = _render_worker_document_fd(serial, document, &size)) < 0)
+        return 1;
+
+    memset(&req, 0, sizeof(struct _RenderWorkerRequest));
+    req.type = RENDER_WORKER_LOAD;
+    req.serial = serial;
+    req.index = slot;
+    req.size = size;
+    ret = _render_worker_send(worker->fd, &req, sizeof(req), fd);
+    close(fd);
+    if (ret != 0)
+        return 1;
+    if ((ret = _render_worker_receive(worker->fd, &reply, sizeof(reply), NULL, RENDER_WORKER_TIMEOUT_MS)) != 0)
+        return ret;
+    if (reply.status != 0)
+        return 3;
+
+    worker->serials[slot] = serial;
+    worker->pages[slot] = reply.pages;
+    worker->next_slot = (slot + 1) % RENDER_WORKER_DOCUMENTS;
+    if (pages)
+        *pages = reply.pages;
+
+    return 0;
+}
+
+/* PageInfo of a page or the named destinations, serialized by the worker;
+ * returns 0 on success, 1 if the worker is broken, 2 on timeout and 3 if
+ * the worker could not read the page */
+int _render_worker_info_job(struct _RenderWorker *worker, guint serial, GBytes *document, int index,
+                            guint flags, GBytes **result)
+{
+    struct _RenderWorkerRequest req;
+    struct _RenderWorkerReply reply;
+    struct _RenderWorkerMapping *mapping;
+    int fd, ret;
+
+    if ((ret = _render_worker_load(worker, serial, document, NULL)) != 0)
+        return ret;
+
+    memset(&req, 0, sizeof(struct _RenderWorkerRequest));
+    req.type = RENDER_WORKER_INFO;
+    req.serial = serial;
+    req.index = index;
+    req.flags = flags;
+
+    if (_render_worker_send(worker->fd, &req, sizeof(req), -1) != 0)
+        return 1;
+    if ((ret = _render_worker_receive(worker->fd, &reply, sizeof(reply), &fd, RENDER_WORKER_TIMEOUT_MS)) != 0)
+        return ret;
+    if (reply.status != 0 || fd < 0 || reply.size == 0) {
+        if (fd >= 0)
+            close(fd);
+        return reply.status != 0 ? 3 : 1;
+    }
+
+    mapping = _render_worker_map(fd, reply.size, PROT_READ);
+    close(fd);
+    if (mapping == NULL)
+        return 1;
+    *result = g_bytes_new(mapping->data, mapping->size);
+    _render_worker_unmap(mapping);
+
+    return 0;
+}
+
+/* A worker that fails is replaced, but the query is not tried again. */
+GBytes *_render_worker_query(guint serial, GBytes *document, int index, guint flags)
+{
+    struct _RenderWorker *worker;
+    GBytes *result = NULL;
+    int ret;
+
+    if (!render_worker_enabled())
+        return NULL;
+
+    worker = _render_worker_acquire();
+    ret = _render_worker_info_job(worker, serial, document, index, flags, &result);
+    if (ret == 1 || ret == 2) {
+        fprintf(stderr, "render worker %s reading page %d, restarting\n",
+                ret == 2 ? "timed out" : "failed", index);
+        _render_worker_stop(worker);
+        _render_worker_spawn(worker);
+    }
+    _render_worker_release(worker);
+
+    return result;
+}
+
+/* what page_info_read() returns, read by a worker */
+int render_worker_page_info(guint serial, GBytes *document, int index, guint flags, PageInfo *info)
+{
+    GBytes *bytes;
+    int ret;
+
+    if (index < 0 || !info)
+        return 1;
+    bytes = _render_worker_query(serial, document, index, flags);
+    ret = page_info_deserialize(bytes, info);
+    if (bytes)
+        g_bytes_unref(bytes);
+    return ret;
+}
+
+GHashTable *render_worker_named_dests(guint serial, GBytes *document)
+{
+    GBytes *bytes;
+    GHashTable *named_dests;
+
+    bytes = _render_worker_query(serial, document, -1, 0);
+    named_dests = page_info_deserialize_named_dests(bytes);
+    if (bytes)
+        g_bytes_unref(bytes);
+    return named_dests;
+}
+
+/* -1 if the document cannot be loaded */
+int render_worker_page_count(guint serial, GBytes *document)
+{
+    struct _RenderWorker *worker;
+    gint pages = -1;
+    int ret;
+
+    if (!render_worker_enabled())
+        return -1;
+
+    worker = _render_worker_acquire();
+    if ((ret = _render_worker_load(worker, serial, document, &pages)) != 0) {
+        pages = -1;
+        if (ret != 3) {
+            fprintf(stderr, "render worker %s loading the document, restarting\n",
+                    ret == 2 ? "timed out" : "failed");
+            _render_worker_stop(worker);
+            _render_worker_spawn(worker);
+        }
+    }
+    _render_worker_release(worker);
+
+    return pages;
+}
+
+int _render_worker_spawn(struct _RenderWorker *worker)
+{
+    GSubprocessLauncher *launcher;
+    GError *error = NULL;
+    int sv[2];
+    const gchar *argv[] = { "/proc/self/exe", RENDER_WORKER_ARGUMENT, NULL };
+
+    worker->process = NULL;
+    worker->fd = -1;
+    memset(worker->serials, 0, sizeof(worker->serials));
+    worker->next_slot = 0;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        fprintf(stderr, "could not create socket for render worker\n");
+        return 1;
+    }
+
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+    g_subprocess_launcher_take_fd(launcher, sv[1], 3);
+    worker->process = g_subprocess_launcher_spawnv(launcher, argv, &error);
+    g_object_unref(launcher);
+
+    if (worker->process == NULL) {
+        fprintf(stderr, "could not start render worker: %s\n", error ? error->message : "");
+        if (error)
+            g_error_free(error);
+        close(sv[0]);
+        return 1;
+    }
+    worker->fd = sv[0];
+
+    return 0;
+}
+
+void _render_worker_stop(struct _RenderWorker *worker)
+{
+    if (worker->process) {
+        g_subprocess_force_exit(worker->process);
+        g_subprocess_wait(worker->process, NULL, NULL);
+        g_object_unref(worker->process);
+        worker->process = NULL;
+    }
+    if (worker->fd >= 0)
+        close(worker->fd);
+    worker->fd = -1;
+    memset(worker->serials, 0, sizeof(worker->serials));
+}
+
+/* memfd with a copy of data, -1 on error */
+int _render_worker_memfd(const gchar *name, const guchar *data, gsize length)
+{
+    gsize written;
+    gssize ret;
+    int fd;
+
+    if ((fd = memfd_create(name, MFD_CLOEXEC)) < 0)
+        return -1;
+    for (written = 0; written < length; written += ret) {
+        if ((ret = write(fd, data + written, length - written)) <= 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* memfd with the contents of the document, the caller has to close it */
+int _render_worker_document_fd(guint serial, GBytes *document, gsize *size)
+{
+    struct _RenderWorkerDocument *doc = NULL;
+    const guchar *data;
+    gsize length;
+    int fd = -1;
+    unsigned int i;
+
+    g_mutex_lock(&_render_worker.document_lock);
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++) {
+        if (_render_worker.documents[i].fd >= 0 && _render_worker.documents[i].serial == serial) {
+            doc = &_render_worker.documents[i];
+            break;
+        }
+    }
+    if (doc == NULL) {
+        /* replace the least recently used document */
+        doc = &_render_worker.documents[0];
+        for (i = 1; i < RENDER_WORKER_DOCUMENTS; i++) {
+            if (_render_worker.documents[i].last_used < doc->last_used)
+                doc = &_render_worker.documents[i];
+        }
+        if (doc->fd >= 0)
+            close(doc->fd);
+        data = g_bytes_get_data(document, &length);
+        doc->fd = _render_worker_memfd("pdfpresent-document", data, length);
+        doc->serial = serial;
+        doc->size = length;
+    }
+    if (doc->fd >= 0) {
+        doc->last_used = ++_render_worker.document_uses;
+        fd = dup(doc->fd);
+        if (size)
+            *size = doc->size;
+    }
+    g_mutex_unlock(&_render_worker.document_lock);
+
+    return fd;
+}
+
+/* whether the document is still in shared memory */
+gboolean _render_worker_document_live(guint serial)
+{
+    gboolean live = FALSE;
+    unsigned int i;
+
+    g_mutex_lock(&_render_worker.document_lock);
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS && !live; i++)
+        live = (_render_worker.documents[i].fd >= 0 && _render_worker.documents[i].serial == serial);
+    g_mutex_unlock(&_render_worker.document_lock);
+
+    return live;
+}
+
+/* the document will not be asked for again, its slots may be reused */
+void render_worker_forget(guint serial)
+{
+    unsigned int i;
+
+    if (!render_worker_enabled())
+        return;
+
+    g_mutex_lock(&_render_worker.document_lock);
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++) {
+        if (_render_worker.documents[i].fd >= 0 && _render_worker.documents[i].serial == serial) {
+            close(_render_worker.documents[i].fd);
+            _render_worker.documents[i].fd = -1;
+            _render_worker.documents[i].last_used = 0;
+        }
+    }
+    g_mutex_unlock(&_render_worker.document_lock);
+}
+
+int _render_worker_send(int fd, gpointer msg, gsize len, int payload)
+{
+    struct msghdr hdr;
+    struct iovec iov = { msg, len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+
+    memset(&hdr, 0, sizeof(struct msghdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    if (payload >= 0) {
+        memset(&control, 0, sizeof(control));
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &payload, sizeof(int));
+    }
+
+    /* a dead peer must not take us down with SIGPIPE */
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) != (gssize)len)
+        return 1;
+    return 0;
+}
+
+/* returns 0 on success, 1 on error or closed socket and 2 on timeout */
+int _render_worker_receive(int fd, gpointer msg, gsize len, int *payload, int timeout)
+{
+    struct msghdr hdr;
+    struct iovec iov = { msg, len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ret;
+
+    if (payload)
+        *payload = -1;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0)
+        return 2;
+    if (ret < 0)
+        return 1;
+
+    memset(&hdr, 0, sizeof(struct msghdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC) != (gssize)len)
+        return 1;
+
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            if (payload)
+                memcpy(payload, CMSG_DATA(cmsg), sizeof(int));
+            else
+                close(*(int *)CMSG_DATA(cmsg));
+        }
+    }
+
+    return 0;
+}
+
+struct _RenderWorkerMapping *_render_worker_map(int fd, gsize size, int prot)
+{
+    struct _RenderWorkerMapping *mapping;
+    void *data;
+
+    data = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    mapping = g_malloc(sizeof(struct _RenderWorkerMapping));
+    mapping->data = data;
+    mapping->size = size;
+    return mapping;
+}
+
+void _render_worker_unmap(struct _RenderWorkerMapping *mapping)
+{
+    if (mapping == NULL)
+        return;
+    munmap(mapping->data, mapping->size);
+    g_free(mapping);
+}
+
+/* full size surface from a low resolution rendering, blank if there is none */
+cairo_surface_t *_render_worker_scale_surface(cairo_surface_t *surf, unsigned int width, unsigned int height)
+{
+    cairo_surface_t *result;
+    cairo_t *cr;
+
+    result = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(result);
+        return NULL;
+    }
+
+    cr = cairo_create(result);
+    cairo_set_source_rgb(cr, 1.0f, 1.0f, 1.0f);
+    cairo_paint(cr);
+    if (surf) {
+        cairo_scale(cr, ((double)width) / cairo_image_surface_get_width(surf),
+                    ((double)height) / cairo_image_surface_get_height(surf));
+        cairo_set_source_surface(cr, surf, 0.0f, 0.0f);
+        cairo_paint(cr);
+    }
+    cairo_destroy(cr);
+
+    return result;
+}
+
+/* worker side */
+
+int render_worker_main(int fd)
+{
+    struct _RenderWorkerRequest req;
+    struct _RenderWorkerReply reply;
+    struct _RenderWorkerMapping *mapping;
+    struct _RenderWorkerLoaded loaded[RENDER_WORKER_DOCUMENTS];
+    struct _RenderWorkerLoaded *slot;
+    PopplerDocument *doc;
+    GBytes *bytes;
+    int payload, result, ret;
+    unsigned int i;
+
+    memset(loaded, 0, sizeof(loaded));
+
+    while (_render_worker_receive(fd, &req, sizeof(req), &payload, -1) == 0) {
+        memset(&reply, 0, sizeof(struct _RenderWorkerReply));
+        reply.type = req.type;
+        reply.status = 1;
+        result = -1;
+
+        if (req.type == RENDER_WORKER_LOAD && payload >= 0 &&
+                req.index >= 0 && req.index < RENDER_WORKER_DOCUMENTS) {
+            slot = &loaded[req.index];
+            if (slot->doc)
+                g_object_unref(slot->doc);
+            slot->doc = NULL;
+            slot->serial = 0;
+            if ((mapping = _render_worker_map(payload, req.size, PROT_READ)) != NULL) {
+                bytes = g_bytes_new_with_free_func(mapping->data, mapping->size,
+                                                   (GDestroyNotify)_render_worker_unmap, mapping);
+                slot->doc = poppler_document_new_from_bytes(bytes, NULL, NULL);
+                g_bytes_unref(bytes);
+            }
+            if (slot->doc) {
+                slot->serial = req.serial;
+                reply.pages = poppler_document_get_n_pages(slot->doc);
+                reply.status = 0;
+            }
+        }
+        else if ((doc = _render_worker_find_document(loaded, req.serial)) == NULL) {
+            /* not loaded, status stays an error */
+        }
+        else if (req.type == RENDER_WORKER_RENDER && payload >= 0) {
+            reply.status = _render_worker_render_page(doc, &req, payload);
+        }
+        else if (req.type == RENDER_WORKER_INFO) {
+            reply.status = _render_worker_page_info(doc, &req, &reply, &result);
+        }
+
+        if (payload >= 0)
+            close(payload);
+        ret = _render_worker_send(fd, &reply, sizeof(reply), result);
+        if (result >= 0)
+            close(result);
+        if (ret != 0)
+            break;
+    }
+
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++) {
+        if (loaded[i].doc)
+            g_object_unref(loaded[i].doc);
+    }
+    close(fd);
+
+    return 0;
+}
+
+PopplerDocument *_render_worker_find_document(struct _RenderWorkerLoaded *loaded, guint serial)
+{
+    unsigned int i;
+    for (i = 0; i < RENDER_WORKER_DOCUMENTS; i++) {
+        if (loaded[i].doc && loaded[i].serial == serial)
+            return loaded[i].doc;
+    }
+    return NULL;
+}
+
+/* the serialized info goes into a new memfd in payload */
+int _render_worker_page_info(PopplerDocument *doc, struct _RenderWorkerRequest *req,
+                             struct _RenderWorkerReply *reply, int *payload)
+{
+    GHashTable *named_dests;
+    PopplerPage *page;
+    PageInfo info;
+    GBytes *bytes;
+    const guchar *data;
+    gsize size;
+
+    if (req->index < 0) {
+        named_dests = page_info_read_named_dests(doc);
+        bytes = page_info_serialize_named_dests(named_dests);
+        g_hash_table_destroy(named_dests);
+    }
+    else {
+        if ((page = poppler_document_get_page(doc, req->index)) == NULL)
+            return 1;
+        page_info_read(page, req->flags, &info);
+        g_object_unref(page);
+        bytes = page_info_serialize(&info);
+        page_info_clear(&info);
+    }
+
+    data = g_bytes_get_data(bytes, &size);
+    *payload = _render_worker_memfd("pdfpresent-info", data, size);
+    reply->size = size;
+    g_bytes_unref(bytes);
+
+    return *payload >= 0 ? 0 : 1;
+}
+
+int _render_worker_render_page(PopplerDocument *doc, struct _RenderWorkerRequest *req, int fd)
+{
+    struct _RenderWorkerMapping *mapping;
+    PopplerPage *page;
+    cairo_surface_t *surf;
+    cairo_t *c;
+
+    if ((page = poppler_document_get_page(doc, req->index)) == NULL)
+        return 1;
+    if ((mapping = _render_worker_map(fd, req->size, PROT_READ | PROT_WRITE)) == NULL) {
+        g_object_unref(page);
+        return 1;
+    }
+
+    surf = cairo_image_surface_create_for_data(mapping->data, CAIRO_FORMAT_ARGB32,
+                                               req->width, req->height, req->stride);
+    c = cairo_create(surf);
+
+    cairo_scale(c, req->scale, req->scale);
+
+    cairo_set_source_rgb(c, 1.0f, 1.0f, 1.0f);
+    cairo_rectangle(c, 0, 0, req->width / req->scale, req->height / req->scale);
+    cairo_fill(c);
+
+    poppler_page_render(page, c);
+
+    cairo_destroy(c);
+    cairo_surface_flush(surf);
+    cairo_surface_destroy(surf);
+
+    _render_worker_unmap(mapping);
+    g_object_unref(page);
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __RENDER_WORKER_H__
+#define __RENDER_WORKER_H__
+
+#include <glib.h>
+#include <cairo.h>
+#include "page-info.h"
+
+/* argument the presenter is started with to run as a render worker */
+#define RENDER_WORKER_ARGUMENT "--render-worker"
+
+int render_worker_init(unsigned int count);
+void render_worker_cleanup(void);
+gboolean render_worker_enabled(void);
+
+/* document is identified by serial, bytes are only sent if the worker does not have it yet */
+int render_worker_render(guint serial, GBytes *document, int index, double scale,
+                         unsigned int width, unsigned int height, cairo_surface_t **surf);
+/* like the in process poppler calls, so the presenter never parses the document itself */
+int render_worker_page_count(guint serial, GBytes *document);
+int render_worker_page_info(guint serial, GBytes *document, int index, guint flags, PageInfo *info);
+GHashTable *render_worker_named_dests(guint serial, GBytes *document);
+/* called once a document is freed */
+void render_worker_forget(guint serial);
+
+/* entry point of the worker process, fd is the socket to the presenter */
+int render_worker_main(int fd);
+
+#endif
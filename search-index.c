@@ -0,0 +1,415 @@
+#include "search-index.h"
+#include <string.h>
+
+struct _SearchIndexBuilder {
+    GHashTable *terms;          /* term -> GArray of word ids */
+    GArray *words;              /* SearchHit of every word */
+    GArray *word_pages;         /* page of every word */
+};
+
+struct _SearchIndex {
+    guint n_terms;
+    gchar *term_data;           /* sorted terms, zero terminated */
+    guint32 *term_offsets;
+    guint32 *posting_offsets;   /* n_terms + 1 entries into postings */
+    guint32 *postings;          /* word ids, ascending for every term */
+    SearchHit *words;
+    guint32 *word_pages;
+};
+
+/* postings of one term, from the next word id on */
+struct _SearchRun {
+    const guint32 *pos;
+    const guint32 *end;
+};
+
+/* Merges the postings of all terms with a prefix lazily: a min-heap of runs
+ * keyed by their next word id. Runs that are used up are dropped, so the
+ * smallest id is at runs[0] as long as n_runs > 0. */
+struct _SearchCursor {
+    struct _SearchRun *runs;
+    guint n_runs;
+};
+
+gchar *_search_index_next_word(const gchar **text, glong *char_index, glong *start, glong *end);
+gchar *_search_index_normalize(const gchar *word, gssize length);
+void _search_index_free_postings(GArray *postings);
+gint _search_index_compare_terms(gconstpointer a, gconstpointer b);
+const gchar *_search_index_term(SearchIndex *index, guint term);
+void _search_index_lookup(SearchIndex *index, const gchar *prefix, struct _SearchCursor *cursor);
+void _search_cursor_sift_down(struct _SearchCursor *cursor, guint i);
+void _search_cursor_advance(struct _SearchCursor *cursor);
+void _search_cursor_skip_to_page(SearchIndex *index, struct _SearchCursor *cursor, guint page);
+void _search_cursor_clear(struct _SearchCursor *cursor);
+
+gchar *_search_index_normalize(const gchar *word, gssize length)
+{
+    gchar *normalized = g_utf8_normalize(word, length, G_NORMALIZE_ALL_COMPOSE);
+    gchar *folded;
+    if (!normalized)
+        return NULL;
+    folded = g_utf8_casefold(normalized, -1);
+    g_free(normalized);
+    return folded;
+}
+
+/* returns the next run of alphanumeric characters, char_index counts characters
+ * to match the boxes from the text layout */
+gchar *_search_index_next_word(const gchar **text, glong *char_index, glong *start, glong *end)
+{
+    const gchar *p = *text;
+    const gchar *word = NULL;
+    gunichar c;
+
+    while (*p) {
+        c = g_utf8_get_char_validated(p, -1);
+        if (c == (gunichar)-1 || c == (gunichar)-2)
+            break;
+        if (g_unichar_isalnum(c)) {
+            if (!word) {
+                word = p;
+                *start = *char_index;
+            }
+        }
+        else if (word) {
+            break;
+        }
+        p = g_utf8_next_char(p);
+        (*char_index)++;
+    }
+
+    *text = p;
+    if (!word)
+        return NULL;
+    *end = *char_index;
+    if (*p)
+        *text = g_utf8_next_char(p);
+    (*char_index)++;
+    return _search_index_normalize(word, p - word);
+}
+
+void _search_index_free_postings(GArray *postings)
+{
+    g_array_free(postings, TRUE);
+}
+
+SearchIndexBuilder *search_index_builder_new(void)
+{
+    SearchIndexBuilder *builder = g_malloc0(sizeof(SearchIndexBuilder));
+    builder->terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)_search_index_free_postings);
+    builder->words = g_array_new(FALSE, FALSE, sizeof(SearchHit));
+    builder->word_pages = g_array_new(FALSE, FALSE, sizeof(guint32));
+    return builder;
+}
+
+void search_index_builder_free(SearchIndexBuilder *builder)
+{
+    if (!builder)
+        return;
+    g_hash_table_destroy(builder->terms);
+    g_array_free(builder->words, TRUE);
+    g_array_free(builder->word_pages, TRUE);
+    g_free(builder);
+}
+
+void search_index_builder_add_page(SearchIndexBuilder *builder, guint page, const gchar *text,
+                                   PopplerRectangle *rects, guint n_rects, double width, double height)
+{
+    const gchar *pos = text;
+    glong char_index = 0, start, end, i;
+    gchar *term;
+    GArray *postings;
+    SearchHit hit;
+    guint32 id, page32 = page;
+
+    if (!builder || !text || width <= 0.0 || height <= 0.0)
+        return;
+
+    while ((term = _search_index_next_word(&pos, &char_index, &start, &end)) != NULL) {
+        if (start >= (glong)n_rects) {
+            g_free(term);
+            break;
+        }
+        hit.x1 = hit.y1 = G_MAXFLOAT;
+        hit.x2 = hit.y2 = -G_MAXFLOAT;
+        for (i = start; i < end && i < (glong)n_rects; i++) {
+            hit.x1 = MIN(hit.x1, rects[i].x1 / width);
+            hit.y1 = MIN(hit.y1, rects[i].y1 / height);
+            hit.x2 = MAX(hit.x2, rects[i].x2 / width);
+            hit.y2 = MAX(hit.y2, rects[i].y2 / height);
+        }
+
+        id = builder->words->len;
+        g_array_append_val(builder->words, hit);
+        g_array_append_val(builder->word_pages, page32);
+
+        postings = g_hash_table_lookup(builder->terms, term);
+        if (postings) {
+            g_free(term);
+        }
+        else {
+            postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+            g_hash_table_insert(builder->terms, term, postings);
+        }
+        g_array_append_val(postings, id);
+    }
+}
+
+gint _search_index_compare_terms(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+SearchIndex *search_index_builder_finish(SearchIndexBuilder *builder)
+{
+    SearchIndex *index;
+    GPtrArray *terms;
+    GHashTableIter iter;
+    gpointer key;
+    GArray *postings;
+    GString *term_data;
+    guint i, n_postings = 0;
+
+    if (!builder)
+        return NULL;
+
+    terms = g_ptr_array_sized_new(g_hash_table_size(builder->terms));
+    g_hash_table_iter_init(&iter, builder->terms);
+    while (g_hash_table_iter_next(&iter, &key, (gpointer *)&postings)) {
+        g_ptr_array_add(terms, key);
+        n_postings += postings->len;
+    }
+    g_ptr_array_sort(terms, _search_index_compare_terms);
+
+    index = g_malloc0(sizeof(SearchIndex));
+    index->n_terms = terms->len;
+    index->term_offsets = g_malloc(sizeof(guint32) * (terms->len + 1));
+    index->posting_offsets = g_malloc(sizeof(guint32) * (terms->len + 1));
+    index->postings = g_malloc(sizeof(guint32) * (n_postings + 1));
+    term_data = g_string_new(NULL);
+
+    n_postings = 0;
+    for (i = 0; i < terms->len; i++) {
+        postings = g_hash_table_lookup(builder->terms, g_ptr_array_index(terms, i));
+        index->term_offsets[i] = term_data->len;
+        g_string_append_len(term_data, g_ptr_array_index(terms, i),
+                            strlen(g_ptr_array_index(terms, i)) + 1);
+        index->posting_offsets[i] = n_postings;
+        memcpy(&index->postings[n_postings], postings->data, sizeof(guint32) * postings->len);
+        n_postings += postings->len;
+    }
+    index->posting_offsets[terms->len] = n_postings;
+    index->term_data = g_string_free(term_data, FALSE);
+
+    index->words = (SearchHit *)g_array_free(builder->words, FALSE);
+    index->word_pages = (guint32 *)g_array_free(builder->word_pages, FALSE);
+    builder->words = NULL;
+    builder->word_pages = NULL;
+
+    g_ptr_array_free(terms, TRUE);
+    g_hash_table_destroy(builder->terms);
+    g_free(builder);
+
+    return index;
+}
+
+void search_index_free(SearchIndex *index)
+{
+    if (!index)
+        return;
+    g_free(index->term_data);
+    g_free(index->term_offsets);
+    g_free(index->posting_offsets);
+    g_free(index->postings);
+    g_free(index->words);
+    g_free(index->word_pages);
+    g_free(index);
+}
+
+const gchar *_search_index_term(SearchIndex *index, guint term)
+{
+    return &index->term_data[index->term_offsets[term]];
+}
+
+/* cursor over the word ids of all terms starting with prefix, ascending */
+void _search_index_lookup(SearchIndex *index, const gchar *prefix, struct _SearchCursor *cursor)
+{
+    gsize length = strlen(prefix);
+    guint lo = 0, hi = index->n_terms, mid, first, last;
+
+    /* first term not smaller than prefix */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(_search_index_term(index, mid), prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+
+    /* terms with this prefix follow directly */
+    hi = index->n_terms;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strncmp(_search_index_term(index, mid), prefix, length) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    last = lo;
+
+    cursor->runs = g_malloc(sizeof(struct _SearchRun) * MAX(last - first, 1));
+    cursor->n_runs = 0;
+    for (mid = first; mid < last; mid++) {
+        if (index->posting_offsets[mid + 1] == index->posting_offsets[mid])
+            continue;
+        cursor->runs[cursor->n_runs].pos = &index->postings[index->posting_offsets[mid]];
+        cursor->runs[cursor->n_runs].end = &index->postings[index->posting_offsets[mid + 1]];
+        cursor->n_runs++;
+    }
+    for (mid = cursor->n_runs / 2; mid-- > 0;)
+        _search_cursor_sift_down(cursor, mid);
+}
+
+void _search_cursor_sift_down(struct _SearchCursor *cursor, guint i)
+{
+    struct _SearchRun run = cursor->runs[i];
+    guint child;
+
+    while ((child = 2 * i + 1) < cursor->n_runs) {
+        if (child + 1 < cursor->n_runs && *cursor->runs[child + 1].pos < *cursor->runs[child].pos)
+            child++;
+        if (*run.pos <= *cursor->runs[child].pos)
+            break;
+        cursor->runs[i] = cursor->runs[child];
+        i = child;
+    }
+    cursor->runs[i] = run;
+}
+
+/* moves past the smallest word id */
+void _search_cursor_advance(struct _SearchCursor *cursor)
+{
+    if (++cursor->runs[0].pos == cursor->runs[0].end) {
+        if (--cursor->n_runs == 0)
+            return;
+        cursor->runs[0] = cursor->runs[cursor->n_runs];
+    }
+    _search_cursor_sift_down(cursor, 0);
+}
+
+/* Drops all word ids on pages before page. Pages ascend with the ids, so
+ * every run that is behind is moved with one binary search. */
+void _search_cursor_skip_to_page(SearchIndex *index, struct _SearchCursor *cursor, guint page)
+{
+    const guint32 *lo, *hi, *mid;
+
+    while (cursor->n_runs > 0 && index->word_pages[*cursor->runs[0].pos] < page) {
+        lo = cursor->runs[0].pos;
+        hi = cursor->runs[0].end;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (index->word_pages[*mid] < page)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cursor->runs[0].pos = lo;
+        if (lo == cursor->runs[0].end) {
+            if (--cursor->n_runs == 0)
+                return;
+            cursor->runs[0] = cursor->runs[cursor->n_runs];
+        }
+        _search_cursor_sift_down(cursor, 0);
+    }
+}
+
+void _search_cursor_clear(struct _SearchCursor *cursor)
+{
+    g_free(cursor->runs);
+    cursor->runs = NULL;
+    cursor->n_runs = 0;
+}
+
+/* The postings of the matching terms are merged as the pages are walked, so
+ * a query stops touching them once max_results pages are found. */
+GArray *search_index_query(SearchIndex *index, const gchar *query, guint max_results)
+{
+    GArray *results = g_array_new(FALSE, FALSE, sizeof(SearchResult));
+    GArray *cursors, *hits;
+    struct _SearchCursor *cursor;
+    const gchar *pos = query;
+    glong char_index = 0, start, end;
+    gchar *term;
+    guint i, page;
+    gboolean agree;
+    SearchResult result;
+
+    if (!index || !query)
+        return results;
+
+    cursors = g_array_new(FALSE, TRUE, sizeof(struct _SearchCursor));
+    while ((term = _search_index_next_word(&pos, &char_index, &start, &end)) != NULL) {
+        g_array_set_size(cursors, cursors->len + 1);
+        cursor = &g_array_index(cursors, struct _SearchCursor, cursors->len - 1);
+        _search_index_lookup(index, term, cursor);
+        g_free(term);
+        if (cursor->n_runs == 0)
+            goto done;
+    }
+    if (cursors->len == 0)
+        goto done;
+
+    /* word ids ascend with the page, so all words are walked once in page order */
+    while (results->len < max_results) {
+        page = 0;
+        for (i = 0; i < cursors->len; i++) {
+            cursor = &g_array_index(cursors, struct _SearchCursor, i);
+            if (cursor->n_runs == 0)
+                goto done;
+            page = MAX(page, index->word_pages[*cursor->runs[0].pos]);
+        }
+
+        agree = TRUE;
+        for (i = 0; i < cursors->len; i++) {
+            cursor = &g_array_index(cursors, struct _SearchCursor, i);
+            _search_cursor_skip_to_page(index, cursor, page);
+            if (cursor->n_runs == 0)
+                goto done;
+            if (index->word_pages[*cursor->runs[0].pos] != page)
+                agree = FALSE;
+        }
+        if (!agree)
+            continue;
+
+        hits = g_array_new(FALSE, FALSE, sizeof(SearchHit));
+        for (i = 0; i < cursors->len; i++) {
+            cursor = &g_array_index(cursors, struct _SearchCursor, i);
+            while (cursor->n_runs > 0 && index->word_pages[*cursor->runs[0].pos] == page) {
+                g_array_append_val(hits, index->words[*cursor->runs[0].pos]);
+                _search_cursor_advance(cursor);
+            }
+        }
+        result.page = page;
+        result.hit_count = hits->len;
+        result.hits = (SearchHit *)g_array_free(hits, FALSE);
+        g_array_append_val(results, result);
+    }
+
+done:
+    for (i = 0; i < cursors->len; i++)
+        _search_cursor_clear(&g_array_index(cursors, struct _SearchCursor, i));
+    g_array_free(cursors, TRUE);
+    return results;
+}
+
+void search_results_free(GArray *results)
+{
+    guint i;
+    if (!results)
+        return;
+    for (i = 0; i < results->len; i++)
+        g_free(g_array_index(results, SearchResult, i).hits);
+    g_array_free(results, TRUE);
+}
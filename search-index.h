@@ -0,0 +1,38 @@
+#ifndef __SEARCH_INDEX_H__
+#define __SEARCH_INDEX_H__
+
+#include <glib.h>
+#include <poppler.h>
+
+/* Inverted index over the words of a document. Terms are kept sorted, so
+ * a lookup is a binary search and only touches the postings of matching words. */
+typedef struct _SearchIndex SearchIndex;
+typedef struct _SearchIndexBuilder SearchIndexBuilder;
+
+/* word box relative to the page size, origin at the top left */
+typedef struct _SearchHit {
+    gfloat x1, y1, x2, y2;
+} SearchHit;
+
+typedef struct _SearchResult {
+    guint page;
+    guint hit_count;
+    SearchHit *hits;
+} SearchResult;
+
+SearchIndexBuilder *search_index_builder_new(void);
+void search_index_builder_free(SearchIndexBuilder *builder);
+/* pages have to be added in order; rects is one box per character of text */
+void search_index_builder_add_page(SearchIndexBuilder *builder, guint page, const gchar *text,
+                                   PopplerRectangle *rects, guint n_rects, double width, double height);
+/* consumes the builder */
+SearchIndex *search_index_builder_finish(SearchIndexBuilder *builder);
+
+void search_index_free(SearchIndex *index);
+
+/* every word of query matches as prefix, pages have to contain all of them;
+ * returns an array of SearchResult in page order */
+GArray *search_index_query(SearchIndex *index, const gchar *query, guint max_results);
+void search_results_free(GArray *results);
+
+#endif
@@ -0,0 +1,341 @@
+#include "transition.h"
+#include "jobs.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* the caller composes one band itself, the render threads the others */
+#define TRANSITION_BANDS            4
+/* stripes of a blinds transition */
+#define TRANSITION_BLINDS           6
+#define TRANSITION_MAX_RECTS        (TRANSITION_BLINDS + 1)
+
+/* copy of source, frame pixel (x, y) is source pixel (x - ox, y - oy) */
+struct _TransitionRect {
+    cairo_surface_t *source;
+    int x, y, width, height;
+    int ox, oy;
+};
+
+struct _TransitionBand {
+    Transition *transition;
+    int y0, y1;
+    gint done;
+};
+
+struct _Transition {
+    PopplerPageTransitionType type;
+    PopplerPageTransitionAlignment alignment;
+    PopplerPageTransitionDirection direction;
+    int angle;
+    gint64 start_time;
+    gint64 duration;
+    gint64 last_frame_time;
+    guint missed;
+    cairo_surface_t *from;
+    cairo_surface_t *to;
+    cairo_surface_t *frame;
+    int width, height;
+    /* layout of the current frame; blend >= 0 mixes both pages instead */
+    int blend;
+    guint n_rects;
+    struct _TransitionRect rects[TRANSITION_MAX_RECTS];
+    struct _TransitionBand bands[TRANSITION_BANDS];
+};
+
+void _transition_layout(Transition *transition, double progress);
+void _transition_add(Transition *transition, cairo_surface_t *source, int x, int y, int width, int height,
+                     int ox, int oy);
+void _transition_compose_band(Transition *transition, int y0, int y1);
+void _transition_band_job(Job *job, gpointer data);
+void _transition_blend_row(guint32 *dst, const guint32 *a, const guint32 *b, int n, guint alpha);
+
+Transition *transition_new(PopplerPageTransition *trans, cairo_surface_t *from, cairo_surface_t *to,
+                           gint64 start_time)
+{
+    Transition *transition;
+    double duration;
+
+    if (!trans || trans->type == POPPLER_PAGE_TRANSITION_REPLACE || !from || !to)
+        return NULL;
+    if (cairo_image_surface_get_format(from) != CAIRO_FORMAT_RGB24 ||
+            cairo_image_surface_get_format(to) != CAIRO_FORMAT_RGB24 ||
+            cairo_image_surface_get_width(from) != cairo_image_surface_get_width(to) ||
+            cairo_image_surface_get_height(from) != cairo_image_surface_get_height(to))
+        return NULL;
+
+    /* the PDF default is one second */
+    duration = trans->duration_real > 0.0 ? trans->duration_real : 1.0;
+
+    transition = g_malloc0(sizeof(Transition));
+    transition->type = trans->type;
+    transition->alignment = trans->alignment;
+    transition->direction = trans->direction;
+    transition->angle = ((trans->angle % 360) + 360) % 360;
+    transition->start_time = start_time;
+    transition->duration = (gint64)(duration * G_USEC_PER_SEC);
+    transition->from = cairo_surface_reference(from);
+    transition->to = cairo_surface_reference(to);
+    transition->width = cairo_image_surface_get_width(from);
+    transition->height = cairo_image_surface_get_height(from);
+    transition->frame = cairo_image_surface_create(CAIRO_FORMAT_RGB24, transition->width, transition->height);
+
+    cairo_surface_flush(from);
+    cairo_surface_flush(to);
+
+    return transition;
+}
+
+void transition_free(Transition *transition)
+{
+    if (!transition)
+        return;
+    cairo_surface_destroy(transition->from);
+    cairo_surface_destroy(transition->to);
+    cairo_surface_destroy(transition->frame);
+    g_free(transition);
+}
+
+cairo_surface_t *transition_get_surface(Transition *transition)
+{
+    return transition ? transition->frame : NULL;
+}
+
+guint transition_get_missed(Transition *transition)
+{
+    return transition ? transition->missed : 0;
+}
+
+gboolean transition_step(Transition *transition, gint64 frame_time, gint64 refresh_interval)
+{
+    Job *jobs[TRANSITION_BANDS];
+    struct _TransitionBand *band;
+    double progress;
+    gint64 gap;
+    int i;
+
+    if (!transition)
+        return FALSE;
+
+    if (transition->last_frame_time && refresh_interval > 0) {
+        gap = frame_time - transition->last_frame_time;
+        if (gap > refresh_interval * 3 / 2)
+            transition->missed += (guint)((gap + refresh_interval / 2) / refresh_interval) - 1;
+    }
+    transition->last_frame_time = frame_time;
+
+    progress = (double)(frame_time - transition->start_time) / transition->duration;
+    progress = CLAMP(progress, 0.0, 1.0);
+    _transition_layout(transition, progress);
+
+    cairo_surface_flush(transition->frame);
+    for (i = 0; i < TRANSITION_BANDS; i++) {
+        band = &transition->bands[i];
+        band->transition = transition;
+        band->y0 = transition->height * i / TRANSITION_BANDS;
+        band->y1 = transition->height * (i + 1) / TRANSITION_BANDS;
+        band->done = 0;
+    }
+    for (i = 1; i < TRANSITION_BANDS; i++)
+        jobs[i] = jobs_submit(JOB_PRIORITY_RENDER, 0, NULL, _transition_band_job, &transition->bands[i], NULL);
+    _transition_band_job(NULL, &transition->bands[0]);
+    for (i = 1; i < TRANSITION_BANDS; i++) {
+        job_wait(jobs[i]);
+        job_unref(jobs[i]);
+        /* not run if the scheduler is shutting down */
+        if (!g_atomic_int_get(&transition->bands[i].done))
+            _transition_band_job(NULL, &transition->bands[i]);
+    }
+    cairo_surface_mark_dirty(transition->frame);
+
+    return progress < 1.0;
+}
+
+void _transition_band_job(Job *job, gpointer data)
+{
+    struct _TransitionBand *band = data;
+    _transition_compose_band(band->transition, band->y0, band->y1);
+    g_atomic_int_set(&band->done, 1);
+}
+
+/* rect on the frame, clipped to it */
+void _transition_add(Transition *transition, cairo_surface_t *source, int x, int y, int width, int height,
+                     int ox, int oy)
+{
+    struct _TransitionRect *rect;
+    int x2 = MIN(x + width, transition->width);
+    int y2 = MIN(y + height, transition->height);
+
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (x >= x2 || y >= y2 || transition->n_rects >= TRANSITION_MAX_RECTS)
+        return;
+
+    rect = &transition->rects[transition->n_rects++];
+    rect->source = source;
+    rect->x = x;
+    rect->y = y;
+    rect->width = x2 - x;
+    rect->height = y2 - y;
+    rect->ox = ox;
+    rect->oy = oy;
+}
+
+void _transition_layout(Transition *transition, double progress)
+{
+    int w = transition->width, h = transition->height;
+    int pw = (int)(progress * w + 0.5), ph = (int)(progress * h + 0.5);
+    int dx = 0, dy = 0, sx, sy, stripe, i;
+    gboolean horizontal = transition->alignment == POPPLER_PAGE_TRANSITION_HORIZONTAL;
+    gboolean outward = transition->direction == POPPLER_PAGE_TRANSITION_OUTWARD;
+
+    transition->n_rects = 0;
+    transition->blend = -1;
+
+    /* angle is the direction of motion, counterclockwise from left to right */
+    switch (((transition->angle + 45) / 90) % 4) {
+        case 0: dx = 1; break;
+        case 1: dy = -1; break;
+        case 2: dx = -1; break;
+        case 3: dy = 1; break;
+    }
+
+    switch (transition->type) {
+        case POPPLER_PAGE_TRANSITION_WIPE:
+            _transition_add(transition, transition->from, 0, 0, w, h, 0, 0);
+            _transition_add(transition, transition->to,
+                            dx < 0 ? w - pw : 0, dy < 0 ? h - ph : 0,
+                            dx ? pw : w, dy ? ph : h, 0, 0);
+            break;
+        case POPPLER_PAGE_TRANSITION_PUSH:
+            sx = dx * pw;
+            sy = dy * ph;
+            _transition_add(transition, transition->from, sx, sy, w, h, sx, sy);
+            _transition_add(transition, transition->to, sx - dx * w, sy - dy * h, w, h,
+                            sx - dx * w, sy - dy * h);
+            break;
+        case POPPLER_PAGE_TRANSITION_COVER:
+        case POPPLER_PAGE_TRANSITION_FLY:
+            sx = dx * pw - dx * w;
+            sy = dy * ph - dy * h;
+            _transition_add(transition, transition->from, 0, 0, w, h, 0, 0);
+            _transition_add(transition, transition->to, sx, sy, w, h, sx, sy);
+            break;
+        case POPPLER_PAGE_TRANSITION_UNCOVER:
+            sx = dx * pw;
+            sy = dy * ph;
+            _transition_add(transition, transition->to, 0, 0, w, h, 0, 0);
+            _transition_add(transition, transition->from, sx, sy, w, h, sx, sy);
+            break;
+        case POPPLER_PAGE_TRANSITION_SPLIT:
+            if (outward) {
+                _transition_add(transition, transition->from, 0, 0, w, h, 0, 0);
+                if (horizontal)
+                    _transition_add(transition, transition->to, 0, (h - ph) / 2, w, ph, 0, 0);
+                else
+                    _transition_add(transition, transition->to, (w - pw) / 2, 0, pw, h, 0, 0);
+            }
+            else {
+                _transition_add(transition, transition->to, 0, 0, w, h, 0, 0);
+                if (horizontal)
+                    _transition_add(transition, transition->from, 0, ph / 2, w, h - ph, 0, 0);
+                else
+                    _transition_add(transition, transition->from, pw / 2, 0, w - pw, h, 0, 0);
+            }
+            break;
+        case POPPLER_PAGE_TRANSITION_BLINDS:
+            _transition_add(transition, transition->from, 0, 0, w, h, 0, 0);
+            stripe = ((horizontal ? h : w) + TRANSITION_BLINDS - 1) / TRANSITION_BLINDS;
+            for (i = 0; i < TRANSITION_BLINDS; i++) {
+                if (horizontal)
+                    _transition_add(transition, transition->to, 0, i * stripe, w,
+                                    (int)(progress * stripe + 0.5), 0, 0);
+                else
+                    _transition_add(transition, transition->to, i * stripe, 0,
+                                    (int)(progress * stripe + 0.5), h, 0, 0);
+            }
+            break;
+        case POPPLER_PAGE_TRANSITION_BOX:
+            if (outward) {
+                _transition_add(transition, transition->from, 0, 0, w, h, 0, 0);
+                _transition_add(transition, transition->to, (w - pw) / 2, (h - ph) / 2, pw, ph, 0, 0);
+            }
+            else {
+                _transition_add(transition, transition->to, 0, 0, w, h, 0, 0);
+                _transition_add(transition, transition->from, pw / 2, ph / 2, w - pw, h - ph, 0, 0);
+            }
+            break;
+        default:
+            /* dissolve, glitter and fade all mix the pages */
+            transition->blend = (int)(progress * 256 + 0.5);
+            break;
+    }
+}
+
+void _transition_compose_band(Transition *transition, int y0, int y1)
+{
+    unsigned char *dst = cairo_image_surface_get_data(transition->frame);
+    int dst_stride = cairo_image_surface_get_stride(transition->frame);
+    unsigned char *src, *from, *to;
+    int src_stride, from_stride, to_stride, y, top, bottom;
+    guint i;
+    struct _TransitionRect *rect;
+
+    if (transition->blend >= 0) {
+        from = cairo_image_surface_get_data(transition->from);
+        from_stride = cairo_image_surface_get_stride(transition->from);
+        to = cairo_image_surface_get_data(transition->to);
+        to_stride = cairo_image_surface_get_stride(transition->to);
+        for (y = y0; y < y1; y++)
+            _transition_blend_row((guint32 *)(dst + y * dst_stride),
+                                  (const guint32 *)(from + y * from_stride),
+                                  (const guint32 *)(to + y * to_stride),
+                                  transition->width, transition->blend);
+        return;
+    }
+
+    for (i = 0; i < transition->n_rects; i++) {
+        rect = &transition->rects[i];
+        top = MAX(rect->y, y0);
+        bottom = MIN(rect->y + rect->height, y1);
+        src = cairo_image_surface_get_data(rect->source);
+        src_stride = cairo_image_surface_get_stride(rect->source);
+        for (y = top; y < bottom; y++)
+            memcpy(dst + y * dst_stride + rect->x * 4,
+                   src + (y - rect->oy) * src_stride + (rect->x - rect->ox) * 4,
+                   rect->width * 4);
+    }
+}
+
+/* dst = a * (256 - alpha) / 256 + b * alpha / 256, per channel */
+void _transition_blend_row(guint32 *dst, const guint32 *a, const guint32 *b, int n, guint alpha)
+{
+    int i = 0;
+    guint32 pa, pb;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i wa = _mm_set1_epi16((short)(256 - alpha));
+    __m128i wb = _mm_set1_epi16((short)alpha);
+    __m128i va, vb, lo, hi;
+
+    /* four pixels at once, channels widened to 16 bits */
+    for (; i + 4 <= n; i += 4) {
+        va = _mm_loadu_si128((const __m128i *)(a + i));
+        vb = _mm_loadu_si128((const __m128i *)(b + i));
+        lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                           _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                           _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    /* two channels per multiplication */
+    for (; i < n; i++) {
+        pa = a[i];
+        pb = b[i];
+        dst[i] = ((((pa & 0xff00ff) * (256 - alpha) + (pb & 0xff00ff) * alpha) >> 8) & 0xff00ff) |
+                 ((((pa & 0x00ff00) * (256 - alpha) + (pb & 0x00ff00) * alpha) >> 8) & 0x00ff00);
+    }
+}
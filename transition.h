@@ -0,0 +1,24 @@
+#ifndef __TRANSITION_H__
+#define __TRANSITION_H__
+
+#include <glib.h>
+#include <cairo.h>
+#include <poppler.h>
+
+/* Page transition from the PDF, composed on the CPU from two pre-scaled
+ * pages. Frames are split into bands which run on the render threads. */
+typedef struct _Transition Transition;
+
+/* from and to are RGB24 image surfaces of the same size; returns NULL if
+ * the transition is a plain cut */
+Transition *transition_new(PopplerPageTransition *trans, cairo_surface_t *from, cairo_surface_t *to,
+                           gint64 start_time);
+void transition_free(Transition *transition);
+
+/* composes the frame for frame_time, returns FALSE once the last frame is done */
+gboolean transition_step(Transition *transition, gint64 frame_time, gint64 refresh_interval);
+cairo_surface_t *transition_get_surface(Transition *transition);
+/* frames that were due but never shown, judged by the gaps between steps */
+guint transition_get_missed(Transition *transition);
+
+#endif